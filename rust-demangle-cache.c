@@ -0,0 +1,502 @@
+#include "rust-demangle-cache.h"
+#include "rust-demangle.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef RUST_DEMANGLE_PTHREADS
+#include <pthread.h>
+#endif
+
+struct cache_entry {
+    size_t mangled_len;
+    // `CACHE_FAILED` if `mangled` couldn't be demangled.
+    size_t demangled_len;
+    // Set on every hit, and cleared by the CLOCK hand passing over the entry.
+    bool referenced;
+    // The `mangled` bytes, followed by the NUL-terminated demangling.
+    char data[];
+};
+#define CACHE_FAILED ((size_t)-1)
+
+// Open-addressing (linear probing) hash table slot, empty if `entry` is `NULL`.
+struct cache_slot {
+    uint64_t hash;
+    struct cache_entry *entry;
+};
+
+struct rust_demangle_cache {
+    int flags;
+    size_t max_bytes;
+
+    // Always a power of two, and kept at most half full.
+    struct cache_slot *slots;
+    size_t cap;
+    size_t count;
+    // Index into `slots` of the CLOCK hand.
+    size_t clock_hand;
+
+    // Entry which couldn't fit in the cache at all, returned by the latest
+    // lookup, and freed by the next one.
+    struct cache_entry *uncached;
+
+    struct rust_demangle_cache_stats stats;
+};
+
+#define CACHE_MIN_CAP 64
+
+static uint64_t fnv1a(const char *data, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+static size_t
+cache_home(const struct rust_demangle_cache *cache, uint64_t hash) {
+    return (size_t)(hash ^ (hash >> 32)) & (cache->cap - 1);
+}
+
+static size_t cache_entry_size(size_t mangled_len, size_t demangled_len) {
+    size_t size = sizeof(struct cache_entry) + mangled_len;
+    if (demangled_len != CACHE_FAILED)
+        size += demangled_len + 1;
+    return size;
+}
+
+static void cache_free_entry(
+    struct rust_demangle_cache *cache, struct cache_entry *entry
+) {
+    cache->stats.bytes -=
+        cache_entry_size(entry->mangled_len, entry->demangled_len);
+    free(entry);
+}
+
+// Empty the slot at `i`, shifting back any later entries which would then
+// become unreachable, so that no "tombstones" are needed.
+static void cache_remove_at(struct rust_demangle_cache *cache, size_t i) {
+    size_t mask = cache->cap - 1;
+    size_t j = i;
+
+    cache_free_entry(cache, cache->slots[i].entry);
+    cache->count--;
+
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!cache->slots[j].entry)
+            break;
+
+        // The entry at `j` can only move to `i` if its home isn't cyclically
+        // in `(i, j]` (i.e. if `i` is between its home and `j`).
+        size_t home = cache_home(cache, cache->slots[j].hash);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            cache->slots[i] = cache->slots[j];
+            i = j;
+        }
+    }
+
+    cache->slots[i].hash = 0;
+    cache->slots[i].entry = NULL;
+}
+
+// Evict one entry, the first one the CLOCK hand finds unreferenced.
+static void cache_evict_one(struct rust_demangle_cache *cache) {
+    for (;;) {
+        size_t i = cache->clock_hand;
+        struct cache_entry *entry = cache->slots[i].entry;
+        if (entry && !entry->referenced) {
+            // NOTE: the hand stays in place, as `cache_remove_at` may
+            // have shifted a later entry into this slot.
+            cache_remove_at(cache, i);
+            cache->stats.evictions++;
+            return;
+        }
+        if (entry)
+            entry->referenced = false;
+        cache->clock_hand = (i + 1) & (cache->cap - 1);
+    }
+}
+
+// Double the capacity of the table, returning `false` if allocation failed.
+static bool cache_grow(struct rust_demangle_cache *cache) {
+    size_t new_cap = cache->cap * 2;
+    struct cache_slot *new_slots =
+        (struct cache_slot *)calloc(new_cap, sizeof(struct cache_slot));
+    if (!new_slots)
+        return false;
+
+    struct cache_slot *old_slots = cache->slots;
+    size_t old_cap = cache->cap;
+    cache->slots = new_slots;
+    cache->cap = new_cap;
+    cache->clock_hand = 0;
+
+    size_t i;
+    for (i = 0; i < old_cap; i++) {
+        if (!old_slots[i].entry)
+            continue;
+        size_t j = cache_home(cache, old_slots[i].hash);
+        while (new_slots[j].entry)
+            j = (j + 1) & (new_cap - 1);
+        new_slots[j] = old_slots[i];
+    }
+    free(old_slots);
+
+    cache->stats.bytes += old_cap * sizeof(struct cache_slot);
+
+    return true;
+}
+
+// Demangle `mangled` into a new (not yet inserted) entry.
+static struct cache_entry *
+cache_demangle(int flags, const char *mangled, size_t len) {
+    // Try a small buffer first, to avoid demangling twice in most cases.
+    char small[256];
+    size_t needed;
+    if (!rust_demangle_into_n(
+            mangled, len, small, sizeof(small), &needed, flags
+        ))
+        needed = CACHE_FAILED;
+
+    struct cache_entry *entry =
+        (struct cache_entry *)malloc(cache_entry_size(len, needed));
+    if (!entry)
+        return NULL;
+    entry->mangled_len = len;
+    entry->demangled_len = needed;
+    entry->referenced = false;
+    memcpy(entry->data, mangled, len);
+
+    if (needed != CACHE_FAILED) {
+        if (needed < sizeof(small))
+            memcpy(entry->data + len, small, needed + 1);
+        else
+            rust_demangle_into_n(
+                mangled, len, entry->data + len, needed + 1, NULL, flags
+            );
+    }
+
+    return entry;
+}
+
+struct rust_demangle_cache *
+rust_demangle_cache_new(size_t max_bytes, int flags) {
+    struct rust_demangle_cache *cache =
+        (struct rust_demangle_cache *)malloc(sizeof(*cache));
+    if (!cache)
+        return NULL;
+
+    cache->flags = flags;
+    cache->max_bytes = max_bytes;
+    cache->cap = CACHE_MIN_CAP;
+    cache->count = 0;
+    cache->clock_hand = 0;
+    cache->uncached = NULL;
+    cache->slots =
+        (struct cache_slot *)calloc(cache->cap, sizeof(struct cache_slot));
+    if (!cache->slots) {
+        free(cache);
+        return NULL;
+    }
+
+    cache->stats.hits = 0;
+    cache->stats.misses = 0;
+    cache->stats.evictions = 0;
+    cache->stats.entries = 0;
+    cache->stats.bytes = cache->cap * sizeof(struct cache_slot);
+
+    return cache;
+}
+
+void rust_demangle_cache_free(struct rust_demangle_cache *cache) {
+    if (!cache)
+        return;
+
+    size_t i;
+    for (i = 0; i < cache->cap; i++)
+        free(cache->slots[i].entry);
+    free(cache->slots);
+    free(cache->uncached);
+    free(cache);
+}
+
+static const char *cache_entry_result(
+    const struct cache_entry *entry, size_t *demangled_len
+) {
+    if (entry->demangled_len == CACHE_FAILED)
+        return NULL;
+    if (demangled_len)
+        *demangled_len = entry->demangled_len;
+    return entry->data + entry->mangled_len;
+}
+
+// Find the entry for `mangled`, counting (and marking it as) a hit, if found.
+static struct cache_entry *cache_find(
+    struct rust_demangle_cache *cache, uint64_t hash, const char *mangled,
+    size_t len
+) {
+    size_t mask = cache->cap - 1;
+    size_t i;
+    for (i = cache_home(cache, hash); cache->slots[i].entry;
+         i = (i + 1) & mask) {
+        struct cache_entry *entry = cache->slots[i].entry;
+        if (cache->slots[i].hash == hash && entry->mangled_len == len &&
+            !memcmp(entry->data, mangled, len)) {
+            cache->stats.hits++;
+            entry->referenced = true;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Insert `entry` (not already in the cache), evicting others as needed.
+static void cache_insert(
+    struct rust_demangle_cache *cache, uint64_t hash, struct cache_entry *entry
+) {
+    size_t entry_size =
+        cache_entry_size(entry->mangled_len, entry->demangled_len);
+
+    // Too large to ever fit, only keep it until the next lookup.
+    if (entry_size + cache->cap * sizeof(struct cache_slot) >
+        cache->max_bytes) {
+        cache->uncached = entry;
+        return;
+    }
+
+    // Make room for the new entry, in the table, and in the memory budget.
+    if ((cache->count + 1) * 2 > cache->cap) {
+        size_t grown_bytes = cache->stats.bytes + entry_size +
+                             cache->cap * sizeof(struct cache_slot);
+        if (grown_bytes > cache->max_bytes || !cache_grow(cache))
+            cache_evict_one(cache);
+    }
+    while (cache->stats.bytes + entry_size > cache->max_bytes)
+        cache_evict_one(cache);
+
+    size_t mask = cache->cap - 1;
+    size_t i = cache_home(cache, hash);
+    while (cache->slots[i].entry)
+        i = (i + 1) & mask;
+    cache->slots[i].hash = hash;
+    cache->slots[i].entry = entry;
+    cache->count++;
+    cache->stats.bytes += entry_size;
+}
+
+const char *rust_demangle_cache_lookup(
+    struct rust_demangle_cache *cache, const char *mangled, size_t len,
+    size_t *demangled_len
+) {
+    free(cache->uncached);
+    cache->uncached = NULL;
+
+    uint64_t hash = fnv1a(mangled, len);
+    struct cache_entry *entry = cache_find(cache, hash, mangled, len);
+    if (entry)
+        return cache_entry_result(entry, demangled_len);
+
+    cache->stats.misses++;
+
+    entry = cache_demangle(cache->flags, mangled, len);
+    if (!entry)
+        return NULL;
+    cache_insert(cache, hash, entry);
+
+    return cache_entry_result(entry, demangled_len);
+}
+
+void rust_demangle_cache_get_stats(
+    const struct rust_demangle_cache *cache,
+    struct rust_demangle_cache_stats *stats
+) {
+    *stats = cache->stats;
+    stats->entries = cache->count;
+}
+
+#ifdef RUST_DEMANGLE_PTHREADS
+
+struct shared_cache_shard {
+    pthread_mutex_t lock;
+    struct rust_demangle_cache *cache;
+
+    // Keep different shards' locks out of each other's cache lines.
+    char padding[64];
+};
+
+struct rust_demangle_shared_cache {
+    struct shared_cache_shard *shards;
+    // Always a power of two.
+    size_t num_shards;
+    int flags;
+};
+
+#define SHARED_CACHE_DEFAULT_SHARDS 64
+
+// Shards are picked by the top 24 bits of the hash (the rest pick the slot).
+#define SHARED_CACHE_MAX_SHARDS ((size_t)1 << 24)
+
+// Each shard's table alone starts at `CACHE_MIN_CAP` slots (1KiB on 64-bit
+// targets), counted against its budget, so smaller budgets cache (almost)
+// nothing, and using fewer shards is better.
+#define SHARED_CACHE_MIN_SHARD_BYTES (8 << 10)
+
+struct rust_demangle_shared_cache *rust_demangle_shared_cache_new(
+    size_t max_bytes, size_t num_shards, int flags
+) {
+    if (num_shards == 0)
+        num_shards = SHARED_CACHE_DEFAULT_SHARDS;
+    if (num_shards > SHARED_CACHE_MAX_SHARDS)
+        num_shards = SHARED_CACHE_MAX_SHARDS;
+    size_t n = 1;
+    while (n < num_shards)
+        n *= 2;
+    num_shards = n;
+    while (num_shards > 1 &&
+           max_bytes / num_shards < SHARED_CACHE_MIN_SHARD_BYTES)
+        num_shards /= 2;
+
+    struct rust_demangle_shared_cache *shared =
+        (struct rust_demangle_shared_cache *)malloc(sizeof(*shared));
+    if (!shared)
+        return NULL;
+    shared->flags = flags;
+    shared->num_shards = 0;
+    shared->shards = (struct shared_cache_shard *)calloc(
+        num_shards, sizeof(struct shared_cache_shard)
+    );
+    if (!shared->shards) {
+        free(shared);
+        return NULL;
+    }
+
+    // The memory budget is split evenly between the shards.
+    for (; shared->num_shards < num_shards; shared->num_shards++) {
+        struct shared_cache_shard *shard = &shared->shards[shared->num_shards];
+        shard->cache = rust_demangle_cache_new(max_bytes / num_shards, flags);
+        if (!shard->cache)
+            break;
+        if (pthread_mutex_init(&shard->lock, NULL) != 0) {
+            rust_demangle_cache_free(shard->cache);
+            break;
+        }
+    }
+    if (shared->num_shards < num_shards) {
+        rust_demangle_shared_cache_free(shared);
+        return NULL;
+    }
+
+    return shared;
+}
+
+void rust_demangle_shared_cache_free(struct rust_demangle_shared_cache *shared
+) {
+    if (!shared)
+        return;
+
+    size_t i;
+    for (i = 0; i < shared->num_shards; i++) {
+        pthread_mutex_destroy(&shared->shards[i].lock);
+        rust_demangle_cache_free(shared->shards[i].cache);
+    }
+    free(shared->shards);
+    free(shared);
+}
+
+// Copy the result in `entry` out to `out` (like `rust_demangle_into`).
+static bool cache_entry_copy_out(
+    const struct cache_entry *entry, char *out, size_t cap, size_t *needed
+) {
+    size_t len = 0;
+    const char *demangled = entry ? cache_entry_result(entry, &len) : NULL;
+    if (!demangled)
+        len = 0;
+
+    if (cap > 0) {
+        size_t copy_len = len < cap ? len : cap - 1;
+        memcpy(out, demangled ? demangled : "", copy_len);
+        out[copy_len] = 0;
+    }
+    if (needed)
+        *needed = len;
+
+    return demangled != NULL;
+}
+
+bool rust_demangle_shared_cache_lookup_into(
+    struct rust_demangle_shared_cache *shared, const char *mangled, size_t len,
+    char *out, size_t cap, size_t *needed
+) {
+    uint64_t hash = fnv1a(mangled, len);
+
+    // NOTE: the top bits pick the shard (see `SHARED_CACHE_MAX_SHARDS`), as
+    // the bottom ones are used (by `cache_home`) to pick the slot, within the
+    // shard.
+    struct shared_cache_shard *shard =
+        &shared->shards[(size_t)(hash >> 40) & (shared->num_shards - 1)];
+    struct rust_demangle_cache *cache = shard->cache;
+
+    pthread_mutex_lock(&shard->lock);
+    struct cache_entry *entry = cache_find(cache, hash, mangled, len);
+    bool success;
+    if (entry) {
+        success = cache_entry_copy_out(entry, out, cap, needed);
+        pthread_mutex_unlock(&shard->lock);
+        return success;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    // Demangle without holding the lock, so that other threads can still
+    // use this shard in the meanwhile.
+    entry = cache_demangle(shared->flags, mangled, len);
+
+    pthread_mutex_lock(&shard->lock);
+    free(cache->uncached);
+    cache->uncached = NULL;
+
+    // Another thread may have inserted the same symbol in the meanwhile.
+    struct cache_entry *existing = cache_find(cache, hash, mangled, len);
+    if (existing) {
+        free(entry);
+        entry = existing;
+    } else {
+        cache->stats.misses++;
+        if (entry)
+            cache_insert(cache, hash, entry);
+    }
+    success = cache_entry_copy_out(entry, out, cap, needed);
+    pthread_mutex_unlock(&shard->lock);
+
+    return success;
+}
+
+void rust_demangle_shared_cache_get_stats(
+    struct rust_demangle_shared_cache *shared,
+    struct rust_demangle_cache_stats *stats
+) {
+    stats->hits = 0;
+    stats->misses = 0;
+    stats->evictions = 0;
+    stats->entries = 0;
+    stats->bytes = 0;
+
+    size_t i;
+    for (i = 0; i < shared->num_shards; i++) {
+        struct rust_demangle_cache_stats shard_stats;
+        pthread_mutex_lock(&shared->shards[i].lock);
+        rust_demangle_cache_get_stats(shared->shards[i].cache, &shard_stats);
+        pthread_mutex_unlock(&shared->shards[i].lock);
+
+        stats->hits += shard_stats.hits;
+        stats->misses += shard_stats.misses;
+        stats->evictions += shard_stats.evictions;
+        stats->entries += shard_stats.entries;
+        stats->bytes += shard_stats.bytes;
+    }
+}
+
+#endif // RUST_DEMANGLE_PTHREADS
@@ -0,0 +1,77 @@
+// Optional companion to `rust-demangle.c`, caching the demangling of symbols
+// which are looked up repeatedly (e.g. the stack frames in profiler samples).
+// Requires `rust-demangle.c` to also be compiled in.
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Cache of up to (approximately) `max_bytes` of memory, evicting the least
+// recently used entries (approximated with the CLOCK algorithm) to stay
+// within that budget. Returns `NULL` if allocating the cache failed.
+struct rust_demangle_cache;
+struct rust_demangle_cache *
+rust_demangle_cache_new(size_t max_bytes, int flags);
+void rust_demangle_cache_free(struct rust_demangle_cache *cache);
+
+// Look up (and demangle, if not already cached) the `len` bytes of `mangled`,
+// returning its (NUL-terminated) demangling, with its length written to
+// `*demangled_len` (if not `NULL`), or `NULL` if `mangled` couldn't be
+// demangled (or allocation failed). Failures are cached as well.
+// The returned string is owned by the cache, and is only valid until the next
+// call to `rust_demangle_cache_lookup` (or `rust_demangle_cache_free`).
+const char *rust_demangle_cache_lookup(
+    struct rust_demangle_cache *cache, const char *mangled, size_t len,
+    size_t *demangled_len
+);
+
+struct rust_demangle_cache_stats {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+
+    // Current size of the cache.
+    size_t entries;
+    size_t bytes;
+};
+void rust_demangle_cache_get_stats(
+    const struct rust_demangle_cache *cache,
+    struct rust_demangle_cache_stats *stats
+);
+
+#ifdef RUST_DEMANGLE_PTHREADS
+// Thread-safe cache, split into `num_shards` (rounded up to a power of two,
+// or some default if `0`) independently locked caches, with each symbol only
+// cached in one of them (chosen by hash), and `max_bytes` split evenly between
+// them. Fewer shards are used if that would leave each with less than 8KiB
+// (down to a single one), and never more than 2^24. Only available if both
+// `rust-demangle-cache.c` and users of this header are compiled with
+// `RUST_DEMANGLE_PTHREADS` defined.
+struct rust_demangle_shared_cache;
+struct rust_demangle_shared_cache *rust_demangle_shared_cache_new(
+    size_t max_bytes, size_t num_shards, int flags
+);
+void rust_demangle_shared_cache_free(struct rust_demangle_shared_cache *shared
+);
+
+// Like `rust_demangle_into_n`, but using (and filling) the cache. The output
+// is copied out (while the cache shard is locked), as another thread could
+// evict it at any point afterwards.
+bool rust_demangle_shared_cache_lookup_into(
+    struct rust_demangle_shared_cache *shared, const char *mangled, size_t len,
+    char *out, size_t cap, size_t *needed
+);
+
+// Sum of the statistics of all the shards.
+void rust_demangle_shared_cache_get_stats(
+    struct rust_demangle_shared_cache *shared,
+    struct rust_demangle_cache_stats *stats
+);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,425 @@
+// Needed for `mmap` and friends, with `-std=c99`.
+#define _POSIX_C_SOURCE 200809L
+
+#include "rust-demangle-elf.h"
+#include "rust-demangle.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Minimal ELF parsing, only as much as needed to find symbol tables.
+// NOTE: fields are read through `elf_read` (instead of casting to the
+// `<elf.h>` structs), to support both byte orders, and avoid requiring the
+// file contents to be aligned (or even `<elf.h>` being available).
+
+#define ELFCLASS32 1
+#define ELFCLASS64 2
+#define ELFDATA2LSB 1
+#define ELFDATA2MSB 2
+
+#define SHT_SYMTAB 2
+#define SHT_DYNSYM 11
+
+#define STT_SECTION 3
+#define STT_FILE 4
+
+struct elf_file {
+    const unsigned char *data;
+    size_t size;
+    bool is_64;
+    bool big_endian;
+
+    // Section headers.
+    uint64_t shoff;
+    uint64_t shentsize;
+    uint64_t shnum;
+};
+
+static uint64_t
+elf_read(const struct elf_file *elf, uint64_t offset, size_t size) {
+    const unsigned char *p = elf->data + offset;
+    uint64_t x = 0;
+    size_t i;
+    for (i = 0; i < size; i++)
+        x |= (uint64_t)p[elf->big_endian ? size - 1 - i : i] << (i * 8);
+    return x;
+}
+
+// Read a field which differs between ELF32 and ELF64, given both its
+// ELF32 offset and size, and its ELF64 offset and size.
+#define ELF_FIELD(elf, base, off32, size32, off64, size64)                     \
+    ((elf)->is_64 ? elf_read((elf), (base) + (off64), (size64))                \
+                  : elf_read((elf), (base) + (off32), (size32)))
+
+static bool
+elf_in_bounds(const struct elf_file *elf, uint64_t offset, uint64_t len) {
+    return offset <= elf->size && len <= elf->size - offset;
+}
+
+static bool elf_open(struct elf_file *elf, const void *data, size_t size) {
+    elf->data = (const unsigned char *)data;
+    elf->size = size;
+
+    if (size < 0x34 || memcmp(data, "\x7f" "ELF", 4) != 0)
+        return false;
+
+    switch (elf->data[4]) {
+    case ELFCLASS32:
+        elf->is_64 = false;
+        break;
+    case ELFCLASS64:
+        elf->is_64 = true;
+        if (size < 0x40)
+            return false;
+        break;
+    default:
+        return false;
+    }
+
+    switch (elf->data[5]) {
+    case ELFDATA2LSB:
+        elf->big_endian = false;
+        break;
+    case ELFDATA2MSB:
+        elf->big_endian = true;
+        break;
+    default:
+        return false;
+    }
+
+    elf->shoff = ELF_FIELD(elf, 0, 0x20, 4, 0x28, 8);
+    elf->shentsize = ELF_FIELD(elf, 0, 0x2e, 2, 0x3a, 2);
+    elf->shnum = ELF_FIELD(elf, 0, 0x30, 2, 0x3c, 2);
+
+    if (elf->shoff == 0) {
+        elf->shnum = 0;
+        return true;
+    }
+    if (elf->shentsize < (elf->is_64 ? 0x40 : 0x28) ||
+        !elf_in_bounds(elf, elf->shoff, elf->shentsize))
+        return false;
+
+    // Too many sections to fit in `e_shnum`, the real count is in the
+    // `sh_size` of the first section header.
+    if (elf->shnum == 0)
+        elf->shnum = ELF_FIELD(elf, elf->shoff, 0x14, 4, 0x20, 8);
+
+    return elf->shnum <= (elf->size - elf->shoff) / elf->shentsize;
+}
+
+// Called for each named symbol, stopping the iteration if it returns `false`.
+typedef bool (*elf_symbol_fn)(
+    uint64_t addr, const char *name, size_t len, void *opaque
+);
+
+static bool elf_symtab_for_each(
+    const struct elf_file *elf, uint64_t shdr, elf_symbol_fn f, void *opaque
+) {
+    uint64_t offset = ELF_FIELD(elf, shdr, 0x10, 4, 0x18, 8);
+    uint64_t size = ELF_FIELD(elf, shdr, 0x14, 4, 0x20, 8);
+    uint64_t link = ELF_FIELD(elf, shdr, 0x18, 4, 0x28, 4);
+    uint64_t entsize = ELF_FIELD(elf, shdr, 0x24, 4, 0x38, 8);
+
+    if (entsize < (elf->is_64 ? 24 : 16) ||
+        !elf_in_bounds(elf, offset, size) || link >= elf->shnum)
+        return false;
+
+    // The associated string table, which all names are found in.
+    uint64_t strtab_shdr = elf->shoff + link * elf->shentsize;
+    uint64_t strtab = ELF_FIELD(elf, strtab_shdr, 0x10, 4, 0x18, 8);
+    uint64_t strtab_size = ELF_FIELD(elf, strtab_shdr, 0x14, 4, 0x20, 8);
+    if (!elf_in_bounds(elf, strtab, strtab_size))
+        return false;
+
+    uint64_t sym;
+    for (sym = offset; size - (sym - offset) >= entsize; sym += entsize) {
+        uint64_t name = elf_read(elf, sym, 4);
+        unsigned char type = elf->data[sym + (elf->is_64 ? 4 : 12)] & 0xf;
+        uint64_t addr = ELF_FIELD(elf, sym, 4, 4, 8, 8);
+
+        if (name == 0 || name >= strtab_size || type == STT_SECTION ||
+            type == STT_FILE)
+            continue;
+
+        const char *name_start = (const char *)elf->data + strtab + name;
+        const char *name_end =
+            memchr(name_start, 0, (size_t)(strtab_size - name));
+        if (!name_end)
+            return false;
+        if (name_end == name_start)
+            continue;
+
+        if (!f(addr, name_start, name_end - name_start, opaque))
+            return false;
+    }
+
+    return true;
+}
+
+static bool elf_for_each_symbol(
+    const void *data, size_t size, elf_symbol_fn f, void *opaque
+) {
+    struct elf_file elf;
+    if (!elf_open(&elf, data, size)) {
+        errno = ENOEXEC;
+        return false;
+    }
+
+    uint64_t i;
+    for (i = 0; i < elf.shnum; i++) {
+        uint64_t shdr = elf.shoff + i * elf.shentsize;
+        uint64_t type = elf_read(&elf, shdr + 4, 4);
+        if (type != SHT_SYMTAB && type != SHT_DYNSYM)
+            continue;
+
+        // Callbacks only fail if allocation failed (and set `errno`).
+        errno = ENOEXEC;
+        if (!elf_symtab_for_each(&elf, shdr, f, opaque))
+            return false;
+    }
+
+    return true;
+}
+
+// Map (read-only) the whole file at `path`, or return `NULL` (with `errno`
+// set) on failure.
+static void *map_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    void *data = NULL;
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        if (st.st_size <= 0)
+            errno = ENOEXEC;
+        else {
+            *size = (size_t)st.st_size;
+            data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED)
+                data = NULL;
+        }
+    }
+
+    // Keep the `errno` from the failure above, if any.
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+
+    return data;
+}
+
+static void unmap_file(void *data, size_t size) {
+    int saved_errno = errno;
+    munmap(data, size);
+    errno = saved_errno;
+}
+
+// Write the demangling of `name` (or `name` itself, if not a Rust symbol) at
+// `pos` in `*buf` (growing it, as needed), followed by a NUL terminator.
+// Returns the length written (excluding the NUL), or `(size_t)-1` (with
+// `errno` set) if allocation failed.
+static size_t demangle_at(
+    char **buf, size_t *cap, size_t pos, const char *name, size_t len,
+    int flags
+) {
+    for (;;) {
+        size_t needed;
+        if (*cap > pos &&
+            rust_demangle_into_n(
+                name, len, *buf + pos, *cap - pos, &needed, flags
+            )) {
+            if (needed < *cap - pos)
+                return needed;
+        } else {
+            needed = len;
+            if (needed < *cap - pos) {
+                memcpy(*buf + pos, name, len);
+                (*buf)[pos + len] = 0;
+                return len;
+            }
+        }
+
+        size_t new_cap = *cap * 2;
+        if (new_cap < pos + needed + 1)
+            new_cap = pos + needed + 1;
+        if (new_cap < 256)
+            new_cap = 256;
+        char *new_buf = (char *)realloc(*buf, new_cap);
+        if (!new_buf) {
+            errno = ENOMEM;
+            return (size_t)-1;
+        }
+        *buf = new_buf;
+        *cap = new_cap;
+    }
+}
+
+struct symbols_state {
+    int flags;
+    void (*callback)(uint64_t addr, const char *name, size_t len, void *opaque);
+    void *callback_opaque;
+
+    // Reused for every symbol.
+    char *buf;
+    size_t cap;
+};
+
+static bool symbols_demangle_one(
+    uint64_t addr, const char *name, size_t len, void *opaque
+) {
+    struct symbols_state *state = (struct symbols_state *)opaque;
+
+    // Not a Rust symbol, no need to copy it.
+    if (name[0] != '_' && name[0] != 'R' && name[0] != 'Z') {
+        state->callback(addr, name, len, state->callback_opaque);
+        return true;
+    }
+
+    len = demangle_at(&state->buf, &state->cap, 0, name, len, state->flags);
+    if (len == (size_t)-1)
+        return false;
+    state->callback(addr, state->buf, len, state->callback_opaque);
+    return true;
+}
+
+bool rust_demangle_elf_symbols_mem(
+    const void *data, size_t size, int flags,
+    void (*callback)(uint64_t addr, const char *name, size_t len, void *opaque),
+    void *opaque
+) {
+    struct symbols_state state;
+    state.flags = flags;
+    state.callback = callback;
+    state.callback_opaque = opaque;
+    state.buf = NULL;
+    state.cap = 0;
+
+    bool success =
+        elf_for_each_symbol(data, size, symbols_demangle_one, &state);
+
+    free(state.buf);
+
+    return success;
+}
+
+bool rust_demangle_elf_symbols(
+    const char *path, int flags,
+    void (*callback)(uint64_t addr, const char *name, size_t len, void *opaque),
+    void *opaque
+) {
+    size_t size;
+    void *data = map_file(path, &size);
+    if (!data)
+        return false;
+
+    bool success =
+        rust_demangle_elf_symbols_mem(data, size, flags, callback, opaque);
+
+    unmap_file(data, size);
+
+    return success;
+}
+
+struct table_state {
+    int flags;
+    struct rust_demangle_elf_table *table;
+    size_t cap;
+    size_t names_len;
+    size_t names_cap;
+};
+
+static bool
+table_demangle_one(uint64_t addr, const char *name, size_t len, void *opaque) {
+    struct table_state *state = (struct table_state *)opaque;
+    struct rust_demangle_elf_table *table = state->table;
+
+    if (table->len == state->cap) {
+        size_t new_cap = state->cap ? state->cap * 2 : 1024;
+        uint64_t *addrs =
+            (uint64_t *)realloc(table->addrs, new_cap * sizeof(uint64_t));
+        if (!addrs)
+            goto oom;
+        table->addrs = addrs;
+        size_t *offsets =
+            (size_t *)realloc(table->offsets, new_cap * sizeof(size_t));
+        if (!offsets)
+            goto oom;
+        table->offsets = offsets;
+        state->cap = new_cap;
+    }
+
+    // Demangle directly into the table.
+    len = demangle_at(
+        &table->names, &state->names_cap, state->names_len, name, len,
+        state->flags
+    );
+    if (len == (size_t)-1)
+        return false;
+
+    table->addrs[table->len] = addr;
+    table->offsets[table->len] = state->names_len;
+    table->len++;
+    state->names_len += len + 1;
+
+    return true;
+
+oom:
+    errno = ENOMEM;
+    return false;
+}
+
+struct rust_demangle_elf_table *
+rust_demangle_elf_table_new(const char *path, int flags) {
+    struct rust_demangle_elf_table *table =
+        (struct rust_demangle_elf_table *)malloc(sizeof(*table));
+    if (!table) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    table->len = 0;
+    table->addrs = NULL;
+    table->offsets = NULL;
+    table->names = NULL;
+
+    size_t size;
+    void *data = map_file(path, &size);
+    if (!data) {
+        free(table);
+        return NULL;
+    }
+
+    struct table_state state;
+    state.flags = flags;
+    state.table = table;
+    state.cap = 0;
+    state.names_len = 0;
+    state.names_cap = 0;
+
+    bool success = elf_for_each_symbol(data, size, table_demangle_one, &state);
+
+    unmap_file(data, size);
+
+    if (!success) {
+        int saved_errno = errno;
+        rust_demangle_elf_table_free(table);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    return table;
+}
+
+void rust_demangle_elf_table_free(struct rust_demangle_elf_table *table) {
+    if (!table)
+        return;
+    free(table->addrs);
+    free(table->offsets);
+    free(table->names);
+    free(table);
+}
@@ -0,0 +1,48 @@
+// Optional companion to `rust-demangle.c`, for demangling all the symbols in
+// the symbol tables (`.symtab` and `.dynsym`) of an ELF file (POSIX-only, as
+// the file is accessed through `mmap`).
+// Requires `rust-demangle.c` to also be compiled in.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Call `callback` for each named symbol in the ELF file at `path`, with the
+// symbol's address, and its name (NUL-terminated, of `len` bytes), demangled
+// if it's a Rust symbol, or otherwise unchanged.
+// Returns `false` on failure (i.e. if `path` couldn't be mapped, or isn't a
+// valid ELF file), with `errno` set.
+bool rust_demangle_elf_symbols(
+    const char *path, int flags,
+    void (*callback)(uint64_t addr, const char *name, size_t len, void *opaque),
+    void *opaque
+);
+// Like `rust_demangle_elf_symbols`, but for an ELF file already in memory.
+bool rust_demangle_elf_symbols_mem(
+    const void *data, size_t size, int flags,
+    void (*callback)(uint64_t addr, const char *name, size_t len, void *opaque),
+    void *opaque
+);
+
+// All the named symbols in an ELF file, in the order they are found in it,
+// with `names + offsets[i]` being the NUL-terminated name of the symbol at
+// `addrs[i]` (demangled if it's a Rust symbol, or otherwise unchanged).
+struct rust_demangle_elf_table {
+    size_t len;
+    uint64_t *addrs;
+    size_t *offsets;
+    char *names;
+};
+// Returns `NULL` on failure (like `rust_demangle_elf_symbols`, with `errno`
+// set), to release with `rust_demangle_elf_table_free` otherwise.
+struct rust_demangle_elf_table *
+rust_demangle_elf_table_new(const char *path, int flags);
+void rust_demangle_elf_table_free(struct rust_demangle_elf_table *table);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,682 @@
+#include "rust-demangle-tree.h"
+#include "rust-demangle.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Each node is encoded as a sequence of items, each starting with a (LEB128)
+// varint, which is either `len << 1`, followed by `len` bytes of text, or
+// `node << 1 | 1`, referring to another node (to be rendered in its place).
+// Nodes are only ever added after all the nodes they refer to (so references
+// always point backwards, and nodes can't form cycles).
+
+// Growable array, of `len` elements (with room for `cap`).
+struct tree_vec {
+    void *ptr;
+    size_t len;
+    size_t cap;
+};
+
+// Make room for `extra` more elements (of `size` bytes each), returning
+// `false` if allocation failed.
+static bool tree_vec_reserve(struct tree_vec *vec, size_t extra, size_t size) {
+    if (extra <= vec->cap - vec->len)
+        return true;
+
+    size_t new_cap = vec->cap ? vec->cap : 16;
+    while (new_cap - vec->len < extra) {
+        if (new_cap > SIZE_MAX / 2 / size)
+            return false;
+        new_cap *= 2;
+    }
+
+    void *new_ptr = realloc(vec->ptr, new_cap * size);
+    if (!new_ptr)
+        return false;
+    vec->ptr = new_ptr;
+    vec->cap = new_cap;
+    return true;
+}
+
+static bool tree_vec_push(
+    struct tree_vec *vec, const void *data, size_t count, size_t size
+) {
+    if (count == 0)
+        return true;
+    if (!tree_vec_reserve(vec, count, size))
+        return false;
+    memcpy((char *)vec->ptr + vec->len * size, data, count * size);
+    vec->len += count;
+    return true;
+}
+
+static bool tree_push_varint(struct tree_vec *vec, uint64_t x) {
+    unsigned char buf[10];
+    size_t len = 0;
+    do {
+        buf[len] = x & 0x7f;
+        x >>= 7;
+        if (x)
+            buf[len] |= 0x80;
+        len++;
+    } while (x);
+    return tree_vec_push(vec, buf, len, 1);
+}
+
+// Read a varint from `*p` (without going past `end`), returning `false` if
+// it's truncated, too large, or not in its shortest form.
+static bool tree_read_varint(
+    const unsigned char **p, const unsigned char *end, uint64_t *x
+) {
+    uint64_t value = 0;
+    unsigned shift = 0;
+    while (*p < end) {
+        unsigned char byte = *(*p)++;
+        if (shift == 63 && (byte & 0x7e))
+            return false;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            if (byte == 0 && shift > 0)
+                return false;
+            *x = value;
+            return true;
+        }
+        shift += 7;
+        if (shift > 63)
+            return false;
+    }
+    return false;
+}
+
+static size_t saturating_add(size_t a, size_t b) {
+    return a + b < a ? SIZE_MAX : a + b;
+}
+
+static uint64_t fnv1a(const char *data, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+// Nodes nest (much) less deeply than this (when built from the events of
+// `rust_demangle_with_events`, which is itself limited by the default
+// `max_depth`), which bounds the recursion of rendering (any tree).
+#define TREE_MAX_DEPTH (4 * RUST_DEMANGLE_DEFAULT_MAX_DEPTH)
+
+#define TREE_NONE ((size_t)-1)
+
+// Open-addressing (linear probing) hash table slot, empty if `node` is
+// `TREE_NONE`.
+struct tree_slot {
+    uint64_t hash;
+    size_t node;
+};
+
+#define TREE_MIN_SLOTS 64
+
+// A node still being built (i.e. whose `BEGIN_*` event hasn't been matched).
+struct tree_frame {
+    // Start of the node's items so far, in `items`.
+    size_t items_start;
+
+    // Position in the output up to which items have been added.
+    size_t output_pos;
+
+    // Rendered length, and depth (of the deepest node referenced), so far.
+    size_t out_len;
+    size_t depth;
+
+    // Used to reuse the node referred to, for nodes of a single reference.
+    size_t texts;
+    size_t refs;
+    size_t last_ref;
+};
+
+struct rust_demangle_tree {
+    int flags;
+
+    // The encodings of all the nodes, back to back, with node `i` taking up
+    // the bytes from `node_starts[i]` up to `node_starts[i + 1]` (so there is
+    // always one more element in `node_starts` than there are nodes), and
+    // rendering to `node_lens[i]` bytes, from `node_depths[i]` levels deep.
+    struct tree_vec bytes;
+    struct tree_vec node_starts;
+    struct tree_vec node_lens;
+    struct tree_vec node_depths;
+
+    // Always a power of two, and kept at most half full.
+    struct tree_slot *slots;
+    size_t slots_cap;
+
+    // The node of each symbol, or `TREE_NONE` if it failed to demangle.
+    struct tree_vec roots;
+
+    // Scratch space for `rust_demangle_tree_add`, kept around between calls.
+    struct tree_vec text;
+    struct tree_vec events;
+    struct tree_vec items;
+    struct tree_vec frames;
+    // `true` if allocation failed while demangling.
+    bool scratch_errored;
+};
+
+static size_t tree_node_count(const struct rust_demangle_tree *tree) {
+    return tree->node_lens.len;
+}
+
+static size_t
+tree_home(const struct rust_demangle_tree *tree, uint64_t hash) {
+    return (size_t)(hash ^ (hash >> 32)) & (tree->slots_cap - 1);
+}
+
+// Double the capacity of the table, returning `false` if allocation failed.
+static bool tree_grow_slots(struct rust_demangle_tree *tree) {
+    size_t new_cap = tree->slots_cap * 2;
+    struct tree_slot *new_slots =
+        (struct tree_slot *)malloc(new_cap * sizeof(struct tree_slot));
+    if (!new_slots)
+        return false;
+    size_t i;
+    for (i = 0; i < new_cap; i++)
+        new_slots[i].node = TREE_NONE;
+
+    struct tree_slot *old_slots = tree->slots;
+    size_t old_cap = tree->slots_cap;
+    tree->slots = new_slots;
+    tree->slots_cap = new_cap;
+
+    for (i = 0; i < old_cap; i++) {
+        if (old_slots[i].node == TREE_NONE)
+            continue;
+        size_t j = tree_home(tree, old_slots[i].hash);
+        while (new_slots[j].node != TREE_NONE)
+            j = (j + 1) & (new_cap - 1);
+        new_slots[j] = old_slots[i];
+    }
+    free(old_slots);
+
+    return true;
+}
+
+// Add a new node (without checking if it already exists), returning its
+// index, or `TREE_NONE` if allocation failed.
+static size_t tree_append_node(
+    struct rust_demangle_tree *tree, const char *data, size_t len,
+    uint64_t hash, size_t out_len, size_t depth
+) {
+    if ((tree_node_count(tree) + 1) * 2 > tree->slots_cap &&
+        !tree_grow_slots(tree))
+        return TREE_NONE;
+
+    // Reserve everything first, so that failure leaves no partial node.
+    if (!tree_vec_reserve(&tree->bytes, len, 1) ||
+        !tree_vec_reserve(&tree->node_starts, 1, sizeof(size_t)) ||
+        !tree_vec_reserve(&tree->node_lens, 1, sizeof(size_t)) ||
+        !tree_vec_reserve(&tree->node_depths, 1, sizeof(uint16_t)))
+        return TREE_NONE;
+
+    size_t node = tree_node_count(tree);
+    uint16_t depth16 = (uint16_t)depth;
+
+    tree_vec_push(&tree->bytes, data, len, 1);
+    tree_vec_push(&tree->node_starts, &tree->bytes.len, 1, sizeof(size_t));
+    tree_vec_push(&tree->node_lens, &out_len, 1, sizeof(size_t));
+    tree_vec_push(&tree->node_depths, &depth16, 1, sizeof(uint16_t));
+
+    size_t i = tree_home(tree, hash);
+    while (tree->slots[i].node != TREE_NONE)
+        i = (i + 1) & (tree->slots_cap - 1);
+    tree->slots[i].hash = hash;
+    tree->slots[i].node = node;
+
+    return node;
+}
+
+// Find the node encoded as `data`, or add it (see `tree_append_node`).
+static size_t tree_intern(
+    struct rust_demangle_tree *tree, const char *data, size_t len,
+    size_t out_len, size_t depth
+) {
+    const size_t *starts = (const size_t *)tree->node_starts.ptr;
+    uint64_t hash = fnv1a(data, len);
+
+    size_t i;
+    for (i = tree_home(tree, hash); tree->slots[i].node != TREE_NONE;
+         i = (i + 1) & (tree->slots_cap - 1)) {
+        size_t node = tree->slots[i].node;
+        if (tree->slots[i].hash == hash &&
+            starts[node + 1] - starts[node] == len &&
+            memcmp((const char *)tree->bytes.ptr + starts[node], data, len) ==
+                0)
+            return node;
+    }
+
+    return tree_append_node(tree, data, len, hash, out_len, depth);
+}
+
+struct rust_demangle_tree *rust_demangle_tree_new(int flags) {
+    struct rust_demangle_tree *tree =
+        (struct rust_demangle_tree *)calloc(1, sizeof(*tree));
+    if (!tree)
+        return NULL;
+
+    tree->flags = flags;
+    tree->slots_cap = TREE_MIN_SLOTS;
+    tree->slots =
+        (struct tree_slot *)malloc(tree->slots_cap * sizeof(struct tree_slot));
+    size_t start = 0;
+    if (!tree->slots ||
+        !tree_vec_push(&tree->node_starts, &start, 1, sizeof(size_t))) {
+        rust_demangle_tree_free(tree);
+        return NULL;
+    }
+    size_t i;
+    for (i = 0; i < tree->slots_cap; i++)
+        tree->slots[i].node = TREE_NONE;
+
+    return tree;
+}
+
+void rust_demangle_tree_free(struct rust_demangle_tree *tree) {
+    if (!tree)
+        return;
+    free(tree->bytes.ptr);
+    free(tree->node_starts.ptr);
+    free(tree->node_lens.ptr);
+    free(tree->node_depths.ptr);
+    free(tree->slots);
+    free(tree->roots.ptr);
+    free(tree->text.ptr);
+    free(tree->events.ptr);
+    free(tree->items.ptr);
+    free(tree->frames.ptr);
+    free(tree);
+}
+
+static void tree_text_callback(const char *data, size_t len, void *opaque) {
+    struct rust_demangle_tree *tree = (struct rust_demangle_tree *)opaque;
+    if (!tree_vec_push(&tree->text, data, len, 1))
+        tree->scratch_errored = true;
+}
+
+static void
+tree_event_callback(const struct rust_demangle_event *event, void *opaque) {
+    struct rust_demangle_tree *tree = (struct rust_demangle_tree *)opaque;
+
+    // Leaves (e.g. identifiers) are kept as text, in the enclosing node.
+    if (event->kind >= RUST_DEMANGLE_EVENT_CRATE)
+        return;
+
+    if (!tree_vec_push(&tree->events, event, 1, sizeof(*event)))
+        tree->scratch_errored = true;
+}
+
+static bool tree_push_frame(struct rust_demangle_tree *tree, size_t pos) {
+    struct tree_frame frame;
+
+    frame.items_start = tree->items.len;
+    frame.output_pos = pos;
+    frame.out_len = 0;
+    frame.depth = 0;
+    frame.texts = 0;
+    frame.refs = 0;
+    frame.last_ref = TREE_NONE;
+
+    return tree_vec_push(&tree->frames, &frame, 1, sizeof(frame));
+}
+
+static struct tree_frame *tree_top_frame(struct rust_demangle_tree *tree) {
+    return (struct tree_frame *)tree->frames.ptr + (tree->frames.len - 1);
+}
+
+// Add the output text up to `pos`, to the innermost node being built.
+static bool tree_push_text(struct rust_demangle_tree *tree, size_t pos) {
+    struct tree_frame *frame = tree_top_frame(tree);
+    if (pos <= frame->output_pos)
+        return true;
+
+    size_t len = pos - frame->output_pos;
+    if (!tree_push_varint(&tree->items, (uint64_t)len << 1) ||
+        !tree_vec_push(
+            &tree->items, (const char *)tree->text.ptr + frame->output_pos,
+            len, 1
+        ))
+        return false;
+
+    frame->output_pos = pos;
+    frame->out_len = saturating_add(frame->out_len, len);
+    frame->texts++;
+    return true;
+}
+
+// Finish the innermost node being built, with the output text up to `pos`,
+// returning its index, or `TREE_NONE` if allocation failed.
+static size_t tree_pop_frame(struct rust_demangle_tree *tree, size_t pos) {
+    if (!tree_push_text(tree, pos))
+        return TREE_NONE;
+
+    struct tree_frame frame = *tree_top_frame(tree);
+    tree->frames.len--;
+
+    // A node which only refers to another node (e.g. a type that's only a
+    // path) would render the same, so the latter can be used instead.
+    size_t node = frame.last_ref;
+    if (frame.texts > 0 || frame.refs != 1) {
+        // NOTE: this can't be hit in practice (see `TREE_MAX_DEPTH`).
+        if (frame.depth + 1 > TREE_MAX_DEPTH)
+            return TREE_NONE;
+
+        node = tree_intern(
+            tree, (const char *)tree->items.ptr + frame.items_start,
+            tree->items.len - frame.items_start, frame.out_len, frame.depth + 1
+        );
+    }
+    tree->items.len = frame.items_start;
+    return node;
+}
+
+// Add a reference to `node` (which took up the output text up to `pos`), to
+// the innermost node being built.
+static bool
+tree_push_ref(struct rust_demangle_tree *tree, size_t node, size_t pos) {
+    struct tree_frame *frame = tree_top_frame(tree);
+    if (!tree_push_varint(&tree->items, (uint64_t)node << 1 | 1))
+        return false;
+
+    size_t depth = ((const uint16_t *)tree->node_depths.ptr)[node];
+    frame->output_pos = pos;
+    frame->out_len = saturating_add(
+        frame->out_len, ((const size_t *)tree->node_lens.ptr)[node]
+    );
+    if (depth > frame->depth)
+        frame->depth = depth;
+    frame->refs++;
+    frame->last_ref = node;
+    return true;
+}
+
+// Build the nodes for the symbol demangled into `text` and `events`,
+// returning the root node, or `TREE_NONE` if allocation failed.
+static size_t tree_build(struct rust_demangle_tree *tree) {
+    const struct rust_demangle_event *events =
+        (const struct rust_demangle_event *)tree->events.ptr;
+
+    tree->items.len = 0;
+    tree->frames.len = 0;
+    if (!tree_push_frame(tree, 0))
+        return TREE_NONE;
+
+    size_t i;
+    for (i = 0; i < tree->events.len; i++) {
+        const struct rust_demangle_event *event = &events[i];
+
+        // NOTE: `BEGIN_*` kinds are even, and `END_*` kinds are odd.
+        if (event->kind % 2 == 0) {
+            if (!tree_push_text(tree, event->output_start) ||
+                !tree_push_frame(tree, event->output_start))
+                return TREE_NONE;
+        } else {
+            size_t node = tree_pop_frame(tree, event->output_end);
+            if (node == TREE_NONE ||
+                !tree_push_ref(tree, node, event->output_end))
+                return TREE_NONE;
+        }
+    }
+
+    // The root node also includes anything after the last event (e.g. the
+    // suffix, or `{size limit reached}`).
+    return tree_pop_frame(tree, tree->text.len);
+}
+
+size_t rust_demangle_tree_add(
+    struct rust_demangle_tree *tree, const char *mangled, size_t len
+) {
+    struct rust_demangle_options options;
+
+    options.flags = tree->flags;
+    options.max_depth = 0;
+    options.max_output = 0;
+    options.max_generic_depth = 0;
+    options.max_generic_args = 0;
+
+    tree->text.len = 0;
+    tree->events.len = 0;
+    tree->scratch_errored = false;
+
+    enum rust_demangle_status status = rust_demangle_with_events(
+        mangled, len, &options, tree_text_callback, tree_event_callback, tree
+    );
+    if (tree->scratch_errored)
+        return RUST_DEMANGLE_TREE_FAILED;
+
+    size_t root = TREE_NONE;
+    if (status != RUST_DEMANGLE_FAILED) {
+        root = tree_build(tree);
+        if (root == TREE_NONE)
+            return RUST_DEMANGLE_TREE_FAILED;
+    }
+
+    if (!tree_vec_push(&tree->roots, &root, 1, sizeof(root)))
+        return RUST_DEMANGLE_TREE_FAILED;
+    return tree->roots.len - 1;
+}
+
+// Like `struct fixed_buf` in `rust-demangle.c` (but without the NUL).
+struct tree_out {
+    char *ptr;
+    size_t len;
+    size_t cap;
+};
+
+static void tree_render_node(
+    const struct rust_demangle_tree *tree, size_t node, struct tree_out *out
+) {
+    const size_t *starts = (const size_t *)tree->node_starts.ptr;
+    const unsigned char *bytes = (const unsigned char *)tree->bytes.ptr;
+    const unsigned char *p = bytes + starts[node];
+    const unsigned char *end = bytes + starts[node + 1];
+
+    // NOTE: all nodes have been validated (or built) already, so the
+    // varints are always valid, and recursion is bounded by their depth.
+    while (p < end && out->len < out->cap) {
+        uint64_t item = 0;
+        tree_read_varint(&p, end, &item);
+        if (item & 1) {
+            tree_render_node(tree, (size_t)(item >> 1), out);
+        } else {
+            size_t len = (size_t)(item >> 1);
+            size_t available = out->cap - out->len;
+            size_t copy = len < available ? len : available;
+            memcpy(out->ptr + out->len, p, copy);
+            out->len += copy;
+            p += len;
+        }
+    }
+}
+
+bool rust_demangle_tree_render(
+    const struct rust_demangle_tree *tree, size_t index, char *out, size_t cap,
+    size_t *needed
+) {
+    if (needed)
+        *needed = 0;
+    if (cap > 0)
+        out[0] = '\0';
+
+    if (index >= tree->roots.len)
+        return false;
+    size_t root = ((const size_t *)tree->roots.ptr)[index];
+    if (root == TREE_NONE)
+        return false;
+
+    struct tree_out buf;
+
+    buf.ptr = out;
+    buf.len = 0;
+    buf.cap = cap > 0 ? cap - 1 : 0;
+
+    tree_render_node(tree, root, &buf);
+    if (cap > 0)
+        out[buf.len] = '\0';
+
+    if (needed)
+        *needed = ((const size_t *)tree->node_lens.ptr)[root];
+    return true;
+}
+
+// The encoding starts with this, followed by (as varints) the flags, the
+// number of nodes, each node's length and bytes, the number of symbols, and
+// each symbol's root node plus one (or `0` if it had failed to demangle).
+static const char tree_magic[4] = {'R', 'D', 'T', '1'};
+
+char *rust_demangle_tree_encode(
+    const struct rust_demangle_tree *tree, size_t *len
+) {
+    const size_t *starts = (const size_t *)tree->node_starts.ptr;
+    const size_t *roots = (const size_t *)tree->roots.ptr;
+    size_t count = tree_node_count(tree);
+    struct tree_vec out = {NULL, 0, 0};
+
+    bool ok = tree_vec_push(&out, tree_magic, sizeof(tree_magic), 1) &&
+              tree_push_varint(&out, (unsigned)tree->flags) &&
+              tree_push_varint(&out, count);
+    size_t i;
+    for (i = 0; ok && i < count; i++)
+        ok = tree_push_varint(&out, starts[i + 1] - starts[i]) &&
+             tree_vec_push(
+                 &out, (const char *)tree->bytes.ptr + starts[i],
+                 starts[i + 1] - starts[i], 1
+             );
+    ok = ok && tree_push_varint(&out, tree->roots.len);
+    for (i = 0; ok && i < tree->roots.len; i++)
+        ok = tree_push_varint(&out, roots[i] == TREE_NONE ? 0 : roots[i] + 1);
+
+    if (!ok) {
+        free(out.ptr);
+        return NULL;
+    }
+
+    // NOTE: an empty allocation could be `NULL`, but never is here.
+    *len = out.len;
+    return (char *)out.ptr;
+}
+
+// Check that the encoding of the next node (which will be node `count`) only
+// contains complete items, and only refers to earlier nodes, also computing
+// its rendered length and depth.
+static bool tree_validate_node(
+    const struct rust_demangle_tree *tree, const unsigned char *p,
+    const unsigned char *end, size_t *out_len, size_t *depth
+) {
+    *out_len = 0;
+    *depth = 1;
+    while (p < end) {
+        uint64_t item;
+        if (!tree_read_varint(&p, end, &item))
+            return false;
+        if (item & 1) {
+            uint64_t node = item >> 1;
+            if (node >= tree_node_count(tree))
+                return false;
+            size_t node_depth =
+                ((const uint16_t *)tree->node_depths.ptr)[node] + 1;
+            if (node_depth > *depth)
+                *depth = node_depth;
+            *out_len = saturating_add(
+                *out_len, ((const size_t *)tree->node_lens.ptr)[node]
+            );
+        } else {
+            uint64_t len = item >> 1;
+            if (len > (uint64_t)(end - p))
+                return false;
+            p += len;
+            *out_len = saturating_add(*out_len, (size_t)len);
+        }
+    }
+    return *depth <= TREE_MAX_DEPTH;
+}
+
+struct rust_demangle_tree *
+rust_demangle_tree_decode(const char *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + len;
+
+    if (len < sizeof(tree_magic) ||
+        memcmp(data, tree_magic, sizeof(tree_magic)) != 0)
+        return NULL;
+    p += sizeof(tree_magic);
+
+    uint64_t flags, count;
+    if (!tree_read_varint(&p, end, &flags) || flags > INT_MAX ||
+        !tree_read_varint(&p, end, &count))
+        return NULL;
+
+    struct rust_demangle_tree *tree = rust_demangle_tree_new((int)flags);
+    if (!tree)
+        return NULL;
+
+    uint64_t i;
+    for (i = 0; i < count; i++) {
+        uint64_t node_len;
+        size_t out_len, depth;
+        if (!tree_read_varint(&p, end, &node_len) ||
+            node_len > (uint64_t)(end - p) ||
+            !tree_validate_node(tree, p, p + node_len, &out_len, &depth))
+            goto invalid;
+
+        // NOTE: nodes aren't interned, as that could change their
+        // indices (if the encoding had any duplicates).
+        const char *node = (const char *)p;
+        if (tree_append_node(
+                tree, node, (size_t)node_len, fnv1a(node, (size_t)node_len),
+                out_len, depth
+            ) == TREE_NONE)
+            goto invalid;
+        p += node_len;
+    }
+
+    uint64_t symbols;
+    if (!tree_read_varint(&p, end, &symbols))
+        goto invalid;
+    for (i = 0; i < symbols; i++) {
+        uint64_t root;
+        if (!tree_read_varint(&p, end, &root) || root > count)
+            goto invalid;
+        size_t node = root == 0 ? TREE_NONE : (size_t)(root - 1);
+        if (!tree_vec_push(&tree->roots, &node, 1, sizeof(node)))
+            goto invalid;
+    }
+
+    if (p != end)
+        goto invalid;
+    return tree;
+
+invalid:
+    rust_demangle_tree_free(tree);
+    return NULL;
+}
+
+void rust_demangle_tree_get_stats(
+    const struct rust_demangle_tree *tree,
+    struct rust_demangle_tree_stats *stats
+) {
+    const size_t *roots = (const size_t *)tree->roots.ptr;
+    const size_t *lens = (const size_t *)tree->node_lens.ptr;
+
+    stats->symbols = tree->roots.len;
+    stats->nodes = tree_node_count(tree);
+    stats->node_bytes = tree->bytes.len;
+    stats->text_bytes = 0;
+
+    size_t i;
+    for (i = 0; i < tree->roots.len; i++)
+        if (roots[i] != TREE_NONE)
+            stats->text_bytes =
+                saturating_add(stats->text_bytes, lens[roots[i]]);
+}
@@ -0,0 +1,73 @@
+// Optional companion to `rust-demangle.c`, storing the demangling of many
+// symbols (e.g. a whole symbol database) compactly, by splitting each one
+// into its paths, types, consts and generic args (using the events from
+// `rust_demangle_with_events`), and interning all of them, so that e.g. the
+// `core::iter::adapters::map::Map` shared by many symbols is only kept once
+// (with every symbol/node referring to other nodes by index).
+// Requires `rust-demangle.c` to also be compiled in.
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Returns `NULL` if allocating the tree failed.
+struct rust_demangle_tree;
+struct rust_demangle_tree *rust_demangle_tree_new(int flags);
+void rust_demangle_tree_free(struct rust_demangle_tree *tree);
+
+// Demangle the `len` bytes of `mangled`, and add it to the tree, returning its
+// index (i.e. the number of symbols added before it), or, if allocation failed
+// (in which case nothing is added), `RUST_DEMANGLE_TREE_FAILED`.
+// Symbols which can't be demangled are still added (so that indices always
+// line up with the order of `rust_demangle_tree_add` calls), but rendering
+// them fails, like demangling them would've.
+#define RUST_DEMANGLE_TREE_FAILED ((size_t)-1)
+size_t rust_demangle_tree_add(
+    struct rust_demangle_tree *tree, const char *mangled, size_t len
+);
+
+// Render the symbol at `index` back into the same text `rust_demangle` would
+// produce, with the same semantics as `rust_demangle_into` (i.e. truncating
+// the output, but always reporting the length of the whole of it).
+// Returns `false` if `index` is out of bounds, or the symbol had failed to
+// demangle (in which case the output, and `*needed`, are empty).
+bool rust_demangle_tree_render(
+    const struct rust_demangle_tree *tree, size_t index, char *out, size_t cap,
+    size_t *needed
+);
+
+// Serialize the whole tree (e.g. to store it on disk), returning the encoding
+// in a single allocation (to release with `free`), and its length in `*len`,
+// or `NULL` if allocation failed. The encoding is deterministic (i.e. trees
+// built by adding the same symbols in the same order encode identically).
+char *rust_demangle_tree_encode(
+    const struct rust_demangle_tree *tree, size_t *len
+);
+
+// Load a tree from an encoding produced by `rust_demangle_tree_encode` (which
+// is copied, and fully validated, so that rendering can never misbehave),
+// that more symbols can also be added to. Returns `NULL` if the encoding is
+// invalid (or allocation failed).
+struct rust_demangle_tree *
+rust_demangle_tree_decode(const char *data, size_t len);
+
+struct rust_demangle_tree_stats {
+    size_t symbols;
+    size_t nodes;
+
+    // Total size of all the (interned) nodes, i.e. roughly the size of the
+    // encoding, vs the total length of the rendered text of all the symbols.
+    size_t node_bytes;
+    size_t text_bytes;
+};
+void rust_demangle_tree_get_stats(
+    const struct rust_demangle_tree *tree,
+    struct rust_demangle_tree_stats *stats
+);
+
+#ifdef __cplusplus
+}
+#endif
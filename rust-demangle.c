@@ -1,11 +1,141 @@
 // FIXME(eddyb) should this use `<rust-demangle.h>`?
 #include "rust-demangle.h"
 
-#include <inttypes.h>
-#include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef RUST_DEMANGLE_PTHREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Memory allocation, which can be redirected (e.g. to a custom allocator, or
+// to count allocations) by defining both of these macros, in which case any
+// memory returned by the API (e.g. `rust_demangle`'s result) has to be
+// released with `RUST_DEMANGLE_FREE`, instead of `free`.
+#ifndef RUST_DEMANGLE_REALLOC
+#define RUST_DEMANGLE_REALLOC realloc
+#endif
+#ifndef RUST_DEMANGLE_FREE
+#define RUST_DEMANGLE_FREE free
+#endif
+
+static void *zeroed_alloc(size_t count, size_t size) {
+    // Check for overflows.
+    if (size != 0 && count > (size_t)-1 / size)
+        return NULL;
+
+    void *ptr = RUST_DEMANGLE_REALLOC(NULL, count * size);
+    if (ptr)
+        memset(ptr, 0, count * size);
+    return ptr;
+}
+
+// Growable string buffers.
+struct str_buf {
+    char *ptr;
+    size_t len;
+    size_t cap;
+    bool errored;
+};
+
+static void str_buf_reserve(struct str_buf *buf, size_t extra) {
+    // Allocation failed before.
+    if (buf->errored)
+        return;
+
+    size_t available = buf->cap - buf->len;
+
+    if (extra <= available)
+        return;
+
+    size_t min_new_cap = buf->cap + (extra - available);
+
+    // Check for overflows.
+    if (min_new_cap < buf->cap) {
+        buf->errored = true;
+        return;
+    }
+
+    size_t new_cap = buf->cap;
+
+    if (new_cap == 0)
+        new_cap = 4;
+
+    // Double capacity until sufficiently large.
+    while (new_cap < min_new_cap) {
+        new_cap *= 2;
+
+        // Check for overflows.
+        if (new_cap < buf->cap) {
+            buf->errored = true;
+            return;
+        }
+    }
+
+    char *new_ptr = (char *)RUST_DEMANGLE_REALLOC(buf->ptr, new_cap);
+    if (new_ptr == NULL) {
+        RUST_DEMANGLE_FREE(buf->ptr);
+        buf->ptr = NULL;
+        buf->len = 0;
+        buf->cap = 0;
+        buf->errored = true;
+    } else {
+        buf->ptr = new_ptr;
+        buf->cap = new_cap;
+    }
+}
+
+static void str_buf_append(struct str_buf *buf, const char *data, size_t len) {
+    str_buf_reserve(buf, len);
+    if (buf->errored)
+        return;
+
+    memcpy(buf->ptr + buf->len, data, len);
+    buf->len += len;
+}
+
+static void
+str_buf_demangle_callback(const char *data, size_t len, void *opaque) {
+    str_buf_append(opaque, data, len);
+}
+
+// The output previously printed by following a backref to `target` (as the
+// `kind` of syntax, see `enum backref_kind`), which can be reused as long as
+// the state it depended on is the same (or, for `depth`, low enough).
+struct backref_memo {
+    size_t target;
+    uint8_t kind;
+    uint64_t bound_lifetime_depth;
+    size_t generic_depth;
+
+    // How much deeper than the backref itself demangling its target went.
+    size_t extra_depth;
+
+    // Range of `memo_output` printed for it.
+    size_t output_start;
+    size_t output_len;
+};
+
+// Where the leading path of the symbol (see `begin_interned_prefix`) was
+// found, if at all (`mangled_end` is `0` otherwise), and, unless it was
+// already interned (as the prefix at `index`), the length of its output.
+struct interned_prefix_state {
+    size_t mangled_start;
+    size_t mangled_end;
+    uint64_t hash;
+    size_t index;
+    size_t output_len;
+};
+#define INTERNED_PREFIX_NONE ((size_t)-1)
+
 struct rust_demangler {
     const char *sym;
     size_t sym_len;
@@ -13,27 +143,104 @@ struct rust_demangler {
     void *callback_opaque;
     void (*callback)(const char *data, size_t len, void *opaque);
 
+    // Heap-allocated scratch space (used for punycode decoding), which is
+    // kept around (and reused) between identifiers, and even symbols.
+    struct str_buf *scratch;
+
+    // Output not yet passed to `callback`, which is only called once this
+    // buffer fills up (or at the very end), instead of for every fragment.
+    char out[256];
+    size_t out_len;
+
     // Position of the next character to read from the symbol.
     size_t next;
 
     // `true` if any error occurred.
     bool errored;
 
+    // Number of backrefs currently being followed. Like in `rustc-demangle`,
+    // errors which occur while following a backref only affect the output
+    // of that backref (with the error message, e.g. `{invalid syntax}`, and
+    // `?` for anything that couldn't be parsed afterwards, printed instead),
+    // as backrefs are followed only for printing, i.e. the rest of the symbol
+    // has already been validated (and so demangling can resume after it).
+    size_t backref_nesting;
+
+    // Current nesting depth (of paths, types, consts and backrefs), which
+    // bounds recursion, and its limit (see `struct rust_demangle_options`).
+    size_t depth;
+    size_t max_depth;
+
+    // Highest `depth` reached so far (or `SIZE_MAX`, once the limit has
+    // been hit), used to tell whether memoized backrefs can be reused.
+    size_t peak_depth;
+
+    // Output length still allowed (see `struct rust_demangle_options`), and
+    // whether printing had to stop early because more output was attempted.
+    size_t max_output;
+    size_t output_remaining;
+    bool output_too_big;
+
     // `true` if nothing should be printed.
     bool skipping_printing;
 
+    // `RUST_DEMANGLE_FLAG_CRATE_ONLY` and/or `RUST_DEMANGLE_FLAG_LEAF_ONLY`, if
+    // only part of the symbol's path is printed, with `partial_path` holding
+    // the parts `demangle_path` is still on the way to (see `demangle_path`).
+    int partial_flags;
+    int partial_path;
+
+    // `true` if generic args are only parsed, and never printed (see
+    // `RUST_DEMANGLE_FLAG_NO_GENERICS`), so no backrefs in them are followed.
+    bool no_generics;
+
+    // Number of lists of generic args currently being printed, and the limits
+    // on printing them (see `struct rust_demangle_options`, with `SIZE_MAX`
+    // instead of `0` for no limit).
+    size_t generic_depth;
+    size_t max_generic_depth;
+    size_t max_generic_args;
+
+    // `true` if the symbol is only being validated (see
+    // `rust_demangle_classify`), i.e. printing is skipped from the start.
+    bool validate_only;
+
     // `true` if printing should be verbose (e.g. include hashes).
     bool verbose;
 
+    // `true` if the output of backrefs should be memoized (see `begin_backref`
+    // and `RUST_DEMANGLE_FLAG_MEMOIZE_BACKREFS`), in which case any output
+    // printed while following backrefs is also kept in `memo_output`.
+    bool memoize_backrefs;
+    struct str_buf memo_output;
+    struct backref_memo memo[16];
+
+    // Called with the structure of the output (see `rust_demangle_with_events`)
+    // if not `NULL`, with `open_events` holding (as an array of `struct
+    // open_event`) all the `BEGIN_*` events not yet ended, and `prefix_len`
+    // being the length of the prefix (e.g. `_R`) that `sym` starts after.
+    void (*on_event)(const struct rust_demangle_event *event, void *opaque);
+    struct str_buf open_events;
+    size_t prefix_len;
+
+    // Set by `rust_demangle_prefix_batch_add` (and otherwise `NULL`), which
+    // interns the leading path of each symbol (see `begin_interned_prefix`),
+    // with `at_interned_prefix` only `true` until `demangle_path` finds it.
+    struct rust_demangle_prefix_batch *prefix_batch;
+    bool at_interned_prefix;
+    struct interned_prefix_state interned;
+
     // Rust mangling version, with legacy mangling being -1.
     int version;
 
     uint64_t bound_lifetime_depth;
 };
 
+static void report_error(struct rust_demangler *rdm, const char *message);
+
 #define ERROR_AND(x)                                                           \
     do {                                                                       \
-        rdm->errored = true;                                                   \
+        report_error(rdm, "{invalid syntax}");                                 \
         x;                                                                     \
     } while (0)
 #define CHECK_OR(cond, x)                                                      \
@@ -49,8 +256,18 @@ struct rust_demangler {
 
 // Parsing functions.
 
+static bool is_symbol_like_char(char c) {
+    // FIXME match is_symbol_like from rustc-demangle
+    return IS_LOWER(c) || IS_UPPER(c) || IS_DIGIT(c) || c == '.';
+}
+
+static bool is_llvm_suffix(const char *sym, size_t len, size_t pos) {
+    return len - pos >= 6 && memcmp(sym + pos, ".llvm.", 6) == 0;
+}
+
 static char peek(const struct rust_demangler *rdm) {
-    if (rdm->next < rdm->sym_len)
+    // NOTE: this makes `eat` always fail after an error.
+    if (!rdm->errored && rdm->next < rdm->sym_len)
         return rdm->sym[rdm->next];
     return 0;
 }
@@ -83,8 +300,9 @@ static struct hex_nibbles parse_hex_nibbles(struct rust_demangler *rdm) {
 
     size_t start = rdm->next, hex_len = 0;
     while (!eat(rdm, '_')) {
-        char c = next(rdm);
+        char c = peek(rdm);
         CHECK_OR(IS_DIGIT(c) || (c >= 'a' && c <= 'f'), return hex);
+        rdm->next++;
         hex_len++;
     }
 
@@ -96,7 +314,8 @@ static struct hex_nibbles parse_hex_nibbles(struct rust_demangler *rdm) {
 static struct hex_nibbles
 parse_hex_nibbles_for_const_uint(struct rust_demangler *rdm) {
     struct hex_nibbles hex = parse_hex_nibbles(rdm);
-    CHECK_OR(!rdm->errored, return hex);
+    if (rdm->errored)
+        return hex;
 
     // Trim leading `0`s.
     while (hex.nibbles_len > 0 && *hex.nibbles == '0') {
@@ -110,7 +329,9 @@ parse_hex_nibbles_for_const_uint(struct rust_demangler *rdm) {
 static struct hex_nibbles
 parse_hex_nibbles_for_const_bytes(struct rust_demangler *rdm) {
     struct hex_nibbles hex = parse_hex_nibbles(rdm);
-    CHECK_OR(!rdm->errored && (hex.nibbles_len % 2 == 0), return hex);
+    if (rdm->errored)
+        return hex;
+    CHECK_OR(hex.nibbles_len % 2 == 0, return hex);
     return hex;
 }
 
@@ -124,24 +345,32 @@ static uint64_t parse_integer_62(struct rust_demangler *rdm) {
 
     uint64_t x = 0;
     while (!eat(rdm, '_')) {
-        char c = next(rdm);
-        x *= 62;
+        char c = peek(rdm);
+        uint64_t d;
         if (IS_DIGIT(c))
-            x += c - '0';
+            d = c - '0';
         else if (IS_LOWER(c))
-            x += 10 + (c - 'a');
+            d = 10 + (c - 'a');
         else if (IS_UPPER(c))
-            x += 10 + 26 + (c - 'A');
+            d = 10 + 26 + (c - 'A');
         else
             ERROR_AND(return 0);
+        rdm->next++;
+
+        // Check for overflows.
+        CHECK_OR(x <= (UINT64_MAX - d) / 62, return 0);
+        x = x * 62 + d;
     }
+    CHECK_OR(x < UINT64_MAX, return 0);
     return x + 1;
 }
 
 static uint64_t parse_opt_integer_62(struct rust_demangler *rdm, char tag) {
     if (!eat(rdm, tag))
         return 0;
-    return 1 + parse_integer_62(rdm);
+    uint64_t x = parse_integer_62(rdm);
+    CHECK_OR(x < UINT64_MAX, return 0);
+    return 1 + x;
 }
 
 static uint64_t parse_disambiguator(struct rust_demangler *rdm) {
@@ -171,13 +400,18 @@ static struct rust_mangled_ident parse_ident(struct rust_demangler *rdm) {
         is_punycode = eat(rdm, 'u');
     }
 
-    char c = next(rdm);
+    char c = peek(rdm);
     CHECK_OR(IS_DIGIT(c), return ident);
+    rdm->next++;
     size_t len = c - '0';
 
     if (c != '0')
-        while (IS_DIGIT(peek(rdm)))
-            len = len * 10 + (next(rdm) - '0');
+        while (IS_DIGIT(peek(rdm))) {
+            size_t d = next(rdm) - '0';
+            // Check for overflows.
+            CHECK_OR(len <= (SIZE_MAX - d) / 10, return ident);
+            len = len * 10 + d;
+        }
 
     if (rdm->version != -1) {
         // Skip past the optional `_` separator.
@@ -189,6 +423,17 @@ static struct rust_mangled_ident parse_ident(struct rust_demangler *rdm) {
     // Check for overflows.
     CHECK_OR((start <= rdm->next) && (rdm->next <= rdm->sym_len), return ident);
 
+    // Rust symbols only use ASCII characters, and can't contain `.llvm.`
+    // suffixes (which would otherwise end the symbol before this identifier).
+    for (size_t i = start; i < rdm->next; i++) {
+        char c = rdm->sym[i];
+        CHECK_OR(c != 0 && (c & 0x80) == 0, return ident);
+        CHECK_OR(
+            c != '.' || !is_llvm_suffix(rdm->sym, rdm->sym_len, i),
+            return ident
+        );
+    }
+
     ident.ascii = rdm->sym + start;
     ident.ascii_len = len;
 
@@ -215,29 +460,136 @@ static struct rust_mangled_ident parse_ident(struct rust_demangler *rdm) {
 
 // Printing functions.
 
+static void flush_output(struct rust_demangler *rdm) {
+    if (rdm->out_len > 0) {
+        rdm->callback(rdm->out, rdm->out_len, rdm->callback_opaque);
+        rdm->out_len = 0;
+    }
+}
+
+// Printing is skipped either explicitly, or after any error which causes
+// demangling to fail (i.e. outside of backrefs, see `backref_nesting`).
+static bool is_printing(const struct rust_demangler *rdm) {
+    return !rdm->skipping_printing &&
+           !(rdm->errored && rdm->backref_nesting == 0);
+}
+
+// Pass `data` on to `callback` (eventually), bypassing all the checks done by
+// `print_str` (which should be used instead by all the demangling functions).
+static void
+append_output(struct rust_demangler *rdm, const char *data, size_t len) {
+    // NOTE: only output printed while following backrefs can ever be
+    // memoized, so nothing else has to be kept around.
+    if (rdm->memoize_backrefs && rdm->backref_nesting > 0)
+        str_buf_append(&rdm->memo_output, data, len);
+
+    if (len > sizeof(rdm->out) - rdm->out_len) {
+        flush_output(rdm);
+
+        // Don't bother buffering anything that wouldn't fit anyway.
+        if (len > sizeof(rdm->out)) {
+            rdm->callback(data, len, rdm->callback_opaque);
+            return;
+        }
+    }
+
+    memcpy(rdm->out + rdm->out_len, data, len);
+    rdm->out_len += len;
+}
+
 static void
 print_str(struct rust_demangler *rdm, const char *data, size_t len) {
-    if (!rdm->errored && !rdm->skipping_printing)
-        rdm->callback(data, len, rdm->callback_opaque);
+    // Empty identifiers have a `NULL` `data`, which can't be passed to
+    // `memcpy` (or the callback), even with a `len` of `0`.
+    if (!is_printing(rdm) || len == 0)
+        return;
+
+    // Like in `rustc-demangle`, printing stops before the first piece of
+    // output which would exceed the limit, but demangling continues in "skip
+    // printing" mode (which doesn't follow backrefs, so it can't blow up), to
+    // validate the rest of the symbol, and find its suffix.
+    if (len > rdm->output_remaining) {
+        rdm->output_too_big = true;
+        rdm->skipping_printing = true;
+        return;
+    }
+    rdm->output_remaining -= len;
+
+    append_output(rdm, data, len);
+}
+
+// NOTE: the `""` forces `s` to be a string literal, so that its length
+// can be computed at compile-time (use `print_str` for anything else).
+#define PRINT(s) print_str(rdm, "" s, sizeof(s) - 1)
+
+static void report_error(struct rust_demangler *rdm, const char *message) {
+    rdm->errored = true;
+    print_str(rdm, message, strlen(message));
 }
 
-#define PRINT(s) print_str(rdm, s, strlen(s))
+// Like `rustc-demangle`'s `parse!`: `expr` (which may error) is only evaluated
+// if no errors occurred so far, otherwise `?` is printed in its place (as
+// the error message was already printed), and `x` is used to stop early.
+#define PARSE_OR(expr, x)                                                      \
+    do {                                                                       \
+        if (rdm->errored) {                                                    \
+            PRINT("?");                                                        \
+            x;                                                                 \
+        }                                                                      \
+        expr;                                                                  \
+        if (rdm->errored)                                                      \
+            x;                                                                 \
+    } while (0)
+
+// All the pairs of decimal digits, from `00` to `99`, so that numbers can be
+// converted to decimal two digits at a time.
+static const char decimal_digit_pairs[] = "00010203040506070809"
+                                          "10111213141516171819"
+                                          "20212223242526272829"
+                                          "30313233343536373839"
+                                          "40414243444546474849"
+                                          "50515253545556575859"
+                                          "60616263646566676869"
+                                          "70717273747576777879"
+                                          "80818283848586878889"
+                                          "90919293949596979899";
 
 static void print_uint64(struct rust_demangler *rdm, uint64_t x) {
-    char s[21];
-    sprintf(s, "%" PRIu64, x);
-    PRINT(s);
+    // NOTE: the digits are produced (and so written) backwards.
+    char s[20];
+    size_t start = sizeof(s);
+    while (x >= 100) {
+        start -= 2;
+        memcpy(s + start, &decimal_digit_pairs[(x % 100) * 2], 2);
+        x /= 100;
+    }
+    if (x >= 10) {
+        start -= 2;
+        memcpy(s + start, &decimal_digit_pairs[x * 2], 2);
+    } else {
+        s[--start] = '0' + x;
+    }
+    print_str(rdm, s + start, sizeof(s) - start);
 }
 
 static void print_uint64_hex(struct rust_demangler *rdm, uint64_t x) {
-    char s[17];
-    sprintf(s, "%" PRIx64, x);
-    PRINT(s);
+    // NOTE: the digits are produced (and so written) backwards.
+    char s[16];
+    size_t start = sizeof(s);
+    do {
+        s[--start] = "0123456789abcdef"[x & 0xf];
+        x >>= 4;
+    } while (x != 0);
+    print_str(rdm, s + start, sizeof(s) - start);
+}
+
+static bool is_unicode_scalar_value(uint32_t c) {
+    return c < 0xd800 || (c > 0xdfff && c <= 0x10ffff);
 }
 
 static void
 print_quoted_escaped_char(struct rust_demangler *rdm, char quote, uint32_t c) {
-    CHECK_OR(c < 0xd800 || (c > 0xdfff && c < 0x10ffff), return);
+    CHECK_OR(is_unicode_scalar_value(c), return);
 
     switch (c) {
     case '\0':
@@ -284,44 +636,26 @@ print_quoted_escaped_char(struct rust_demangler *rdm, char quote, uint32_t c) {
         } else {
             // FIXME show printable unicode characters without hex encoding
             PRINT("\\u{");
-            char s[9] = {0};
-            sprintf(s, "%" PRIx32, c);
-            PRINT(s);
+            print_uint64_hex(rdm, c);
             PRINT("}");
         }
     }
 }
 
-static void
-print_ident(struct rust_demangler *rdm, struct rust_mangled_ident ident) {
-    if (rdm->errored || rdm->skipping_printing)
-        return;
-
-    if (!ident.punycode) {
-        print_str(rdm, ident.ascii, ident.ascii_len);
-        return;
-    }
-
-    size_t len = 0;
-    size_t cap = 4;
-    while (cap < ident.ascii_len) {
-        cap *= 2;
-        // Check for overflows.
-        CHECK_OR((cap * 4) / 4 == cap, return);
-    }
-
-    // Store the output codepoints as groups of 4 UTF-8 bytes.
-    uint8_t *out = (uint8_t *)malloc(cap * 4);
-    CHECK_OR(out, return);
+// Punycode identifiers of up to this many characters are decoded on the stack
+// (`rustc-demangle` only supports this many, using a fixed-size buffer), and
+// any longer ones on the heap, in `rdm->scratch`.
+#define SMALL_PUNYCODE_LEN 128
 
+/// Decode the punycode (and ASCII) parts of `ident` into characters (written
+/// to `out`, which has to have space for at least `ident.ascii_len` plus
+/// `ident.punycode_len` of them), returning how many were decoded, or
+/// `SIZE_MAX` if the punycode is invalid.
+static size_t punycode_decode(struct rust_mangled_ident ident, uint32_t *out) {
     // Populate initial output from ASCII fragment.
-    for (len = 0; len < ident.ascii_len; len++) {
-        uint8_t *p = out + 4 * len;
-        p[0] = 0;
-        p[1] = 0;
-        p[2] = 0;
-        p[3] = ident.ascii[len];
-    }
+    size_t len;
+    for (len = 0; len < ident.ascii_len; len++)
+        out[len] = (uint8_t)ident.ascii[len];
 
     // Punycode parameters and initial state.
     size_t base = 36;
@@ -331,71 +665,65 @@ print_ident(struct rust_demangler *rdm, struct rust_mangled_ident ident) {
     size_t damp = 700;
     size_t bias = 72;
     size_t i = 0;
-    uint32_t c = 0x80;
+    size_t c = 0x80;
 
     size_t punycode_pos = 0;
-    while (punycode_pos < ident.punycode_len) {
+    while (1) {
         // Read one delta value.
         size_t delta = 0;
         size_t w = 1;
         size_t k = 0;
-        size_t t;
-        uint8_t d;
-        do {
+        while (1) {
             k += base;
-            t = k < bias ? 0 : (k - bias);
+            size_t t = k < bias ? 0 : (k - bias);
             if (t < t_min)
                 t = t_min;
             if (t > t_max)
                 t = t_max;
 
-            CHECK_OR(punycode_pos < ident.punycode_len, goto cleanup);
-            d = ident.punycode[punycode_pos++];
+            if (punycode_pos == ident.punycode_len)
+                return SIZE_MAX;
+            size_t d = (uint8_t)ident.punycode[punycode_pos++];
 
             if (IS_LOWER(d))
                 d = d - 'a';
             else if (IS_DIGIT(d))
                 d = 26 + (d - '0');
             else
-                ERROR_AND(goto cleanup);
+                return SIZE_MAX;
 
+            // Check for overflows.
+            if (d != 0 && w > (SIZE_MAX - delta) / d)
+                return SIZE_MAX;
             delta += d * w;
+            if (d < t)
+                break;
+            if (w > SIZE_MAX / (base - t))
+                return SIZE_MAX;
             w *= base - t;
-        } while (d >= t);
+        }
 
         // Compute the new insert position and character.
         len++;
+        // Check for overflows.
+        if (delta > SIZE_MAX - i || (i + delta) / len > SIZE_MAX - c)
+            return SIZE_MAX;
         i += delta;
         c += i / len;
         i %= len;
-
-        // Ensure enough space is available.
-        if (cap < len) {
-            cap *= 2;
-            // Check for overflows.
-            CHECK_OR((cap * 4) / 4 == cap, goto cleanup);
-            CHECK_OR(cap >= len, goto cleanup);
-        }
-        uint8_t *p = (uint8_t *)realloc(out, cap * 4);
-        CHECK_OR(p, goto cleanup);
-        out = p;
-
-        // Move the characters after the insert position.
-        p = out + i * 4;
-        memmove(p + 4, p, (len - i - 1) * 4);
-
-        // Insert the new character, as UTF-8 bytes.
-        p[0] = c >= 0x10000 ? 0xf0 | (c >> 18) : 0;
-        p[1] =
-            c >= 0x800 ? (c < 0x10000 ? 0xe0 : 0x80) | ((c >> 12) & 0x3f) : 0;
-        p[2] = (c < 0x800 ? 0xc0 : 0x80) | ((c >> 6) & 0x3f);
-        p[3] = 0x80 | (c & 0x3f);
+        if (c > 0x10ffff || !is_unicode_scalar_value(c))
+            return SIZE_MAX;
+
+        // Move the characters after the insert position, and insert the new
+        // character (each punycode delta takes up at least one byte, so this
+        // can never exceed the space available in `out`).
+        memmove(out + i + 1, out + i, (len - i - 1) * sizeof(uint32_t));
+        out[i] = c;
+        i++;
 
         // If there are no more deltas, decoding is complete.
         if (punycode_pos == ident.punycode_len)
-            break;
-
-        i++;
+            return len;
 
         // Perform bias adaptation.
         delta /= damp;
@@ -409,17 +737,76 @@ print_ident(struct rust_demangler *rdm, struct rust_mangled_ident ident) {
         }
         bias = k + ((base - t_min + 1) * delta) / (delta + skew);
     }
+}
+
+static void
+print_ident(struct rust_demangler *rdm, struct rust_mangled_ident ident) {
+    if (!is_printing(rdm))
+        return;
+
+    if (!ident.punycode) {
+        print_str(rdm, ident.ascii, ident.ascii_len);
+        return;
+    }
 
-    // Remove all the 0 bytes to leave behind an UTF-8 string.
-    size_t j;
-    for (i = 0, j = 0; i < len * 4; i++)
-        if (out[i] != 0)
-            out[j++] = out[i];
+    // NOTE: both lengths are bounded by the symbol length, so this
+    // can't overflow, and it's an upper bound for the number of characters.
+    size_t max_len = ident.ascii_len + ident.punycode_len;
+    uint32_t small[SMALL_PUNYCODE_LEN];
+    uint32_t *chars = small;
+    if (max_len > SMALL_PUNYCODE_LEN) {
+        struct str_buf *scratch = rdm->scratch;
+        scratch->len = 0;
+        scratch->errored = false;
 
-    print_str(rdm, (const char *)out, j);
+        // Check for overflows.
+        CHECK_OR(max_len < SIZE_MAX / sizeof(uint32_t), return);
+        str_buf_reserve(scratch, max_len * sizeof(uint32_t));
+        CHECK_OR(!scratch->errored, return);
+        chars = (uint32_t *)scratch->ptr;
+    }
 
-cleanup:
-    free(out);
+    size_t len = punycode_decode(ident, chars);
+    if (len == SIZE_MAX) {
+        // Like `rustc-demangle`, reconstruct a standard punycode encoding
+        // (by using `-` as the separator) instead.
+        PRINT("punycode{");
+        if (ident.ascii_len > 0) {
+            print_str(rdm, ident.ascii, ident.ascii_len);
+            PRINT("-");
+        }
+        print_str(rdm, ident.punycode, ident.punycode_len);
+        PRINT("}");
+        return;
+    }
+
+    // Encode the characters as UTF-8, printing them one at a time (which,
+    // like in `rustc-demangle`, determines where the output limit is hit).
+    for (size_t i = 0; i < len; i++) {
+        uint32_t c = chars[i];
+        char utf8[4];
+        size_t utf8_len;
+        if (c < 0x80) {
+            utf8[0] = c;
+            utf8_len = 1;
+        } else if (c < 0x800) {
+            utf8[0] = 0xc0 | (c >> 6);
+            utf8[1] = 0x80 | (c & 0x3f);
+            utf8_len = 2;
+        } else if (c < 0x10000) {
+            utf8[0] = 0xe0 | (c >> 12);
+            utf8[1] = 0x80 | ((c >> 6) & 0x3f);
+            utf8[2] = 0x80 | (c & 0x3f);
+            utf8_len = 3;
+        } else {
+            utf8[0] = 0xf0 | (c >> 18);
+            utf8[1] = 0x80 | ((c >> 12) & 0x3f);
+            utf8[2] = 0x80 | ((c >> 6) & 0x3f);
+            utf8[3] = 0x80 | (c & 0x3f);
+            utf8_len = 4;
+        }
+        print_str(rdm, utf8, utf8_len);
+    }
 }
 
 /// Print the lifetime according to the previously decoded index.
@@ -444,103 +831,737 @@ static void print_lifetime_from_index(struct rust_demangler *rdm, uint64_t lt) {
     }
 }
 
-// Demangling functions.
+// Structured output (see `rust_demangle_with_events`).
 
-static void demangle_binder(struct rust_demangler *rdm);
-static void demangle_path(struct rust_demangler *rdm, bool in_value);
-static void demangle_generic_arg(struct rust_demangler *rdm);
-static void demangle_type(struct rust_demangler *rdm);
-static bool demangle_path_maybe_open_generics(struct rust_demangler *rdm);
-static void demangle_dyn_trait(struct rust_demangler *rdm);
-static void demangle_const(struct rust_demangler *rdm, bool in_value);
-static void demangle_const_uint(struct rust_demangler *rdm, char ty_tag);
-static void demangle_const_str_literal(struct rust_demangler *rdm);
+// A `BEGIN_*` event that hasn't been ended yet.
+struct open_event {
+    enum rust_demangle_event_kind kind;
+    char tag;
+    size_t mangled_start;
+    size_t output_start;
+};
 
-/// Optionally enter a binder ('G') for late-bound lifetimes,
-/// printing e.g. `for<'a, 'b> `, and make those lifetimes visible
-/// to the caller (via depth level, which the caller should reset).
-static void demangle_binder(struct rust_demangler *rdm) {
-    CHECK_OR(!rdm->errored, return);
+// Length of the output printed so far (excluding the suffix).
+static size_t output_pos(const struct rust_demangler *rdm) {
+    return rdm->max_output - rdm->output_remaining;
+}
 
-    uint64_t bound_lifetimes = parse_opt_integer_62(rdm, 'G');
-    if (bound_lifetimes > 0) {
-        PRINT("for<");
-        for (uint64_t i = 0; i < bound_lifetimes; i++) {
-            if (i > 0)
-                PRINT(", ");
-            rdm->bound_lifetime_depth++;
-            print_lifetime_from_index(rdm, 1);
-        }
-        PRINT("> ");
-    }
+static size_t count_open_events(const struct rust_demangler *rdm) {
+    return rdm->open_events.len / sizeof(struct open_event);
 }
 
-static void demangle_path(struct rust_demangler *rdm, bool in_value) {
-    CHECK_OR(!rdm->errored, return);
+// Events are only emitted for what's actually printed.
+static bool is_emitting_events(const struct rust_demangler *rdm) {
+    return rdm->on_event && is_printing(rdm) && !rdm->errored &&
+           !rdm->open_events.errored;
+}
 
-    char tag = next(rdm);
-    switch (tag) {
-    case 'C': {
-        uint64_t dis = parse_disambiguator(rdm);
-        struct rust_mangled_ident name = parse_ident(rdm);
+static void emit_event(
+    struct rust_demangler *rdm, enum rust_demangle_event_kind kind, char tag,
+    size_t mangled_start, size_t output_start, uint64_t value
+) {
+    // NOTE: `BEGIN_*` kinds are even (and before all the leaf kinds),
+    // and only their start is known (see `struct rust_demangle_event`).
+    bool is_begin = kind < RUST_DEMANGLE_EVENT_CRATE && kind % 2 == 0;
+
+    struct rust_demangle_event event;
+
+    event.kind = kind;
+    event.tag = tag;
+    event.mangled_start = rdm->prefix_len + mangled_start;
+    event.mangled_end = rdm->prefix_len + rdm->next;
+    event.output_start = output_start;
+    event.output_end = output_pos(rdm);
+    event.disambiguator = 0;
+    event.lifetime = 0;
+
+    if (is_begin)
+        event.mangled_end = event.mangled_start;
+    if (is_begin)
+        event.output_end = event.output_start;
+
+    if (kind == RUST_DEMANGLE_EVENT_LIFETIME ||
+        kind == RUST_DEMANGLE_EVENT_BINDER)
+        event.lifetime = value;
+    else if (kind == RUST_DEMANGLE_EVENT_CRATE ||
+             kind == RUST_DEMANGLE_EVENT_NAMESPACE)
+        event.disambiguator = value;
+
+    rdm->on_event(&event, rdm->callback_opaque);
+}
 
-        print_ident(rdm, name);
-        if (rdm->verbose) {
-            PRINT("[");
-            print_uint64_hex(rdm, dis);
-            PRINT("]");
-        }
-        break;
-    }
-    case 'N': {
-        char ns = next(rdm);
-        CHECK_OR(IS_LOWER(ns) || IS_UPPER(ns), return);
+/// Emit a leaf event (i.e. one without `BEGIN_*`/`END_*` variants), for the
+/// syntax (and output) from `mangled_start` (and `output_start`) up to now.
+static void emit_leaf_event(
+    struct rust_demangler *rdm, enum rust_demangle_event_kind kind, char tag,
+    size_t mangled_start, size_t output_start, uint64_t value
+) {
+    if (is_emitting_events(rdm))
+        emit_event(rdm, kind, tag, mangled_start, output_start, value);
+}
 
-        demangle_path(rdm, in_value);
+/// Emit the `BEGIN_*` event `kind`, for the syntax starting at `mangled_start`
+/// (and at the current output position), returning the number of events that
+/// were already open, to later pass to `end_events`.
+static size_t begin_event(
+    struct rust_demangler *rdm, enum rust_demangle_event_kind kind, char tag,
+    size_t mangled_start
+) {
+    // NOTE: this is checked first, as it's the common case.
+    if (!rdm->on_event)
+        return 0;
 
-        uint64_t dis = parse_disambiguator(rdm);
-        struct rust_mangled_ident name = parse_ident(rdm);
+    size_t already_open = count_open_events(rdm);
+    if (!is_emitting_events(rdm))
+        return already_open;
 
-        if (IS_UPPER(ns)) {
-            // Special namespaces, like closures and shims.
-            PRINT("::{");
-            switch (ns) {
-            case 'C':
-                PRINT("closure");
-                break;
-            case 'S':
-                PRINT("shim");
-                break;
-            default:
-                print_str(rdm, &ns, 1);
-            }
-            if (name.ascii || name.punycode) {
-                PRINT(":");
-                print_ident(rdm, name);
-            }
-            PRINT("#");
-            print_uint64(rdm, dis);
-            PRINT("}");
-        } else {
-            // Implementation-specific/unspecified namespaces.
+    struct open_event open;
 
-            if (name.ascii || name.punycode) {
-                PRINT("::");
-                print_ident(rdm, name);
-            }
-        }
+    open.kind = kind;
+    open.tag = tag;
+    open.mangled_start = mangled_start;
+    open.output_start = output_pos(rdm);
+
+    str_buf_append(&rdm->open_events, (const char *)&open, sizeof(open));
+    if (!rdm->open_events.errored)
+        emit_event(rdm, kind, tag, mangled_start, open.output_start, 0);
+    return already_open;
+}
+
+/// End all the events begun since there were `already_open` open events (as
+/// returned by `begin_event`), with their respective `END_*` events.
+/// NOTE: this may end more than just the last event begun, as events
+/// begun by functions which stopped early (due to errors) are left open, and
+/// so is everything while still in an error state (i.e. until the backref the
+/// error happened in is left, if any, as otherwise demangling fails anyway).
+static void end_events(struct rust_demangler *rdm, size_t already_open) {
+    if (!rdm->on_event || rdm->errored)
+        return;
+
+    struct open_event *open_events = (struct open_event *)rdm->open_events.ptr;
+    while (count_open_events(rdm) > already_open) {
+        rdm->open_events.len -= sizeof(struct open_event);
+        struct open_event *open = &open_events[count_open_events(rdm)];
+
+        // NOTE: every `END_*` kind directly follows its `BEGIN_*` kind.
+        emit_event(
+            rdm, (enum rust_demangle_event_kind)(open->kind + 1), open->tag,
+            open->mangled_start, open->output_start, 0
+        );
+    }
+}
+
+/// Print a lifetime (see `print_lifetime_from_index`), as a `LIFETIME` event
+/// for the syntax starting at `mangled_start`.
+static void
+print_lifetime(struct rust_demangler *rdm, size_t mangled_start, uint64_t lt) {
+    size_t output_start = output_pos(rdm);
+    print_lifetime_from_index(rdm, lt);
+    emit_leaf_event(
+        rdm, RUST_DEMANGLE_EVENT_LIFETIME, 'L', mangled_start, output_start, lt
+    );
+}
+
+// Interned prefixes (see `rust_demangle_prefix_batch_add`).
+
+// The leading path of some symbol(s), as `key_len` bytes of mangled syntax (at
+// `key_start` in `keys`), and its output (at `text_start` in `prefix_text`).
+struct interned_prefix {
+    size_t key_start;
+    size_t key_len;
+    size_t text_start;
+    size_t text_len;
+};
+
+// A symbol added to a `rust_demangle_prefix_batch`, which (if `success`)
+// demangled to the output of its interned `prefix` (unless that's
+// `INTERNED_PREFIX_NONE`), followed by `text_len` bytes at `text_start`.
+struct prefix_batch_symbol {
+    bool success;
+    size_t prefix;
+    size_t text_start;
+    size_t text_len;
+};
+
+// The index (plus one, with `0` for empty slots) of an interned prefix, along
+// with its hash (so that most mismatches don't have to look at the prefix).
+struct prefix_batch_slot {
+    uint64_t hash;
+    size_t index_plus_one;
+};
+
+struct rust_demangle_prefix_batch {
+    struct rust_demangler rdm;
+    struct str_buf scratch;
+
+    // All the prefixes (as an array of `struct interned_prefix`), and their
+    // mangled and demangled forms, back to back.
+    struct str_buf prefixes;
+    struct str_buf keys;
+    struct str_buf prefix_text;
+
+    // Open-addressing (linear probing) hash table of `prefixes`, and kept at
+    // most half full.
+    struct prefix_batch_slot *slots;
+    size_t slots_cap;
+
+    // All the symbols (as an array of `struct prefix_batch_symbol`), and the
+    // rest of their output (i.e. after their prefix), back to back.
+    struct str_buf symbols;
+    struct str_buf text;
+
+    // Number of symbols whose prefix had already been interned.
+    size_t hits;
+
+    // `true` if any allocation failed (see `rust_demangle_prefix_batch_add`).
+    bool errored;
+};
+
+// FNV-1a, which is plenty for (mostly short) prefixes, and can also be
+// computed incrementally, starting from `HASH_BYTES_INIT`, one chunk at a time
+// (see `rust_demangle_fingerprint`).
+#define HASH_BYTES_INIT 0xcbf29ce484222325
+static uint64_t hash_bytes(uint64_t hash, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)data[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+static size_t find_interned_prefix(
+    const struct rust_demangle_prefix_batch *batch, const char *key,
+    size_t len, uint64_t hash
+) {
+    const struct interned_prefix *prefixes =
+        (const struct interned_prefix *)batch->prefixes.ptr;
+    size_t mask = batch->slots_cap - 1;
+
+    for (size_t i = hash & mask; batch->slots[i].index_plus_one;
+         i = (i + 1) & mask) {
+        if (batch->slots[i].hash != hash)
+            continue;
+        size_t index = batch->slots[i].index_plus_one - 1;
+        if (prefixes[index].key_len == len &&
+            memcmp(batch->keys.ptr + prefixes[index].key_start, key, len) == 0)
+            return index;
+    }
+    return INTERNED_PREFIX_NONE;
+}
+
+/// Handle the leading path of the symbol (i.e. its crate root and modules),
+/// found by the caller at `sym[start..end]` (and `levels` paths deep), which
+/// is only demangled once per `rust_demangle_prefix_batch`: if it was already
+/// interned, its output is accounted for (but not printed, as it's kept
+/// separately), and `true` is returned (after moving past it).
+/// Otherwise, the caller should demangle it as usual, then call
+/// `end_interned_prefix`, so that its output can be interned.
+static bool begin_interned_prefix(
+    struct rust_demangler *rdm, size_t start, size_t end, size_t levels
+) {
+    const struct rust_demangle_prefix_batch *batch = rdm->prefix_batch;
+    const char *key = rdm->sym + start;
+    uint64_t hash = hash_bytes(HASH_BYTES_INIT, key, end - start);
+    size_t index = find_interned_prefix(batch, key, end - start, hash);
+
+    rdm->interned.mangled_start = start;
+    rdm->interned.mangled_end = end;
+    rdm->interned.hash = hash;
+
+    // NOTE: the prefix is demangled as usual if that would hit any
+    // limits, to stop at the same point as it would without interning.
+    if (index != INTERNED_PREFIX_NONE) {
+        const struct interned_prefix *prefix =
+            (const struct interned_prefix *)batch->prefixes.ptr + index;
+        if (levels <= rdm->max_depth - rdm->depth &&
+            prefix->text_len <= rdm->output_remaining) {
+            if (rdm->depth + levels > rdm->peak_depth)
+                rdm->peak_depth = rdm->depth + levels;
+            rdm->output_remaining -= prefix->text_len;
+            rdm->interned.index = index;
+            rdm->next = end;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void end_interned_prefix(struct rust_demangler *rdm) {
+    // NOTE: the prefix is always at the very start of the output.
+    if (is_printing(rdm) && rdm->next == rdm->interned.mangled_end)
+        rdm->interned.output_len = output_pos(rdm);
+    else
+        rdm->interned.mangled_end = 0;
+}
+
+/// Find the end of the identifier at `sym[pos..]` (including any preceding
+/// disambiguator, in v0 symbols), returning `0` if it's malformed, without
+/// fully validating it (which happens when a prefix is first demangled, with
+/// any other prefix only looked up if it's the same bytes, i.e. also valid).
+static size_t skip_ident(const struct rust_demangler *rdm, size_t pos) {
+    const char *sym = rdm->sym;
+    size_t sym_len = rdm->sym_len;
+
+    if (rdm->version != -1) {
+        if (pos < sym_len && sym[pos] == 's')
+            while (pos < sym_len && sym[pos++] != '_') {
+            }
+        if (pos < sym_len && sym[pos] == 'u')
+            pos++;
+    }
+
+    if (!(pos < sym_len && IS_DIGIT(sym[pos])))
+        return 0;
+    size_t len = 0;
+    while (pos < sym_len && IS_DIGIT(sym[pos])) {
+        // No identifier can be longer than the symbol (nor overflow).
+        if (len > sym_len / 10)
+            return 0;
+        len = len * 10 + (sym[pos++] - '0');
+    }
+
+    if (rdm->version != -1 && pos < sym_len && sym[pos] == '_')
+        pos++;
+
+    if (len > sym_len - pos)
+        return 0;
+    return pos + len;
+}
+
+// Demangling functions.
+
+// A list of generic args (or `dyn Trait` bindings) being printed, as `<...>`,
+// which may be collapsed, or cut short (see `max_generic_depth` and
+// `max_generic_args`), by skipping printing for (the rest of) its contents,
+// with an ellipsis printed in its place.
+struct generic_list {
+    size_t count;
+    bool skipped;
+};
+
+// Horizontal ellipsis (U+2026), as UTF-8.
+#define ELLIPSIS "\xe2\x80\xa6"
+
+static void
+begin_generic_list(struct rust_demangler *rdm, struct generic_list *list) {
+    PRINT("<");
+    list->count = 0;
+    list->skipped = false;
+
+    rdm->generic_depth++;
+    if (rdm->generic_depth > rdm->max_generic_depth &&
+        !rdm->skipping_printing) {
+        PRINT(ELLIPSIS);
+        list->skipped = true;
+        rdm->skipping_printing = true;
+    }
+}
+
+/// Print the separator before the next element of `list` (if any precede it).
+static void
+next_generic_list_elem(struct rust_demangler *rdm, struct generic_list *list) {
+    if (list->count == rdm->max_generic_args && !rdm->skipping_printing) {
+        PRINT(", " ELLIPSIS);
+        list->skipped = true;
+        rdm->skipping_printing = true;
+    } else if (list->count > 0)
+        PRINT(", ");
+    list->count++;
+}
+
+static void
+end_generic_list(struct rust_demangler *rdm, struct generic_list *list) {
+    // NOTE: printing stays skipped if the ellipsis itself didn't fit
+    // (see `print_str`), as nothing else was printed after it.
+    if (list->skipped && !rdm->output_too_big)
+        rdm->skipping_printing = false;
+    rdm->generic_depth--;
+    PRINT(">");
+}
+
+static void demangle_binder(struct rust_demangler *rdm);
+static void demangle_path(struct rust_demangler *rdm, bool in_value);
+static void demangle_interned_prefix(struct rust_demangler *rdm, bool in_value);
+static void demangle_generic_arg(struct rust_demangler *rdm);
+static void demangle_type(struct rust_demangler *rdm);
+static bool demangle_path_maybe_open_generics(
+    struct rust_demangler *rdm, struct generic_list *list
+);
+static void demangle_dyn_trait(struct rust_demangler *rdm);
+static void demangle_const(struct rust_demangler *rdm, bool in_value);
+static void demangle_const_uint(struct rust_demangler *rdm, char ty_tag);
+static void demangle_const_str_literal(struct rust_demangler *rdm);
+static void demangle_const_struct_field(struct rust_demangler *rdm);
+
+/// Enter one more level of nesting (of paths, types, consts or backrefs),
+/// erroring if that exceeds `max_depth` (see `struct rust_demangle_options`).
+static void push_depth(struct rust_demangler *rdm) {
+    if (rdm->depth >= rdm->max_depth) {
+        rdm->peak_depth = SIZE_MAX;
+        report_error(rdm, "{recursion limit reached}");
+        return;
+    }
+    rdm->depth++;
+    if (rdm->depth > rdm->peak_depth)
+        rdm->peak_depth = rdm->depth;
+}
+
+static void pop_depth(struct rust_demangler *rdm) { rdm->depth--; }
+
+// What a backref is being followed as, which (along with the `in_value`
+// flag for paths and consts) determines what its target is parsed as.
+enum backref_kind {
+    // Never memoized (e.g. `demangle_path_maybe_open_generics`).
+    BACKREF_UNMEMOIZED,
+
+    BACKREF_PATH,
+    BACKREF_PATH_IN_VALUE,
+    BACKREF_TYPE,
+    BACKREF_CONST,
+    BACKREF_CONST_IN_VALUE,
+};
+
+// State saved by `begin_backref`, for `end_backref` to restore (and memoize).
+struct backref {
+    enum backref_kind kind;
+    size_t start;
+    size_t target;
+
+    size_t saved_next;
+    size_t saved_depth;
+    size_t saved_peak_depth;
+    uint64_t bound_lifetime_depth;
+    size_t generic_depth;
+    size_t output_start;
+    size_t open_events;
+};
+
+static struct backref_memo *
+find_backref_memo(struct rust_demangler *rdm, const struct backref *backref) {
+    size_t i = backref->target % (sizeof(rdm->memo) / sizeof(rdm->memo[0]));
+    return &rdm->memo[i];
+}
+
+/// Parse a backref (after its `B` tag) and, unless printing is being skipped
+/// (in which case backrefs are never followed), move to its target, returning
+/// `true` if the caller should then demangle the target (as `kind`), followed
+/// by calling `end_backref` with the same `*backref`.
+/// If the same target was already printed (and memoized), its output is
+/// copied instead, and `false` is returned.
+static bool begin_backref(
+    struct rust_demangler *rdm, enum backref_kind kind,
+    struct backref *backref
+) {
+    size_t start = rdm->next - 1;
+    uint64_t target = parse_integer_62(rdm);
+    if (rdm->errored)
+        return false;
+
+    // Only backwards references are allowed, so that (along with the depth
+    // limit) following backrefs always terminates.
+    CHECK_OR(target < start, return false);
+
+    if (rdm->depth >= rdm->max_depth) {
+        rdm->peak_depth = SIZE_MAX;
+        report_error(rdm, "{recursion limit reached}");
+        return false;
+    }
+
+    if (rdm->skipping_printing)
+        return false;
+
+    backref->kind = kind;
+    backref->start = start;
+    backref->target = target;
+
+    if (rdm->memoize_backrefs && kind != BACKREF_UNMEMOIZED &&
+        !rdm->memo_output.errored) {
+        struct backref_memo *memo = find_backref_memo(rdm, backref);
+        size_t depth = rdm->depth + 1;
+
+        // NOTE: a memo is only reused if printing it anew would have
+        // produced the same output, i.e. it would also not hit any limits
+        // (otherwise the target is demangled again, to stop at the same
+        // point as it would without memoization).
+        if (memo->kind == kind && memo->target == target &&
+            memo->bound_lifetime_depth == rdm->bound_lifetime_depth &&
+            (memo->generic_depth == rdm->generic_depth ||
+             rdm->max_generic_depth == SIZE_MAX) &&
+            memo->extra_depth <= rdm->max_depth - depth &&
+            memo->output_len <= rdm->output_remaining) {
+            if (depth + memo->extra_depth > rdm->peak_depth)
+                rdm->peak_depth = depth + memo->extra_depth;
+
+            // Make sure `memo_output` won't be reallocated while copying.
+            str_buf_reserve(&rdm->memo_output, memo->output_len);
+            if (!rdm->memo_output.errored) {
+                print_str(
+                    rdm, rdm->memo_output.ptr + memo->output_start,
+                    memo->output_len
+                );
+                return false;
+            }
+        }
+    }
+
+    backref->saved_next = rdm->next;
+    backref->saved_depth = rdm->depth;
+    backref->saved_peak_depth = rdm->peak_depth;
+    backref->bound_lifetime_depth = rdm->bound_lifetime_depth;
+    backref->generic_depth = rdm->generic_depth;
+    backref->output_start = rdm->memo_output.len;
+    backref->open_events = count_open_events(rdm);
+
+    rdm->next = target;
+    rdm->depth++;
+    rdm->peak_depth = rdm->depth;
+    rdm->backref_nesting++;
+    return true;
+}
+
+static void
+end_backref(struct rust_demangler *rdm, const struct backref *backref) {
+    // Only fully printed (and error-free) output can be memoized.
+    if (rdm->memoize_backrefs && backref->kind != BACKREF_UNMEMOIZED &&
+        !rdm->errored && !rdm->skipping_printing &&
+        rdm->peak_depth <= rdm->max_depth && !rdm->memo_output.errored) {
+        struct backref_memo *memo = find_backref_memo(rdm, backref);
+
+        memo->target = backref->target;
+        memo->kind = backref->kind;
+        memo->bound_lifetime_depth = backref->bound_lifetime_depth;
+        memo->generic_depth = backref->generic_depth;
+        memo->extra_depth = rdm->peak_depth - (backref->saved_depth + 1);
+        memo->output_start = backref->output_start;
+        memo->output_len = rdm->memo_output.len - backref->output_start;
+    }
+
+    rdm->next = backref->saved_next;
+    rdm->depth = backref->saved_depth;
+    if (rdm->peak_depth < backref->saved_peak_depth)
+        rdm->peak_depth = backref->saved_peak_depth;
+    rdm->backref_nesting--;
+
+    // Events begun in the backref but left open (by an error, or on purpose,
+    // see `demangle_path_maybe_open_generics`) are only ended after leaving
+    // it, so their syntax is described as starting at the backref itself (as
+    // its target may be anywhere before it, next to unrelated syntax).
+    struct open_event *open_events = (struct open_event *)rdm->open_events.ptr;
+    for (size_t i = backref->open_events; i < count_open_events(rdm); i++)
+        open_events[i].mangled_start = backref->start;
+
+    // Any errors were contained to the backref (see `backref_nesting`), and so
+    // must be any state left behind by stopping early, e.g. in the middle of
+    // a generic list (collapsed by `begin_generic_list`) or of a binder.
+    // Printing was never being skipped when following the backref (other than
+    // after running out of output, see `begin_backref`), so that's restored.
+    rdm->skipping_printing = rdm->output_too_big;
+    rdm->bound_lifetime_depth = backref->bound_lifetime_depth;
+    rdm->generic_depth = backref->generic_depth;
+    rdm->errored = false;
+}
+
+/// Optionally enter a binder ('G') for late-bound lifetimes,
+/// printing e.g. `for<'a, 'b> `, and make those lifetimes visible
+/// to the caller (via depth level, which the caller should reset).
+static void demangle_binder(struct rust_demangler *rdm) {
+    size_t mangled_start = rdm->next;
+    uint64_t bound_lifetimes;
+    PARSE_OR(bound_lifetimes = parse_opt_integer_62(rdm, 'G'), return);
+
+    // NOTE: like in `rustc-demangle`, bound lifetimes aren't tracked
+    // when skipping printing, which also avoids looping over a huge count
+    // (including after hitting the output limit, midway through the loop).
+    if (rdm->skipping_printing)
+        return;
+
+    if (bound_lifetimes > 0) {
+        size_t output_start = output_pos(rdm);
+        PRINT("for<");
+        for (uint64_t i = 0; i < bound_lifetimes && !rdm->skipping_printing;
+             i++) {
+            if (i > 0)
+                PRINT(", ");
+            rdm->bound_lifetime_depth++;
+            print_lifetime_from_index(rdm, 1);
+        }
+        PRINT("> ");
+        emit_leaf_event(
+            rdm, RUST_DEMANGLE_EVENT_BINDER, 'G', mangled_start, output_start,
+            bound_lifetimes
+        );
+    }
+}
+
+/// Demangle a qualified path (`M`, `X` or `Y`), printing only its crate root
+/// (see `RUST_DEMANGLE_FLAG_CRATE_ONLY`), i.e. that of the `impl` (or, as
+/// `Y` paths don't have one, that of the trait).
+static void demangle_qualified_path_crate(
+    struct rust_demangler *rdm, char tag, bool in_value
+) {
+    if (tag != 'Y') {
+        PARSE_OR(parse_disambiguator(rdm), return);
+        rdm->partial_path = RUST_DEMANGLE_FLAG_CRATE_ONLY;
+        demangle_path(rdm, in_value);
+    }
+
+    bool was_skipping_printing = rdm->skipping_printing;
+    rdm->skipping_printing = true;
+    demangle_type(rdm);
+    if (tag == 'X')
+        demangle_path(rdm, false);
+    rdm->skipping_printing = was_skipping_printing;
+
+    if (tag == 'Y') {
+        rdm->partial_path = RUST_DEMANGLE_FLAG_CRATE_ONLY;
+        demangle_path(rdm, false);
+    }
+}
+
+static void demangle_path(struct rust_demangler *rdm, bool in_value) {
+    // Only the symbol's own path (or the path it instantiates) is interned.
+    bool at_interned_prefix = rdm->at_interned_prefix;
+    rdm->at_interned_prefix = false;
+
+    // Parts of the symbol's path still to be printed (see `partial_flags`),
+    // with anything else in this path parsed without printing it.
+    int partial = rdm->partial_path;
+    rdm->partial_path = 0;
+
+    PARSE_OR(push_depth(rdm), return);
+
+    char tag;
+    PARSE_OR(tag = next(rdm), return);
+
+    // NOTE: backrefs don't get events of their own, only their targets.
+    size_t events = count_open_events(rdm);
+    if (tag != 'B')
+        events = begin_event(
+            rdm, RUST_DEMANGLE_EVENT_BEGIN_PATH, tag, rdm->next - 1
+        );
+
+    switch (tag) {
+    case 'C': {
+        size_t mangled_start = rdm->next;
+        uint64_t dis;
+        struct rust_mangled_ident name;
+        PARSE_OR(dis = parse_disambiguator(rdm), return);
+        PARSE_OR(name = parse_ident(rdm), return);
+
+        size_t output_start = output_pos(rdm);
+        print_ident(rdm, name);
+        emit_leaf_event(
+            rdm, RUST_DEMANGLE_EVENT_CRATE, 'C', mangled_start, output_start,
+            dis
+        );
+        if (rdm->verbose) {
+            PRINT("[");
+            print_uint64_hex(rdm, dis);
+            PRINT("]");
+        }
+        break;
+    }
+    case 'N': {
+        char ns;
+        PARSE_OR(ns = next(rdm), return);
+        CHECK_OR(IS_LOWER(ns) || IS_UPPER(ns), return);
+
+        // Only the crate root is left to find in the parent path, if at all.
+        bool was_skipping_printing = rdm->skipping_printing;
+        if (partial & RUST_DEMANGLE_FLAG_CRATE_ONLY)
+            rdm->partial_path = RUST_DEMANGLE_FLAG_CRATE_ONLY;
+        else if (partial)
+            rdm->skipping_printing = true;
+
+        if (at_interned_prefix)
+            demangle_interned_prefix(rdm, in_value);
+        else
+            demangle_path(rdm, in_value);
+
+        if (partial == RUST_DEMANGLE_FLAG_LEAF_ONLY)
+            rdm->skipping_printing = was_skipping_printing;
+        was_skipping_printing = rdm->skipping_printing;
+        if (partial == RUST_DEMANGLE_FLAG_CRATE_ONLY)
+            rdm->skipping_printing = true;
+
+        // The last component is printed on its own, with `LEAF_ONLY`.
+        bool separator = partial != RUST_DEMANGLE_FLAG_LEAF_ONLY;
+
+        // HACK: if an error occurred, `PARSE_OR` below will print a `?`
+        // without its preceding `::` (which is skipped in certain conditions,
+        // i.e. a lowercase namespace with an empty identifier), so in order
+        // to get `::?`, the `::` has to be printed here.
+        if (rdm->errored)
+            PRINT("::");
+
+        size_t mangled_start = rdm->next;
+        uint64_t dis;
+        struct rust_mangled_ident name;
+        PARSE_OR(dis = parse_disambiguator(rdm), return);
+        PARSE_OR(name = parse_ident(rdm), return);
+
+        if (IS_UPPER(ns)) {
+            // Special namespaces, like closures and shims.
+            if (separator)
+                PRINT("::");
+            PRINT("{");
+            switch (ns) {
+            case 'C':
+                PRINT("closure");
+                break;
+            case 'S':
+                PRINT("shim");
+                break;
+            default:
+                print_str(rdm, &ns, 1);
+            }
+            size_t output_start = output_pos(rdm);
+            if (name.ascii || name.punycode) {
+                PRINT(":");
+                output_start = output_pos(rdm);
+                print_ident(rdm, name);
+            }
+            emit_leaf_event(
+                rdm, RUST_DEMANGLE_EVENT_NAMESPACE, ns, mangled_start,
+                output_start, dis
+            );
+            PRINT("#");
+            print_uint64(rdm, dis);
+            PRINT("}");
+        } else {
+            // Implementation-specific/unspecified namespaces.
+
+            size_t output_start = output_pos(rdm);
+            if (name.ascii || name.punycode) {
+                if (separator)
+                    PRINT("::");
+                output_start = output_pos(rdm);
+                print_ident(rdm, name);
+            }
+            emit_leaf_event(
+                rdm, RUST_DEMANGLE_EVENT_NAMESPACE, ns, mangled_start,
+                output_start, dis
+            );
+        }
+        if (partial == RUST_DEMANGLE_FLAG_CRATE_ONLY)
+            rdm->skipping_printing = was_skipping_printing;
         break;
     }
     case 'M':
     case 'X':
-        // Ignore the `impl`'s own path.
-        parse_disambiguator(rdm);
-        bool was_skipping_printing = rdm->skipping_printing;
-        rdm->skipping_printing = true;
-        demangle_path(rdm, in_value);
-        rdm->skipping_printing = was_skipping_printing;
-        __attribute__((fallthrough));
     case 'Y':
+        if (partial & RUST_DEMANGLE_FLAG_CRATE_ONLY) {
+            demangle_qualified_path_crate(rdm, tag, in_value);
+            break;
+        }
+        if (tag != 'Y') {
+            // Ignore the `impl`'s own path.
+            PARSE_OR(parse_disambiguator(rdm), return);
+            bool was_skipping_printing = rdm->skipping_printing;
+            rdm->skipping_printing = true;
+            demangle_path(rdm, in_value);
+            rdm->skipping_printing = was_skipping_printing;
+        }
         PRINT("<");
         demangle_type(rdm);
         if (tag != 'M') {
@@ -549,37 +1570,88 @@ static void demangle_path(struct rust_demangler *rdm, bool in_value) {
         }
         PRINT(">");
         break;
-    case 'I':
+    case 'I': {
+        rdm->at_interned_prefix = at_interned_prefix;
+        rdm->partial_path = partial;
         demangle_path(rdm, in_value);
+        if (partial || rdm->no_generics) {
+            bool was_skipping_printing = rdm->skipping_printing;
+            rdm->skipping_printing = true;
+            while (!rdm->errored && !eat(rdm, 'E'))
+                demangle_generic_arg(rdm);
+            rdm->skipping_printing = was_skipping_printing;
+            break;
+        }
         if (in_value)
             PRINT("::");
-        PRINT("<");
-        for (size_t i = 0; !rdm->errored && !eat(rdm, 'E'); i++) {
-            if (i > 0)
-                PRINT(", ");
+        size_t generics = begin_event(
+            rdm, RUST_DEMANGLE_EVENT_BEGIN_GENERICS, 'I', rdm->next
+        );
+        struct generic_list list;
+        begin_generic_list(rdm, &list);
+        while (!rdm->errored && !eat(rdm, 'E')) {
+            next_generic_list_elem(rdm, &list);
             demangle_generic_arg(rdm);
         }
-        PRINT(">");
+        end_generic_list(rdm, &list);
+        end_events(rdm, generics);
         break;
+    }
     case 'B': {
-        size_t backref = parse_integer_62(rdm);
-        if (!rdm->skipping_printing) {
-            size_t old_next = rdm->next;
-            rdm->next = backref;
+        struct backref backref;
+        enum backref_kind kind =
+            in_value ? BACKREF_PATH_IN_VALUE : BACKREF_PATH;
+        if (begin_backref(rdm, kind, &backref)) {
+            rdm->partial_path = partial;
             demangle_path(rdm, in_value);
-            rdm->next = old_next;
+            end_backref(rdm, &backref);
         }
         break;
     }
     default:
         ERROR_AND(return);
     }
+
+    pop_depth(rdm);
+    end_events(rdm, events);
+}
+
+/// Demangle the leading path of a v0 symbol (see `begin_interned_prefix`), if
+/// it's a chain of nested paths (`N`) ending in a crate root (`C`), as found
+/// at the start of the symbol's own path, e.g. `NtNtCs..._4core4iter3map`.
+/// Anything else (e.g. backrefs, which depend on where they are in the symbol)
+/// is demangled as usual.
+static void
+demangle_interned_prefix(struct rust_demangler *rdm, bool in_value) {
+    size_t start = rdm->next;
+    size_t end = start;
+    size_t levels = 1;
+
+    while (end + 1 < rdm->sym_len && rdm->sym[end] == 'N' &&
+           (IS_LOWER(rdm->sym[end + 1]) || IS_UPPER(rdm->sym[end + 1]))) {
+        end += 2;
+        levels++;
+    }
+    if (end < rdm->sym_len && rdm->sym[end] == 'C') {
+        end++;
+        for (size_t i = 0; end && i < levels; i++)
+            end = skip_ident(rdm, end);
+    } else
+        end = 0;
+
+    if (end && begin_interned_prefix(rdm, start, end, levels))
+        return;
+    demangle_path(rdm, in_value);
+    if (end)
+        end_interned_prefix(rdm);
 }
 
 static void demangle_generic_arg(struct rust_demangler *rdm) {
     if (eat(rdm, 'L')) {
-        uint64_t lt = parse_integer_62(rdm);
-        print_lifetime_from_index(rdm, lt);
+        size_t mangled_start = rdm->next - 1;
+        uint64_t lt;
+        PARSE_OR(lt = parse_integer_62(rdm), return);
+        print_lifetime(rdm, mangled_start, lt);
     } else if (eat(rdm, 'K'))
         demangle_const(rdm, false);
     else
@@ -637,24 +1709,34 @@ static const char *basic_type(char tag) {
 }
 
 static void demangle_type(struct rust_demangler *rdm) {
-    CHECK_OR(!rdm->errored, return);
+    char tag;
+    PARSE_OR(tag = next(rdm), return);
 
-    char tag = next(rdm);
+    size_t events = count_open_events(rdm);
+    if (tag != 'B')
+        events = begin_event(
+            rdm, RUST_DEMANGLE_EVENT_BEGIN_TYPE, tag, rdm->next - 1
+        );
 
     const char *basic = basic_type(tag);
     if (basic) {
-        PRINT(basic);
+        print_str(rdm, basic, strlen(basic));
+        end_events(rdm, events);
         return;
     }
 
+    PARSE_OR(push_depth(rdm), return);
+
     switch (tag) {
     case 'R':
     case 'Q':
         PRINT("&");
         if (eat(rdm, 'L')) {
-            uint64_t lt = parse_integer_62(rdm);
+            size_t mangled_start = rdm->next - 1;
+            uint64_t lt;
+            PARSE_OR(lt = parse_integer_62(rdm), return);
             if (lt) {
-                print_lifetime_from_index(rdm, lt);
+                print_lifetime(rdm, mangled_start, lt);
                 PRINT(" ");
             }
         }
@@ -697,21 +1779,32 @@ static void demangle_type(struct rust_demangler *rdm) {
     case 'F': {
         uint64_t old_bound_lifetime_depth = rdm->bound_lifetime_depth;
         demangle_binder(rdm);
+        if (rdm->errored)
+            goto restore;
 
-        if (eat(rdm, 'U'))
-            PRINT("unsafe ");
+        bool is_unsafe = eat(rdm, 'U');
 
-        if (eat(rdm, 'K')) {
-            struct rust_mangled_ident abi;
+        struct rust_mangled_ident abi;
+
+        abi.ascii = NULL;
+        abi.ascii_len = 0;
+        abi.punycode = NULL;
+        abi.punycode_len = 0;
 
+        if (eat(rdm, 'K')) {
             if (eat(rdm, 'C')) {
                 abi.ascii = "C";
                 abi.ascii_len = 1;
             } else {
-                abi = parse_ident(rdm);
+                PARSE_OR(abi = parse_ident(rdm), goto restore);
                 CHECK_OR(abi.ascii && !abi.punycode, goto restore);
             }
+        }
+
+        if (is_unsafe)
+            PRINT("unsafe ");
 
+        if (abi.ascii) {
             PRINT("extern \"");
 
             // If the ABI had any `-`, they were replaced with `_`,
@@ -766,19 +1859,19 @@ static void demangle_type(struct rust_demangler *rdm) {
         rdm->bound_lifetime_depth = old_bound_lifetime_depth;
 
         CHECK_OR(eat(rdm, 'L'), return);
-        uint64_t lt = parse_integer_62(rdm);
+        size_t mangled_start = rdm->next - 1;
+        uint64_t lt;
+        PARSE_OR(lt = parse_integer_62(rdm), return);
         if (lt) {
             PRINT(" + ");
-            print_lifetime_from_index(rdm, lt);
+            print_lifetime(rdm, mangled_start, lt);
         }
         break;
     case 'B': {
-        size_t backref = parse_integer_62(rdm);
-        if (!rdm->skipping_printing) {
-            size_t old_next = rdm->next;
-            rdm->next = backref;
+        struct backref backref;
+        if (begin_backref(rdm, BACKREF_TYPE, &backref)) {
             demangle_type(rdm);
-            rdm->next = old_next;
+            end_backref(rdm, &backref);
         }
         break;
     }
@@ -787,33 +1880,37 @@ static void demangle_type(struct rust_demangler *rdm) {
         rdm->next--;
         demangle_path(rdm, false);
     }
+
+    pop_depth(rdm);
+    end_events(rdm, events);
 }
 
 /// A trait in a trait object may have some "existential projections"
 /// (i.e. associated type bindings) after it, which should be printed
 /// in the `<...>` of the trait, e.g. `dyn Trait<T, U, Assoc=X>`.
 /// To this end, this method will keep the `<...>` of an 'I' path
-/// open, by omitting the `>`, and return `Ok(true)` in that case.
-static bool demangle_path_maybe_open_generics(struct rust_demangler *rdm) {
+/// open, by omitting the `>`, and return `Ok(true)` in that case
+/// (with `list` tracking what's been printed in the `<...>` so far).
+static bool demangle_path_maybe_open_generics(
+    struct rust_demangler *rdm, struct generic_list *list
+) {
     bool open = false;
 
-    CHECK_OR(!rdm->errored, return open);
-
     if (eat(rdm, 'B')) {
-        size_t backref = parse_integer_62(rdm);
-        if (!rdm->skipping_printing) {
-            size_t old_next = rdm->next;
-            rdm->next = backref;
-            open = demangle_path_maybe_open_generics(rdm);
-            rdm->next = old_next;
+        struct backref backref;
+        if (begin_backref(rdm, BACKREF_UNMEMOIZED, &backref)) {
+            open = demangle_path_maybe_open_generics(rdm, list);
+            end_backref(rdm, &backref);
         }
     } else if (eat(rdm, 'I')) {
+        // NOTE: these events are ended by `demangle_dyn_trait`.
+        begin_event(rdm, RUST_DEMANGLE_EVENT_BEGIN_PATH, 'I', rdm->next - 1);
         demangle_path(rdm, false);
-        PRINT("<");
+        begin_event(rdm, RUST_DEMANGLE_EVENT_BEGIN_GENERICS, 'I', rdm->next);
+        begin_generic_list(rdm, list);
         open = true;
-        for (size_t i = 0; !rdm->errored && !eat(rdm, 'E'); i++) {
-            if (i > 0)
-                PRINT(", ");
+        while (!rdm->errored && !eat(rdm, 'E')) {
+            next_generic_list_elem(rdm, list);
             demangle_generic_arg(rdm);
         }
     } else
@@ -822,33 +1919,46 @@ static bool demangle_path_maybe_open_generics(struct rust_demangler *rdm) {
 }
 
 static void demangle_dyn_trait(struct rust_demangler *rdm) {
-    CHECK_OR(!rdm->errored, return);
-
-    bool open = demangle_path_maybe_open_generics(rdm);
+    size_t events = count_open_events(rdm);
+    struct generic_list list;
+    bool open = demangle_path_maybe_open_generics(rdm, &list);
 
     while (eat(rdm, 'p')) {
-        if (!open)
-            PRINT("<");
-        else
-            PRINT(", ");
+        if (!open) {
+            begin_event(
+                rdm, RUST_DEMANGLE_EVENT_BEGIN_GENERICS, 'p', rdm->next - 1
+            );
+            begin_generic_list(rdm, &list);
+        }
         open = true;
+        next_generic_list_elem(rdm, &list);
 
-        struct rust_mangled_ident name = parse_ident(rdm);
+        struct rust_mangled_ident name;
+        PARSE_OR(name = parse_ident(rdm), return);
         print_ident(rdm, name);
         PRINT(" = ");
         demangle_type(rdm);
     }
 
     if (open)
-        PRINT(">");
+        end_generic_list(rdm, &list);
+    end_events(rdm, events);
 }
 
 static void demangle_const(struct rust_demangler *rdm, bool in_value) {
-    CHECK_OR(!rdm->errored, return);
+    char ty_tag;
+    PARSE_OR(ty_tag = next(rdm), return);
+
+    PARSE_OR(push_depth(rdm), return);
+
+    size_t events = count_open_events(rdm);
+    if (ty_tag != 'B')
+        events = begin_event(
+            rdm, RUST_DEMANGLE_EVENT_BEGIN_CONST, ty_tag, rdm->next - 1
+        );
 
     bool opened_brace = false;
 
-    char ty_tag = next(rdm);
     switch (ty_tag) {
     case 'p':
         PRINT("_");
@@ -877,21 +1987,27 @@ static void demangle_const(struct rust_demangler *rdm, bool in_value) {
         break;
 
     case 'b': {
-        struct hex_nibbles hex = parse_hex_nibbles_for_const_uint(rdm);
-        CHECK_OR(!rdm->errored && hex.nibbles_len <= 1, return);
+        struct hex_nibbles hex;
+        PARSE_OR(hex = parse_hex_nibbles_for_const_uint(rdm), return);
+        CHECK_OR(hex.nibbles_len <= 1, return);
         uint8_t v = hex.nibbles_len > 0 ? decode_hex_nibble(hex.nibbles[0]) : 0;
         CHECK_OR(v <= 1, return);
-        PRINT(v == 1 ? "true" : "false");
+        if (v == 1)
+            PRINT("true");
+        else
+            PRINT("false");
         break;
     }
 
     case 'c': {
-        struct hex_nibbles hex = parse_hex_nibbles_for_const_uint(rdm);
-        CHECK_OR(!rdm->errored && hex.nibbles_len <= 6, return);
+        struct hex_nibbles hex;
+        PARSE_OR(hex = parse_hex_nibbles_for_const_uint(rdm), return);
+        CHECK_OR(hex.nibbles_len <= 6, return);
 
         uint32_t c = 0;
         for (size_t i = 0; i < hex.nibbles_len; i++)
             c = (c << 4) | decode_hex_nibble(hex.nibbles[i]);
+        CHECK_OR(is_unicode_scalar_value(c), return);
 
         PRINT("'");
         print_quoted_escaped_char(rdm, '\'', c);
@@ -943,16 +2059,11 @@ static void demangle_const(struct rust_demangler *rdm, bool in_value) {
 
         PRINT("[");
 
-        size_t i = 0;
-        while (!eat(rdm, 'E')) {
-            CHECK_OR(!rdm->errored, return);
-
+        for (size_t i = 0; !rdm->errored && !eat(rdm, 'E'); i++) {
             if (i > 0)
                 PRINT(", ");
 
             demangle_const(rdm, true);
-
-            i += 1;
         }
 
         PRINT("]");
@@ -967,16 +2078,12 @@ static void demangle_const(struct rust_demangler *rdm, bool in_value) {
 
         PRINT("(");
 
-        size_t i = 0;
-        while (!eat(rdm, 'E')) {
-            CHECK_OR(!rdm->errored, return);
-
+        size_t i;
+        for (i = 0; !rdm->errored && !eat(rdm, 'E'); i++) {
             if (i > 0)
                 PRINT(", ");
 
             demangle_const(rdm, true);
-
-            i += 1;
         }
 
         if (i == 1)
@@ -986,7 +2093,7 @@ static void demangle_const(struct rust_demangler *rdm, bool in_value) {
         break;
     }
 
-    case 'V':
+    case 'V': {
         if (!in_value) {
             opened_brace = true;
             PRINT("{");
@@ -994,23 +2101,20 @@ static void demangle_const(struct rust_demangler *rdm, bool in_value) {
 
         demangle_path(rdm, true);
 
-        switch (next(rdm)) {
+        char kind;
+        PARSE_OR(kind = next(rdm), return);
+        switch (kind) {
         case 'U':
             break;
 
         case 'T': {
             PRINT("(");
 
-            size_t i = 0;
-            while (!eat(rdm, 'E')) {
-                CHECK_OR(!rdm->errored, return);
-
+            for (size_t i = 0; !rdm->errored && !eat(rdm, 'E'); i++) {
                 if (i > 0)
                     PRINT(", ");
 
                 demangle_const(rdm, true);
-
-                i += 1;
             }
 
             PRINT(")");
@@ -1020,23 +2124,11 @@ static void demangle_const(struct rust_demangler *rdm, bool in_value) {
         case 'S': {
             PRINT(" { ");
 
-            size_t i = 0;
-            while (!eat(rdm, 'E')) {
-                CHECK_OR(!rdm->errored, return);
-
+            for (size_t i = 0; !rdm->errored && !eat(rdm, 'E'); i++) {
                 if (i > 0)
                     PRINT(", ");
 
-                parse_disambiguator(rdm);
-
-                struct rust_mangled_ident name = parse_ident(rdm);
-                print_ident(rdm, name);
-
-                PRINT(": ");
-
-                demangle_const(rdm, true);
-
-                i += 1;
+                demangle_const_struct_field(rdm);
             }
 
             PRINT(" }");
@@ -1048,14 +2140,15 @@ static void demangle_const(struct rust_demangler *rdm, bool in_value) {
         }
 
         break;
+    }
 
     case 'B': {
-        size_t backref = parse_integer_62(rdm);
-        if (!rdm->skipping_printing) {
-            size_t old_next = rdm->next;
-            rdm->next = backref;
+        struct backref backref;
+        enum backref_kind kind =
+            in_value ? BACKREF_CONST_IN_VALUE : BACKREF_CONST;
+        if (begin_backref(rdm, kind, &backref)) {
             demangle_const(rdm, in_value);
-            rdm->next = old_next;
+            end_backref(rdm, &backref);
         }
         break;
     }
@@ -1067,13 +2160,14 @@ static void demangle_const(struct rust_demangler *rdm, bool in_value) {
     if (opened_brace) {
         PRINT("}");
     }
+
+    pop_depth(rdm);
+    end_events(rdm, events);
 }
 
 static void demangle_const_uint(struct rust_demangler *rdm, char ty_tag) {
-    CHECK_OR(!rdm->errored, return);
-
-    struct hex_nibbles hex = parse_hex_nibbles_for_const_uint(rdm);
-    CHECK_OR(!rdm->errored, return);
+    struct hex_nibbles hex;
+    PARSE_OR(hex = parse_hex_nibbles_for_const_uint(rdm), return);
 
     // Print anything that doesn't fit in `uint64_t` verbatim.
     if (hex.nibbles_len > 16) {
@@ -1086,8 +2180,20 @@ static void demangle_const_uint(struct rust_demangler *rdm, char ty_tag) {
         print_uint64(rdm, v);
     }
 
-    if (rdm->verbose)
-        PRINT(basic_type(ty_tag));
+    if (rdm->verbose) {
+        const char *ty = basic_type(ty_tag);
+        print_str(rdm, ty, strlen(ty));
+    }
+}
+
+static void demangle_const_struct_field(struct rust_demangler *rdm) {
+    struct rust_mangled_ident name;
+    PARSE_OR(parse_disambiguator(rdm), return);
+    PARSE_OR(name = parse_ident(rdm), return);
+
+    print_ident(rdm, name);
+    PRINT(": ");
+    demangle_const(rdm, true);
 }
 
 // UTF-8 uses an unary encoding for its "length" field (`1`s followed by a `0`).
@@ -1122,38 +2228,67 @@ static struct utf8_byte utf8_decode(uint8_t byte) {
     return utf8;
 }
 
+/// Decode the UTF-8 sequence starting at the `*pos`-th byte (i.e. pair of
+/// nibbles) of `hex`, advancing `*pos` past it, or return `false` if it's not
+/// valid UTF-8 (i.e. anything `str::from_utf8` would reject).
+static bool
+decode_utf8_from_hex(struct hex_nibbles hex, size_t *pos, uint32_t *out) {
+    size_t bytes = hex.nibbles_len / 2;
+    size_t i = *pos;
+
+#define HEX_BYTE(i)                                                            \
+    ((decode_hex_nibble(hex.nibbles[2 * (i)]) << 4) |                          \
+     decode_hex_nibble(hex.nibbles[2 * (i) + 1]))
+
+    struct utf8_byte utf8 = utf8_decode(HEX_BYTE(i));
+    i++;
+    uint32_t c = utf8.payload;
+    if (utf8.seq_len > 0) {
+        if (utf8.seq_len < 2 || utf8.seq_len > 4 ||
+            utf8.seq_len - 1 > bytes - i)
+            return false;
+        for (size_t extra = utf8.seq_len - 1; extra > 0; extra--) {
+            struct utf8_byte cont = utf8_decode(HEX_BYTE(i));
+            i++;
+            if (cont.seq_len != 1)
+                return false;
+            c = (c << cont.payload_width) | cont.payload;
+        }
+
+        // Reject overlong encodings (i.e. using more bytes than needed).
+        uint32_t min = utf8.seq_len == 2   ? 0x80
+                       : utf8.seq_len == 3 ? 0x800
+                                           : 0x10000;
+        if (c < min)
+            return false;
+    }
+
+#undef HEX_BYTE
+
+    *pos = i;
+    *out = c;
+    return is_unicode_scalar_value(c);
+}
+
 static void demangle_const_str_literal(struct rust_demangler *rdm) {
-    CHECK_OR(!rdm->errored, return);
+    struct hex_nibbles hex;
+    PARSE_OR(hex = parse_hex_nibbles_for_const_bytes(rdm), return);
 
-    struct hex_nibbles hex = parse_hex_nibbles_for_const_bytes(rdm);
-    CHECK_OR(!rdm->errored, return);
+    // Validate the whole string before printing any of it.
+    uint32_t c;
+    for (size_t i = 0; i < hex.nibbles_len / 2;)
+        CHECK_OR(decode_utf8_from_hex(hex, &i, &c), return);
 
     PRINT("\"");
-    for (size_t i = 0; i < hex.nibbles_len; i += 2) {
-        struct utf8_byte utf8 = utf8_decode(
-            (decode_hex_nibble(hex.nibbles[i]) << 4) |
-            decode_hex_nibble(hex.nibbles[i + 1])
-        );
-        uint32_t c = utf8.payload;
-        if (utf8.seq_len > 0) {
-            CHECK_OR(utf8.seq_len >= 2 && utf8.seq_len <= 4, return);
-            for (size_t extra = utf8.seq_len - 1; extra > 0; extra--) {
-                i += 2;
-                utf8 = utf8_decode(
-                    (decode_hex_nibble(hex.nibbles[i]) << 4) |
-                    decode_hex_nibble(hex.nibbles[i + 1])
-                );
-                CHECK_OR(utf8.seq_len == 1, return);
-                c = (c << utf8.payload_width) | utf8.payload;
-            }
-        }
+    for (size_t i = 0; i < hex.nibbles_len / 2;) {
+        decode_utf8_from_hex(hex, &i, &c);
         print_quoted_escaped_char(rdm, '"', c);
     }
     PRINT("\"");
 }
 
 static bool is_rust_hash(struct rust_mangled_ident name) {
-    if (name.ascii[0] != 'h') {
+    if (name.ascii_len == 0 || name.ascii[0] != 'h') {
         return false;
     }
     for (size_t i = 1; i < name.ascii_len; i++) {
@@ -1168,12 +2303,13 @@ static bool is_rust_hash(struct rust_mangled_ident name) {
 static void print_legacy_ident(
     struct rust_demangler *rdm, struct rust_mangled_ident ident
 ) {
-    if (rdm->errored || rdm->skipping_printing)
+    if (!is_printing(rdm))
         return;
 
     CHECK_OR(!ident.punycode, return);
 
-    if (ident.ascii[0] == '_' && ident.ascii[1] == '$') {
+    if (ident.ascii_len >= 2 && ident.ascii[0] == '_' &&
+        ident.ascii[1] == '$') {
         ident.ascii += 1;
         ident.ascii_len -= 1;
     }
@@ -1255,9 +2391,7 @@ static void print_legacy_ident(
                     // FIXME show printable unicode characters without hex
                     // encoding
                     PRINT("\\u{");
-                    char s[9] = {0};
-                    sprintf(s, "%" PRIx32, c);
-                    PRINT(s);
+                    print_uint64_hex(rdm, c);
                     PRINT("}");
                 }
             }
@@ -1284,15 +2418,78 @@ static void print_legacy_ident(
     print_str(rdm, ident.ascii, ident.ascii_len);
 }
 
+/// Find where the leading path of a legacy symbol (see `begin_interned_prefix`)
+/// ends, i.e. the start of its last printed component (so that at least one
+/// is left after it), returning `0` if there isn't one.
+static size_t find_legacy_prefix_end(const struct rust_demangler *rdm) {
+    size_t count = 0;
+    bool last_is_hash = false;
+
+    // Starts of the last 3 components (as the last one may be a hash).
+    size_t starts[3] = {0, 0, 0};
+
+    size_t pos = rdm->next;
+    while (pos < rdm->sym_len && rdm->sym[pos] != 'E') {
+        size_t start = pos;
+        pos = skip_ident(rdm, pos);
+        if (!pos)
+            return 0;
+        starts[count % 3] = start;
+        count++;
+
+        // NOTE: only the identifier itself (after its length) matters.
+        struct rust_mangled_ident name;
+
+        while (IS_DIGIT(rdm->sym[start]))
+            start++;
+        name.ascii = rdm->sym + start;
+        name.ascii_len = pos - start;
+        name.punycode = NULL;
+        name.punycode_len = 0;
+        last_is_hash = is_rust_hash(name);
+    }
+
+    size_t printed = count;
+    if (!rdm->verbose && last_is_hash)
+        printed--;
+    if (pos >= rdm->sym_len || printed < 2)
+        return 0;
+    return starts[(printed - 1) % 3];
+}
+
 static void demangle_legacy_path(struct rust_demangler *rdm) {
     bool first = true;
 
+    size_t events =
+        begin_event(rdm, RUST_DEMANGLE_EVENT_BEGIN_PATH, 0, rdm->next);
+
+    size_t interned_end = 0;
+    if (rdm->prefix_batch && !rdm->partial_flags) {
+        interned_end = find_legacy_prefix_end(rdm);
+        if (interned_end &&
+            begin_interned_prefix(rdm, rdm->next, interned_end, 0)) {
+            first = false;
+            interned_end = 0;
+        }
+    }
+
+    // With only part of the path printed (see `partial_flags`), nothing past
+    // the crate root (i.e. the first component) is printed while parsing it,
+    // and the last component is printed at the end (from `leaf_start`).
+    int partial = rdm->partial_flags;
+    size_t components = 0;
+    size_t leaf_start = 0;
+    bool was_skipping_printing = rdm->skipping_printing;
+    if (partial == RUST_DEMANGLE_FLAG_LEAF_ONLY)
+        rdm->skipping_printing = true;
+
     while (1) {
         if (eat(rdm, 'E')) {
             // FIXME Maybe check if at end of symbol?
-            return;
+            break;
         }
 
+        size_t mangled_start = rdm->next;
         struct rust_mangled_ident name = parse_ident(rdm);
 
         if (!rdm->verbose && peek(rdm) == 'E' && is_rust_hash(name)) {
@@ -1304,182 +2501,362 @@ static void demangle_legacy_path(struct rust_demangler *rdm) {
         if (!first) {
             PRINT("::");
         }
-        first = false;
 
+        size_t output_start = output_pos(rdm);
         print_legacy_ident(rdm, name);
 
         CHECK_OR(!rdm->errored, return);
-    }
-}
 
-bool rust_demangle_with_callback(
-    const char *whole_mangled_symbol, int flags,
-    void (*callback)(const char *data, size_t len, void *opaque), void *opaque
-) {
-    struct rust_demangler rdm;
+        emit_leaf_event(
+            rdm,
+            first ? RUST_DEMANGLE_EVENT_CRATE : RUST_DEMANGLE_EVENT_NAMESPACE,
+            0, mangled_start, output_start, 0
+        );
+        if (first && (partial & RUST_DEMANGLE_FLAG_CRATE_ONLY)) {
+            was_skipping_printing = rdm->skipping_printing;
+            rdm->skipping_printing = true;
+        }
+        first = false;
+        components++;
+        leaf_start = mangled_start;
 
-    rdm.sym = whole_mangled_symbol;
-    rdm.sym_len = 0;
+        if (rdm->next == interned_end)
+            end_interned_prefix(rdm);
+    }
 
-    rdm.callback_opaque = opaque;
-    rdm.callback = callback;
+    if (partial) {
+        rdm->skipping_printing = was_skipping_printing;
+        if ((partial & RUST_DEMANGLE_FLAG_LEAF_ONLY) &&
+            (partial == RUST_DEMANGLE_FLAG_LEAF_ONLY || components > 1)) {
+            if (partial != RUST_DEMANGLE_FLAG_LEAF_ONLY)
+                PRINT("::");
+            size_t end = rdm->next;
+            rdm->next = leaf_start;
+            print_legacy_ident(rdm, parse_ident(rdm));
+            rdm->next = end;
+        }
+    }
 
-    rdm.next = 0;
-    rdm.errored = false;
-    rdm.skipping_printing = false;
-    rdm.verbose = (flags & RUST_DEMANGLE_FLAG_VERBOSE) != 0;
-    rdm.version = -2; // Invalid version
-    rdm.bound_lifetime_depth = 0;
+    end_events(rdm, events);
+}
+
+/// Demangle one symbol, using the configuration (output callback, flags and
+/// scratch space) already present in `rdm`, and resetting everything else.
+static bool demangle_symbol(
+    struct rust_demangler *rdm, const char *whole_mangled_symbol,
+    size_t whole_len
+) {
+    rdm->sym = whole_mangled_symbol;
+    rdm->sym_len = whole_len;
+
+    rdm->out_len = 0;
+
+    rdm->next = 0;
+    rdm->errored = false;
+    rdm->backref_nesting = 0;
+    rdm->depth = 0;
+    rdm->peak_depth = 0;
+    rdm->output_remaining = rdm->max_output;
+    rdm->output_too_big = false;
+    rdm->skipping_printing = rdm->validate_only;
+    rdm->version = -2; // Invalid version
+    rdm->bound_lifetime_depth = 0;
+    rdm->generic_depth = 0;
+    rdm->open_events.len = 0;
+    rdm->at_interned_prefix = false;
+    rdm->interned.mangled_start = 0;
+    rdm->interned.mangled_end = 0;
+    rdm->interned.hash = 0;
+    rdm->interned.index = INTERNED_PREFIX_NONE;
+    rdm->interned.output_len = 0;
+    rdm->partial_path = 0;
+
+    if (rdm->memoize_backrefs) {
+        rdm->memo_output.len = 0;
+        for (size_t i = 0; i < sizeof(rdm->memo) / sizeof(rdm->memo[0]); i++)
+            rdm->memo[i].kind = BACKREF_UNMEMOIZED;
+    }
 
     // Rust symbols always start with R, _R or __R for the v0 scheme or ZN, _ZN
     // or __ZN for the legacy scheme.
-    if (strncmp(rdm.sym, "_R", 2) == 0) {
-        rdm.sym += 2;
-        rdm.version = 0; // v0
-    } else if (rdm.sym[0] == 'R') {
+    size_t prefix_len;
+    if (whole_len >= 2 && memcmp(rdm->sym, "_R", 2) == 0) {
+        prefix_len = 2;
+        rdm->version = 0; // v0
+    } else if (whole_len >= 1 && rdm->sym[0] == 'R') {
         // On Windows, dbghelp strips leading underscores, so we accept "R..."
         // form too.
-        rdm.sym += 1;
-        rdm.version = 0; // v0
-    } else if (strncmp(rdm.sym, "__R", 3) == 0) {
+        prefix_len = 1;
+        rdm->version = 0; // v0
+    } else if (whole_len >= 3 && memcmp(rdm->sym, "__R", 3) == 0) {
         // On OSX, symbols are prefixed with an extra _
-        rdm.sym += 3;
-        rdm.version = 0; // v0
-    } else if (strncmp(rdm.sym, "_ZN", 3) == 0) {
-        rdm.sym += 3;
-        rdm.version = -1; // legacy
-    } else if (strncmp(rdm.sym, "ZN", 2) == 0) {
+        prefix_len = 3;
+        rdm->version = 0; // v0
+    } else if (whole_len >= 3 && memcmp(rdm->sym, "_ZN", 3) == 0) {
+        prefix_len = 3;
+        rdm->version = -1; // legacy
+    } else if (whole_len >= 2 && memcmp(rdm->sym, "ZN", 2) == 0) {
         // On Windows, dbghelp strips leading underscores, so we accept "R..."
         // form too.
-        rdm.sym += 2;
-        rdm.version = -1; // legacy
-    } else if (strncmp(rdm.sym, "__ZN", 4) == 0) {
+        prefix_len = 2;
+        rdm->version = -1; // legacy
+    } else if (whole_len >= 4 && memcmp(rdm->sym, "__ZN", 4) == 0) {
         // On OSX, symbols are prefixed with an extra _
-        rdm.sym += 4;
-        rdm.version = -1; // legacy
+        prefix_len = 4;
+        rdm->version = -1; // legacy
     } else {
         return false;
     }
+    rdm->sym += prefix_len;
+    rdm->sym_len -= prefix_len;
+    rdm->prefix_len = prefix_len;
 
-    if (rdm.version != -1) {
+    if (rdm->version != -1) {
         // Paths always start with uppercase characters.
-        if (!IS_UPPER(rdm.sym[0]))
+        if (!(rdm->sym_len > 0 && IS_UPPER(rdm->sym[0])))
             return false;
     }
 
-    // Rust symbols only use ASCII characters.
-    for (const char *p = rdm.sym; *p; p++) {
-        if ((*p & 0x80) != 0)
-            return false;
+    // NOTE: there is no separate validation pass over the symbol:
+    // anything not consumed by the grammar below is either an identifier
+    // (checked by `parse_ident`), or part of the suffix (checked below).
 
-        if (*p == '.' && strncmp(p, ".llvm.", 6) == 0) {
-            // Ignore .llvm.<hash> suffixes
-            break;
-        }
-
-        rdm.sym_len++;
-    }
-
-    if (rdm.version == -1) {
-        demangle_legacy_path(&rdm);
+    if (rdm->version == -1) {
+        demangle_legacy_path(rdm);
     } else {
-        demangle_path(&rdm, true);
+        rdm->at_interned_prefix = rdm->prefix_batch && !rdm->partial_flags;
+        rdm->partial_path = rdm->partial_flags;
+        demangle_path(rdm, true);
 
         // Skip instantiating crate.
-        if (!rdm.errored && rdm.next < rdm.sym_len && peek(&rdm) >= 'A' &&
-            peek(&rdm) <= 'Z') {
-            rdm.skipping_printing = true;
-            demangle_path(&rdm, false);
+        if (!rdm->errored && rdm->next < rdm->sym_len && peek(rdm) >= 'A' &&
+            peek(rdm) <= 'Z') {
+            rdm->skipping_printing = true;
+            demangle_path(rdm, false);
         }
     }
 
-    if (!rdm.errored && (rdm.sym_len - rdm.next > 0)) {
-        for (const char *p = rdm.sym + rdm.next; *p; p++) {
-            // FIXME match is_symbol_like from rustc-demangle
-            if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
-                  (*p >= '0' && *p <= '9') || *p == '.')) {
+    // End any events left open by errors (in backrefs).
+    end_events(rdm, 0);
+
+    // Ignore .llvm.<hash> suffixes.
+    size_t suffix_len = 0;
+    if (!rdm->errored && rdm->next < rdm->sym_len &&
+        !is_llvm_suffix(rdm->sym, rdm->sym_len, rdm->next)) {
+        for (size_t i = rdm->next; i < rdm->sym_len; i++) {
+            if (!is_symbol_like_char(rdm->sym[i])) {
                 // Suffix is not a symbol like string
                 return false;
             }
+            if (suffix_len == 0 && is_llvm_suffix(rdm->sym, rdm->sym_len, i))
+                suffix_len = i - rdm->next;
         }
+        if (suffix_len == 0)
+            suffix_len = rdm->sym_len - rdm->next;
+    }
+
+    if (rdm->errored)
+        return false;
 
-        // Print LLVM produced suffix
-        print_str(&rdm, rdm.sym + rdm.next, rdm.sym_len - rdm.next);
+    if (rdm->output_too_big) {
+        const char *marker = "{size limit reached}";
+        append_output(rdm, marker, strlen(marker));
     }
 
-    return !rdm.errored;
+    // Print LLVM produced suffix (which, like in `rustc-demangle`, doesn't
+    // count towards the output limit, and is printed even after it's hit),
+    // unless only part of the path is printed.
+    if (rdm->partial_flags)
+        suffix_len = 0;
+    append_output(rdm, rdm->sym + rdm->next, suffix_len);
+
+    flush_output(rdm);
+    return true;
 }
 
-// Growable string buffers.
-struct str_buf {
-    char *ptr;
-    size_t len;
-    size_t cap;
-    bool errored;
-};
+static void rust_demangler_init(
+    struct rust_demangler *rdm, int flags, struct str_buf *scratch,
+    void (*callback)(const char *data, size_t len, void *opaque), void *opaque
+) {
+    rdm->callback_opaque = opaque;
+    rdm->callback = callback;
+    rdm->scratch = scratch;
+    rdm->verbose = (flags & RUST_DEMANGLE_FLAG_VERBOSE) != 0;
+    rdm->memoize_backrefs = (flags & RUST_DEMANGLE_FLAG_MEMOIZE_BACKREFS) != 0;
+    rdm->partial_flags =
+        flags & (RUST_DEMANGLE_FLAG_CRATE_ONLY | RUST_DEMANGLE_FLAG_LEAF_ONLY);
+    rdm->partial_path = 0;
+    rdm->no_generics = (flags & RUST_DEMANGLE_FLAG_NO_GENERICS) != 0;
+    rdm->memo_output.ptr = NULL;
+    rdm->memo_output.len = 0;
+    rdm->memo_output.cap = 0;
+    rdm->memo_output.errored = false;
+    rdm->on_event = NULL;
+    rdm->open_events.ptr = NULL;
+    rdm->open_events.len = 0;
+    rdm->open_events.cap = 0;
+    rdm->open_events.errored = false;
+    rdm->prefix_len = 0;
+    rdm->prefix_batch = NULL;
+    rdm->at_interned_prefix = false;
+    rdm->validate_only = false;
+    rdm->max_depth = RUST_DEMANGLE_DEFAULT_MAX_DEPTH;
+    rdm->max_output = RUST_DEMANGLE_DEFAULT_MAX_OUTPUT;
+    rdm->max_generic_depth = SIZE_MAX;
+    rdm->max_generic_args = SIZE_MAX;
+}
 
-static void str_buf_reserve(struct str_buf *buf, size_t extra) {
-    // Allocation failed before.
-    if (buf->errored)
-        return;
+/// Apply the limits in `options` (other than `flags`, see
+/// `rust_demangler_init`), leaving the defaults in place for any `0`s.
+static void rust_demangler_set_limits(
+    struct rust_demangler *rdm, const struct rust_demangle_options *options
+) {
+    if (options->max_depth)
+        rdm->max_depth = options->max_depth;
+    if (options->max_output)
+        rdm->max_output = options->max_output;
+    if (options->max_generic_depth)
+        rdm->max_generic_depth = options->max_generic_depth;
+    if (options->max_generic_args)
+        rdm->max_generic_args = options->max_generic_args;
+}
 
-    size_t available = buf->cap - buf->len;
+static void
+discard_demangle_callback(const char *data, size_t len, void *opaque) {
+    (void)data;
+    (void)len;
+    (void)opaque;
+}
 
-    if (extra <= available)
-        return;
+enum rust_demangle_status rust_demangle_with_events(
+    const char *mangled, size_t len,
+    const struct rust_demangle_options *options,
+    void (*callback)(const char *data, size_t len, void *opaque),
+    void (*on_event)(const struct rust_demangle_event *event, void *opaque),
+    void *opaque
+) {
+    struct str_buf scratch;
 
-    size_t min_new_cap = buf->cap + (extra - available);
+    scratch.ptr = NULL;
+    scratch.len = 0;
+    scratch.cap = 0;
+    scratch.errored = false;
 
-    // Check for overflows.
-    if (min_new_cap < buf->cap) {
-        buf->errored = true;
-        return;
+    if (!callback)
+        callback = discard_demangle_callback;
+
+    struct rust_demangler rdm;
+    rust_demangler_init(&rdm, options->flags, &scratch, callback, opaque);
+    rust_demangler_set_limits(&rdm, options);
+
+    // NOTE: memoized backrefs would be missing their events.
+    if (on_event) {
+        rdm.on_event = on_event;
+        rdm.memoize_backrefs = false;
     }
 
-    size_t new_cap = buf->cap;
+    enum rust_demangle_status status = RUST_DEMANGLE_FAILED;
+    if (demangle_symbol(&rdm, mangled, len) && !rdm.open_events.errored)
+        status = rdm.output_too_big ? RUST_DEMANGLE_TOO_BIG : RUST_DEMANGLE_OK;
 
-    if (new_cap == 0)
-        new_cap = 4;
+    RUST_DEMANGLE_FREE(scratch.ptr);
+    RUST_DEMANGLE_FREE(rdm.memo_output.ptr);
+    RUST_DEMANGLE_FREE(rdm.open_events.ptr);
+    return status;
+}
 
-    // Double capacity until sufficiently large.
-    while (new_cap < min_new_cap) {
-        new_cap *= 2;
+enum rust_demangle_status rust_demangle_with_options(
+    const char *mangled, size_t len,
+    const struct rust_demangle_options *options,
+    void (*callback)(const char *data, size_t len, void *opaque), void *opaque
+) {
+    return rust_demangle_with_events(
+        mangled, len, options, callback, NULL, opaque
+    );
+}
 
-        // Check for overflows.
-        if (new_cap < buf->cap) {
-            buf->errored = true;
-            return;
-        }
-    }
+bool rust_demangle_with_callback_n(
+    const char *mangled, size_t len, int flags,
+    void (*callback)(const char *data, size_t len, void *opaque), void *opaque
+) {
+    struct rust_demangle_options options;
 
-    char *new_ptr = (char *)realloc(buf->ptr, new_cap);
-    if (new_ptr == NULL) {
-        free(buf->ptr);
-        buf->ptr = NULL;
-        buf->len = 0;
-        buf->cap = 0;
-        buf->errored = true;
-    } else {
-        buf->ptr = new_ptr;
-        buf->cap = new_cap;
+    options.flags = flags;
+    options.max_depth = 0;
+    options.max_output = 0;
+    options.max_generic_depth = 0;
+    options.max_generic_args = 0;
+
+    enum rust_demangle_status status =
+        rust_demangle_with_options(mangled, len, &options, callback, opaque);
+    return status != RUST_DEMANGLE_FAILED;
+}
+
+bool rust_demangle_with_callback(
+    const char *mangled, int flags,
+    void (*callback)(const char *data, size_t len, void *opaque), void *opaque
+) {
+    return rust_demangle_with_callback_n(
+        mangled, strlen(mangled), flags, callback, opaque
+    );
+}
+
+// Fixed-capacity string buffers, which never allocate, and instead truncate
+// the output, while still keeping track of the full length (like `snprintf`).
+struct fixed_buf {
+    char *ptr;
+    size_t len;
+    size_t cap;
+};
+
+static void
+fixed_buf_demangle_callback(const char *data, size_t len, void *opaque) {
+    struct fixed_buf *buf = (struct fixed_buf *)opaque;
+
+    if (buf->len < buf->cap) {
+        size_t available = buf->cap - buf->len;
+        memcpy(buf->ptr + buf->len, data, len < available ? len : available);
     }
+
+    // Saturate instead of overflowing.
+    buf->len = buf->len + len < buf->len ? SIZE_MAX : buf->len + len;
 }
 
-static void str_buf_append(struct str_buf *buf, const char *data, size_t len) {
-    str_buf_reserve(buf, len);
-    if (buf->errored)
-        return;
+bool rust_demangle_into_n(
+    const char *mangled, size_t len, char *out, size_t cap, size_t *needed,
+    int flags
+) {
+    struct fixed_buf buf;
 
-    memcpy(buf->ptr + buf->len, data, len);
-    buf->len += len;
+    // Leave room for the NUL terminator.
+    buf.ptr = out;
+    buf.len = 0;
+    buf.cap = cap > 0 ? cap - 1 : 0;
+
+    bool success = rust_demangle_with_callback_n(
+        mangled, len, flags, fixed_buf_demangle_callback, &buf
+    );
+
+    if (!success)
+        buf.len = 0;
+
+    if (cap > 0)
+        out[buf.len < buf.cap ? buf.len : buf.cap] = 0;
+    if (needed)
+        *needed = buf.len;
+
+    return success;
 }
 
-static void
-str_buf_demangle_callback(const char *data, size_t len, void *opaque) {
-    str_buf_append(opaque, data, len);
+bool rust_demangle_into(
+    const char *mangled, char *out, size_t cap, size_t *needed, int flags
+) {
+    return rust_demangle_into_n(
+        mangled, strlen(mangled), out, cap, needed, flags
+    );
 }
 
-char *rust_demangle(const char *mangled, int flags) {
+char *rust_demangle_n(const char *mangled, size_t len, int flags) {
     struct str_buf out;
 
     out.ptr = NULL;
@@ -1487,15 +2864,855 @@ char *rust_demangle(const char *mangled, int flags) {
     out.cap = 0;
     out.errored = false;
 
-    bool success = rust_demangle_with_callback(
-        mangled, flags, str_buf_demangle_callback, &out
+    bool success = rust_demangle_with_callback_n(
+        mangled, len, flags, str_buf_demangle_callback, &out
     );
 
     if (!success) {
-        free(out.ptr);
+        RUST_DEMANGLE_FREE(out.ptr);
         return NULL;
     }
 
     str_buf_append(&out, "\0", 1);
     return out.ptr;
 }
+
+char *rust_demangle(const char *mangled, int flags) {
+    return rust_demangle_n(mangled, strlen(mangled), flags);
+}
+
+enum rust_demangle_scheme
+rust_demangle_classify(const char *mangled, size_t len) {
+    struct str_buf scratch;
+
+    // NOTE: punycode is only decoded (into `scratch`) when printing, so
+    // this never allocates.
+    scratch.ptr = NULL;
+    scratch.len = 0;
+    scratch.cap = 0;
+    scratch.errored = false;
+
+    struct rust_demangler rdm;
+    rust_demangler_init(&rdm, 0, &scratch, discard_demangle_callback, NULL);
+    rdm.validate_only = true;
+
+    if (!demangle_symbol(&rdm, mangled, len))
+        return RUST_DEMANGLE_SCHEME_NONE;
+    return rdm.version == -1 ? RUST_DEMANGLE_SCHEME_LEGACY
+                             : RUST_DEMANGLE_SCHEME_V0;
+}
+
+static void
+fingerprint_demangle_callback(const char *data, size_t len, void *opaque) {
+    uint64_t *hash = (uint64_t *)opaque;
+    *hash = hash_bytes(*hash, data, len);
+}
+
+bool rust_demangle_fingerprint(
+    const char *mangled, size_t len, int flags, uint64_t *fingerprint
+) {
+    uint64_t hash = HASH_BYTES_INIT;
+
+    bool success = rust_demangle_with_callback_n(
+        mangled, len, flags & ~RUST_DEMANGLE_FLAG_VERBOSE,
+        fingerprint_demangle_callback, &hash
+    );
+
+    *fingerprint = success ? hash : 0;
+    return success;
+}
+
+/// Demangle `syms[start..end]` (see `rust_demangle_batch`), appending to the
+/// `str_buf` that `rdm` was configured to output to, and returning `false` if
+/// allocating that output failed.
+static bool demangle_batch_range(
+    struct rust_demangler *rdm, const char *const *syms, const size_t *lens,
+    size_t start, size_t end, size_t *offsets
+) {
+    struct str_buf *out = (struct str_buf *)rdm->callback_opaque;
+
+    for (size_t i = start; i < end; i++) {
+        size_t out_start = out->len;
+        size_t len = lens ? lens[i] : strlen(syms[i]);
+
+        if (demangle_symbol(rdm, syms[i], len)) {
+            str_buf_append(out, "\0", 1);
+            offsets[i] = out_start;
+        } else {
+            // Discard any output produced before failing.
+            out->len = out_start;
+            offsets[i] = RUST_DEMANGLE_BATCH_FAILED;
+        }
+
+        // Allocation failed (and `str_buf_reserve` already freed `out`).
+        if (out->errored)
+            return false;
+    }
+    return true;
+}
+
+char *rust_demangle_batch(
+    const char *const *syms, const size_t *lens, size_t n, int flags,
+    size_t *offsets
+) {
+    struct str_buf out, scratch;
+
+    out.ptr = NULL;
+    out.len = 0;
+    out.cap = 0;
+    out.errored = false;
+
+    scratch.ptr = NULL;
+    scratch.len = 0;
+    scratch.cap = 0;
+    scratch.errored = false;
+
+    struct rust_demangler rdm;
+    rust_demangler_init(
+        &rdm, flags, &scratch, str_buf_demangle_callback, &out
+    );
+
+    demangle_batch_range(&rdm, syms, lens, 0, n, offsets);
+
+    RUST_DEMANGLE_FREE(scratch.ptr);
+    RUST_DEMANGLE_FREE(rdm.memo_output.ptr);
+
+    // Always return an allocation on success, even if there's no output.
+    str_buf_reserve(&out, 1);
+    if (out.errored)
+        return NULL;
+    return out.ptr;
+}
+
+struct rust_demangle_ctx {
+    struct rust_demangler rdm;
+
+    // The output of the last symbol (NUL-terminated), and the scratch space
+    // used by `rdm` (see `struct rust_demangler`), all kept between symbols.
+    struct str_buf out;
+    struct str_buf scratch;
+
+    // Capacity reserved for `out` (and `rdm.memo_output`, if used) upfront.
+    size_t reserve;
+
+    struct rust_demangle_ctx_stats stats;
+};
+
+static size_t ctx_reserved_bytes(const struct rust_demangle_ctx *ctx) {
+    return ctx->out.cap + ctx->scratch.cap + ctx->rdm.memo_output.cap;
+}
+
+/// Release all the buffers of `ctx`, and reserve them again (as done by
+/// `rust_demangle_ctx_new`), returning `false` if that allocation failed.
+static bool ctx_reset_buffers(struct rust_demangle_ctx *ctx) {
+    struct str_buf *bufs[] = {&ctx->out, &ctx->scratch, &ctx->rdm.memo_output};
+    for (size_t i = 0; i < sizeof(bufs) / sizeof(bufs[0]); i++) {
+        RUST_DEMANGLE_FREE(bufs[i]->ptr);
+        bufs[i]->ptr = NULL;
+        bufs[i]->len = 0;
+        bufs[i]->cap = 0;
+        bufs[i]->errored = false;
+    }
+
+    // Leave room for the NUL terminator.
+    str_buf_reserve(&ctx->out, ctx->reserve + 1);
+    if (ctx->rdm.memoize_backrefs)
+        str_buf_reserve(&ctx->rdm.memo_output, ctx->reserve);
+    return !ctx->out.errored && !ctx->rdm.memo_output.errored;
+}
+
+struct rust_demangle_ctx *rust_demangle_ctx_new(
+    const struct rust_demangle_options *options, size_t reserve
+) {
+    struct rust_demangle_ctx *ctx =
+        (struct rust_demangle_ctx *)zeroed_alloc(1, sizeof(*ctx));
+    if (!ctx)
+        return NULL;
+
+    rust_demangler_init(
+        &ctx->rdm, options->flags, &ctx->scratch, str_buf_demangle_callback,
+        &ctx->out
+    );
+    rust_demangler_set_limits(&ctx->rdm, options);
+
+    // Check for overflows (of the NUL terminator added to `reserve`).
+    ctx->reserve = reserve < SIZE_MAX ? reserve : SIZE_MAX - 1;
+    if (!ctx_reset_buffers(ctx)) {
+        rust_demangle_ctx_free(ctx);
+        return NULL;
+    }
+    ctx->stats.reserved_bytes = ctx_reserved_bytes(ctx);
+
+    return ctx;
+}
+
+void rust_demangle_ctx_free(struct rust_demangle_ctx *ctx) {
+    if (!ctx)
+        return;
+
+    RUST_DEMANGLE_FREE(ctx->out.ptr);
+    RUST_DEMANGLE_FREE(ctx->scratch.ptr);
+    RUST_DEMANGLE_FREE(ctx->rdm.memo_output.ptr);
+    RUST_DEMANGLE_FREE(ctx);
+}
+
+const char *rust_demangle_ctx_demangle(
+    struct rust_demangle_ctx *ctx, const char *mangled, size_t len,
+    size_t *out_len
+) {
+    size_t reserved_before = ctx_reserved_bytes(ctx);
+
+    // Any allocation failure was only for the previous symbol, so try again
+    // (after `str_buf_reserve` freed the buffer, making it empty).
+    ctx->out.len = 0;
+    ctx->out.errored = false;
+    ctx->rdm.memo_output.errored = false;
+
+    bool success = demangle_symbol(&ctx->rdm, mangled, len);
+    if (success)
+        str_buf_append(&ctx->out, "\0", 1);
+    success = success && !ctx->out.errored;
+
+    ctx->stats.symbols++;
+    if (ctx_reserved_bytes(ctx) != reserved_before) {
+        ctx->stats.allocations++;
+        ctx->stats.reserved_bytes = ctx_reserved_bytes(ctx);
+    }
+    if (success && ctx->out.len - 1 > ctx->stats.peak_output)
+        ctx->stats.peak_output = ctx->out.len - 1;
+
+    if (out_len)
+        *out_len = success ? ctx->out.len - 1 : 0;
+    return success ? ctx->out.ptr : NULL;
+}
+
+void rust_demangle_ctx_reset(struct rust_demangle_ctx *ctx) {
+    // NOTE: if reserving fails here, the buffers are empty, and will
+    // just be grown again as needed, by the next symbols.
+    ctx_reset_buffers(ctx);
+
+    ctx->stats.symbols = 0;
+    ctx->stats.allocations = 0;
+    ctx->stats.peak_output = 0;
+    ctx->stats.reserved_bytes = ctx_reserved_bytes(ctx);
+}
+
+void rust_demangle_ctx_get_stats(
+    const struct rust_demangle_ctx *ctx, struct rust_demangle_ctx_stats *stats
+) {
+    *stats = ctx->stats;
+}
+
+static void prefix_batch_grow_slots(struct rust_demangle_prefix_batch *batch) {
+    size_t new_cap = batch->slots_cap * 2;
+    struct prefix_batch_slot *new_slots = (struct prefix_batch_slot *)
+        zeroed_alloc(new_cap, sizeof(struct prefix_batch_slot));
+    if (!new_slots) {
+        batch->errored = true;
+        return;
+    }
+
+    for (size_t i = 0; i < batch->slots_cap; i++) {
+        if (!batch->slots[i].index_plus_one)
+            continue;
+        size_t j = batch->slots[i].hash & (new_cap - 1);
+        while (new_slots[j].index_plus_one)
+            j = (j + 1) & (new_cap - 1);
+        new_slots[j] = batch->slots[i];
+    }
+
+    RUST_DEMANGLE_FREE(batch->slots);
+    batch->slots = new_slots;
+    batch->slots_cap = new_cap;
+}
+
+/// Find the prefix mangled as `key` (hashed as `hash`), or add it (with `text`
+/// as its output), returning its index.
+static size_t intern_prefix(
+    struct rust_demangle_prefix_batch *batch, const char *key, size_t key_len,
+    uint64_t hash, const char *text, size_t text_len
+) {
+    size_t index = find_interned_prefix(batch, key, key_len, hash);
+    if (index != INTERNED_PREFIX_NONE)
+        return index;
+
+    size_t count = batch->prefixes.len / sizeof(struct interned_prefix);
+    if ((count + 1) * 2 > batch->slots_cap)
+        prefix_batch_grow_slots(batch);
+
+    struct interned_prefix prefix;
+
+    prefix.key_start = batch->keys.len;
+    prefix.key_len = key_len;
+    prefix.text_start = batch->prefix_text.len;
+    prefix.text_len = text_len;
+
+    str_buf_append(&batch->keys, key, key_len);
+    str_buf_append(&batch->prefix_text, text, text_len);
+    str_buf_append(&batch->prefixes, (const char *)&prefix, sizeof(prefix));
+    if (batch->errored || batch->keys.errored ||
+        batch->prefix_text.errored || batch->prefixes.errored) {
+        batch->errored = true;
+        return INTERNED_PREFIX_NONE;
+    }
+
+    size_t i = hash & (batch->slots_cap - 1);
+    while (batch->slots[i].index_plus_one)
+        i = (i + 1) & (batch->slots_cap - 1);
+    batch->slots[i].hash = hash;
+    batch->slots[i].index_plus_one = count + 1;
+
+    return count;
+}
+
+struct rust_demangle_prefix_batch *rust_demangle_prefix_batch_new(int flags) {
+    struct rust_demangle_prefix_batch *batch =
+        (struct rust_demangle_prefix_batch *)zeroed_alloc(1, sizeof(*batch));
+    if (!batch)
+        return NULL;
+
+    batch->slots_cap = 64;
+    batch->slots = (struct prefix_batch_slot *)zeroed_alloc(
+        batch->slots_cap, sizeof(struct prefix_batch_slot)
+    );
+    if (!batch->slots) {
+        RUST_DEMANGLE_FREE(batch);
+        return NULL;
+    }
+
+    rust_demangler_init(
+        &batch->rdm, flags, &batch->scratch, str_buf_demangle_callback,
+        &batch->text
+    );
+    batch->rdm.prefix_batch = batch;
+
+    return batch;
+}
+
+void rust_demangle_prefix_batch_free(struct rust_demangle_prefix_batch *batch) {
+    if (!batch)
+        return;
+
+    RUST_DEMANGLE_FREE(batch->scratch.ptr);
+    RUST_DEMANGLE_FREE(batch->rdm.memo_output.ptr);
+    RUST_DEMANGLE_FREE(batch->prefixes.ptr);
+    RUST_DEMANGLE_FREE(batch->keys.ptr);
+    RUST_DEMANGLE_FREE(batch->prefix_text.ptr);
+    RUST_DEMANGLE_FREE(batch->slots);
+    RUST_DEMANGLE_FREE(batch->symbols.ptr);
+    RUST_DEMANGLE_FREE(batch->text.ptr);
+    RUST_DEMANGLE_FREE(batch);
+}
+
+size_t rust_demangle_prefix_batch_add(
+    struct rust_demangle_prefix_batch *batch, const char *mangled, size_t len
+) {
+    if (batch->errored)
+        return RUST_DEMANGLE_PREFIX_BATCH_FAILED;
+
+    struct rust_demangler *rdm = &batch->rdm;
+    struct prefix_batch_symbol symbol;
+
+    symbol.text_start = batch->text.len;
+    symbol.success = demangle_symbol(rdm, mangled, len);
+    symbol.prefix = rdm->interned.index;
+
+    if (!symbol.success) {
+        // Discard any output produced before failing.
+        batch->text.len = symbol.text_start;
+        symbol.prefix = INTERNED_PREFIX_NONE;
+    } else if (symbol.prefix != INTERNED_PREFIX_NONE) {
+        batch->hits++;
+    } else if (rdm->interned.mangled_end != 0 && !batch->text.errored) {
+        // Move the prefix (printed at the start of the output) out of `text`.
+        char *text = batch->text.ptr + symbol.text_start;
+        size_t prefix_len = rdm->interned.output_len;
+        size_t rest_len = batch->text.len - symbol.text_start - prefix_len;
+
+        symbol.prefix = intern_prefix(
+            batch, rdm->sym + rdm->interned.mangled_start,
+            rdm->interned.mangled_end - rdm->interned.mangled_start,
+            rdm->interned.hash, text, prefix_len
+        );
+        memmove(text, text + prefix_len, rest_len);
+        batch->text.len -= prefix_len;
+    }
+    symbol.text_len = batch->text.len - symbol.text_start;
+
+    str_buf_append(&batch->symbols, (const char *)&symbol, sizeof(symbol));
+    if (batch->text.errored || batch->symbols.errored)
+        batch->errored = true;
+    if (batch->errored)
+        return RUST_DEMANGLE_PREFIX_BATCH_FAILED;
+
+    return batch->symbols.len / sizeof(symbol) - 1;
+}
+
+bool rust_demangle_prefix_batch_render(
+    const struct rust_demangle_prefix_batch *batch, size_t index, char *out,
+    size_t cap, size_t *needed
+) {
+    const struct prefix_batch_symbol *symbol = NULL;
+    if (!batch->errored &&
+        index < batch->symbols.len / sizeof(struct prefix_batch_symbol))
+        symbol = (const struct prefix_batch_symbol *)batch->symbols.ptr + index;
+
+    struct fixed_buf buf;
+
+    // Leave room for the NUL terminator.
+    buf.ptr = out;
+    buf.len = 0;
+    buf.cap = cap > 0 ? cap - 1 : 0;
+
+    bool success = symbol && symbol->success;
+    if (success && symbol->prefix != INTERNED_PREFIX_NONE) {
+        const struct interned_prefix *prefix =
+            (const struct interned_prefix *)batch->prefixes.ptr +
+            symbol->prefix;
+        fixed_buf_demangle_callback(
+            batch->prefix_text.ptr + prefix->text_start, prefix->text_len, &buf
+        );
+    }
+    if (success && symbol->text_len > 0)
+        fixed_buf_demangle_callback(
+            batch->text.ptr + symbol->text_start, symbol->text_len, &buf
+        );
+
+    if (cap > 0)
+        out[buf.len < buf.cap ? buf.len : buf.cap] = 0;
+    if (needed)
+        *needed = buf.len;
+
+    return success;
+}
+
+void rust_demangle_prefix_batch_get_stats(
+    const struct rust_demangle_prefix_batch *batch,
+    struct rust_demangle_prefix_batch_stats *stats
+) {
+    stats->symbols = batch->symbols.len / sizeof(struct prefix_batch_symbol);
+    stats->prefixes = batch->prefixes.len / sizeof(struct interned_prefix);
+    stats->hits = batch->hits;
+    stats->prefix_bytes = batch->prefix_text.len;
+    stats->suffix_bytes = batch->text.len;
+}
+
+#ifdef RUST_DEMANGLE_PTHREADS
+
+// Number of symbols each thread takes at once (small enough to balance out
+// any unevenness between symbols, but large enough to avoid contention).
+#define BATCH_PARALLEL_CHUNK 256
+
+struct batch_parallel_chunk {
+    // Index of the thread which demangled this chunk.
+    size_t thread;
+
+    // Output range of this chunk, in its thread's output.
+    size_t out_start;
+    size_t out_len;
+};
+
+struct batch_parallel_shared {
+    const char *const *syms;
+    const size_t *lens;
+    size_t n;
+    int flags;
+    size_t *offsets;
+
+    pthread_mutex_t lock;
+
+    // Index of the next chunk for any (idle) thread to take.
+    size_t next_chunk;
+
+    // `true` if any thread failed to allocate its output.
+    bool errored;
+
+    struct batch_parallel_chunk *chunks;
+    size_t chunk_count;
+};
+
+struct batch_parallel_thread {
+    struct batch_parallel_shared *shared;
+    size_t index;
+    pthread_t thread;
+    struct str_buf out;
+};
+
+static void *batch_parallel_worker(void *opaque) {
+    struct batch_parallel_thread *thread =
+        (struct batch_parallel_thread *)opaque;
+    struct batch_parallel_shared *shared = thread->shared;
+
+    struct str_buf scratch;
+
+    scratch.ptr = NULL;
+    scratch.len = 0;
+    scratch.cap = 0;
+    scratch.errored = false;
+
+    struct rust_demangler rdm;
+    rust_demangler_init(
+        &rdm, shared->flags, &scratch, str_buf_demangle_callback, &thread->out
+    );
+
+    while (1) {
+        pthread_mutex_lock(&shared->lock);
+        size_t c = shared->errored ? shared->chunk_count : shared->next_chunk;
+        if (c < shared->chunk_count)
+            shared->next_chunk++;
+        pthread_mutex_unlock(&shared->lock);
+
+        if (c >= shared->chunk_count)
+            break;
+
+        size_t start = c * BATCH_PARALLEL_CHUNK;
+        size_t end = start + BATCH_PARALLEL_CHUNK;
+        if (end > shared->n)
+            end = shared->n;
+
+        struct batch_parallel_chunk *chunk = &shared->chunks[c];
+        chunk->thread = thread->index;
+        chunk->out_start = thread->out.len;
+
+        if (!demangle_batch_range(
+                &rdm, shared->syms, shared->lens, start, end, shared->offsets
+            )) {
+            pthread_mutex_lock(&shared->lock);
+            shared->errored = true;
+            pthread_mutex_unlock(&shared->lock);
+            break;
+        }
+
+        chunk->out_len = thread->out.len - chunk->out_start;
+    }
+
+    RUST_DEMANGLE_FREE(scratch.ptr);
+    RUST_DEMANGLE_FREE(rdm.memo_output.ptr);
+    return NULL;
+}
+
+char *rust_demangle_batch_parallel(
+    const char *const *syms, const size_t *lens, size_t n, int flags,
+    size_t *offsets, size_t num_threads
+) {
+    if (num_threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = online > 0 ? (size_t)online : 1;
+    }
+
+    size_t chunk_count =
+        (n + BATCH_PARALLEL_CHUNK - 1) / BATCH_PARALLEL_CHUNK;
+    if (num_threads > chunk_count)
+        num_threads = chunk_count;
+    if (num_threads <= 1)
+        return rust_demangle_batch(syms, lens, n, flags, offsets);
+
+    struct batch_parallel_shared shared;
+
+    shared.syms = syms;
+    shared.lens = lens;
+    shared.n = n;
+    shared.flags = flags;
+    shared.offsets = offsets;
+    shared.next_chunk = 0;
+    shared.errored = false;
+    shared.chunk_count = chunk_count;
+
+    shared.chunks = (struct batch_parallel_chunk *)zeroed_alloc(
+        chunk_count, sizeof(struct batch_parallel_chunk)
+    );
+    struct batch_parallel_thread *threads =
+        (struct batch_parallel_thread *)zeroed_alloc(
+            num_threads, sizeof(struct batch_parallel_thread)
+        );
+    char *result = NULL;
+    if (!shared.chunks || !threads)
+        goto cleanup;
+
+    if (pthread_mutex_init(&shared.lock, NULL) != 0)
+        goto cleanup;
+
+    // The calling thread also takes part (as thread `0`), and if creating
+    // any other threads fails, it will just end up doing more of the work.
+    size_t spawned;
+    for (spawned = 0; spawned < num_threads; spawned++) {
+        struct batch_parallel_thread *thread = &threads[spawned];
+        thread->shared = &shared;
+        thread->index = spawned;
+        if (spawned == 0)
+            continue;
+        int err = pthread_create(
+            &thread->thread, NULL, batch_parallel_worker, thread
+        );
+        if (err != 0)
+            break;
+    }
+    batch_parallel_worker(&threads[0]);
+    for (size_t i = 1; i < spawned; i++)
+        pthread_join(threads[i].thread, NULL);
+
+    pthread_mutex_destroy(&shared.lock);
+
+    if (shared.errored)
+        goto cleanup;
+
+    // Stitch together the output of every chunk, in the original order.
+    size_t total_len = 0;
+    for (size_t c = 0; c < chunk_count; c++)
+        total_len += shared.chunks[c].out_len;
+
+    // Always return an allocation on success, even if there's no output.
+    result =
+        (char *)RUST_DEMANGLE_REALLOC(NULL, total_len > 0 ? total_len : 1);
+    if (!result)
+        goto cleanup;
+
+    size_t pos = 0;
+    for (size_t c = 0; c < chunk_count; c++) {
+        struct batch_parallel_chunk *chunk = &shared.chunks[c];
+        if (chunk->out_len > 0)
+            memcpy(
+                result + pos,
+                threads[chunk->thread].out.ptr + chunk->out_start,
+                chunk->out_len
+            );
+
+        size_t end = (c + 1) * BATCH_PARALLEL_CHUNK;
+        if (end > n)
+            end = n;
+        for (size_t i = c * BATCH_PARALLEL_CHUNK; i < end; i++)
+            if (offsets[i] != RUST_DEMANGLE_BATCH_FAILED)
+                offsets[i] = offsets[i] - chunk->out_start + pos;
+
+        pos += chunk->out_len;
+    }
+
+cleanup:
+    if (threads)
+        for (size_t i = 0; i < num_threads; i++)
+            RUST_DEMANGLE_FREE(threads[i].out.ptr);
+    RUST_DEMANGLE_FREE(threads);
+    RUST_DEMANGLE_FREE(shared.chunks);
+    return result;
+}
+
+#endif // RUST_DEMANGLE_PTHREADS
+
+// Streaming text filter.
+
+struct rust_demangle_filter {
+    void *callback_opaque;
+    void (*callback)(const char *data, size_t len, void *opaque);
+
+    // Demangler (and its scratch space), outputting to `demangled`, so that
+    // nothing is passed to `callback` unless demangling succeeds.
+    struct rust_demangler rdm;
+    struct str_buf scratch;
+    struct str_buf demangled;
+
+    // Word at the end of the input so far, which could be a symbol that
+    // continues into the next chunk of input.
+    struct str_buf pending;
+
+    // `true` if the input so far ended in the middle of a word (which means
+    // the next chunk of input can't start with a symbol).
+    bool in_word;
+};
+
+// Longest (partial) word kept around between chunks, while waiting to see if
+// it's a symbol, past which it's passed through, instead.
+#define FILTER_MAX_PENDING (1 << 20)
+
+static bool is_word_char(char c) {
+    return IS_LOWER(c) || IS_UPPER(c) || IS_DIGIT(c) || c == '_' || c == '$' ||
+           c == '.';
+}
+
+/// Find the first position `i >= pos` which might be the start of a symbol,
+/// i.e. `data[i]` is `_`, and `data[i + 1]` is one of `R`, `Z` or `_` (or
+/// `i + 1 == len`, where more input is needed to tell).
+static size_t
+filter_find_candidate(const char *data, size_t pos, size_t len) {
+    // Most text has few `_` (and fewer `_R`/`_Z`/`__`), so compare pairs of
+    // bytes, as many at a time as possible, to quickly skip over it.
+#ifdef __AVX2__
+    const __m256i underscore_32 = _mm256_set1_epi8('_');
+    const __m256i upper_r_32 = _mm256_set1_epi8('R');
+    const __m256i upper_z_32 = _mm256_set1_epi8('Z');
+    for (; len - pos > 32; pos += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(data + pos));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(data + pos + 1));
+        __m256i matches = _mm256_and_si256(
+            _mm256_cmpeq_epi8(a, underscore_32),
+            _mm256_or_si256(
+                _mm256_or_si256(
+                    _mm256_cmpeq_epi8(b, upper_r_32),
+                    _mm256_cmpeq_epi8(b, upper_z_32)
+                ),
+                _mm256_cmpeq_epi8(b, underscore_32)
+            )
+        );
+        unsigned mask = (unsigned)_mm256_movemask_epi8(matches);
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i underscore_16 = _mm_set1_epi8('_');
+    const __m128i upper_r_16 = _mm_set1_epi8('R');
+    const __m128i upper_z_16 = _mm_set1_epi8('Z');
+    for (; len - pos > 16; pos += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(data + pos));
+        __m128i b = _mm_loadu_si128((const __m128i *)(data + pos + 1));
+        __m128i matches = _mm_and_si128(
+            _mm_cmpeq_epi8(a, underscore_16),
+            _mm_or_si128(
+                _mm_or_si128(
+                    _mm_cmpeq_epi8(b, upper_r_16),
+                    _mm_cmpeq_epi8(b, upper_z_16)
+                ),
+                _mm_cmpeq_epi8(b, underscore_16)
+            )
+        );
+        unsigned mask = (unsigned)_mm_movemask_epi8(matches);
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+#endif
+    for (; pos < len; pos++) {
+        if (data[pos] != '_')
+            continue;
+        if (pos + 1 == len)
+            break;
+        char c = data[pos + 1];
+        if (c == 'R' || c == 'Z' || c == '_')
+            break;
+    }
+    return pos;
+}
+
+/// Output the demangling of `word`, if it's a valid symbol, or `word` itself.
+static void filter_word(
+    struct rust_demangle_filter *filter, const char *word, size_t len
+) {
+    filter->demangled.len = 0;
+    if (demangle_symbol(&filter->rdm, word, len) &&
+        !filter->demangled.errored) {
+        word = filter->demangled.ptr;
+        len = filter->demangled.len;
+    }
+    filter->demangled.errored = false;
+
+    if (len > 0)
+        filter->callback(word, len, filter->callback_opaque);
+}
+
+static void filter_flush_pending(struct rust_demangle_filter *filter) {
+    filter_word(filter, filter->pending.ptr, filter->pending.len);
+    filter->pending.len = 0;
+}
+
+struct rust_demangle_filter *rust_demangle_filter_new(
+    int flags, void (*callback)(const char *data, size_t len, void *opaque),
+    void *opaque
+) {
+    struct rust_demangle_filter *filter =
+        (struct rust_demangle_filter *)zeroed_alloc(1, sizeof(*filter));
+    if (!filter)
+        return NULL;
+
+    filter->callback_opaque = opaque;
+    filter->callback = callback;
+
+    rust_demangler_init(
+        &filter->rdm, flags, &filter->scratch, str_buf_demangle_callback,
+        &filter->demangled
+    );
+
+    return filter;
+}
+
+void rust_demangle_filter_write(
+    struct rust_demangle_filter *filter, const char *data, size_t len
+) {
+    size_t pos = 0;
+
+    // Finish the word left over from the previous chunk, if any.
+    if (filter->pending.len > 0) {
+        while (pos < len && is_word_char(data[pos]))
+            pos++;
+
+        str_buf_append(&filter->pending, data, pos);
+        if (filter->pending.errored ||
+            filter->pending.len > FILTER_MAX_PENDING) {
+            // Give up on the word, and pass the rest of it through.
+            filter->pending.errored = false;
+            filter->callback(
+                filter->pending.ptr, filter->pending.len,
+                filter->callback_opaque
+            );
+            filter->pending.len = 0;
+            filter->in_word = true;
+        } else if (pos == len)
+            return;
+        else
+            filter_flush_pending(filter);
+    }
+
+    // Start of the input not yet passed to the callback (or `pending`).
+    size_t passthrough = pos;
+
+    while (pos < len) {
+        size_t start = filter_find_candidate(data, pos, len);
+        if (start == len)
+            break;
+
+        // Find the end of the word `start` is in.
+        size_t end = start + 1;
+        while (end < len && is_word_char(data[end]))
+            end++;
+        pos = end;
+
+        // Symbols can only start at the start of a word.
+        if (start > 0 ? is_word_char(data[start - 1]) : filter->in_word)
+            continue;
+
+        if (start > passthrough)
+            filter->callback(
+                data + passthrough, start - passthrough,
+                filter->callback_opaque
+            );
+        passthrough = end;
+
+        if (end == len) {
+            // The word may continue in the next chunk.
+            str_buf_append(&filter->pending, data + start, end - start);
+            if (filter->pending.errored) {
+                filter->pending.errored = false;
+                filter->callback(
+                    data + start, end - start, filter->callback_opaque
+                );
+            }
+        } else
+            filter_word(filter, data + start, end - start);
+    }
+
+    if (len > passthrough)
+        filter->callback(
+            data + passthrough, len - passthrough, filter->callback_opaque
+        );
+
+    if (len > 0)
+        filter->in_word = is_word_char(data[len - 1]);
+}
+
+void rust_demangle_filter_finish(struct rust_demangle_filter *filter) {
+    if (filter->pending.len > 0)
+        filter_flush_pending(filter);
+
+    RUST_DEMANGLE_FREE(filter->scratch.ptr);
+    RUST_DEMANGLE_FREE(filter->rdm.memo_output.ptr);
+    RUST_DEMANGLE_FREE(filter->demangled.ptr);
+    RUST_DEMANGLE_FREE(filter->pending.ptr);
+    RUST_DEMANGLE_FREE(filter);
+}
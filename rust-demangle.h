@@ -1,18 +1,353 @@
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #define RUST_DEMANGLE_FLAG_VERBOSE 1
 
+// Reuse the output of backrefs (`B...` in v0 symbols) when the same target
+// is printed again, instead of demangling it again (which can be a lot faster
+// for heavily generic symbols, that keep referring back to long paths), at
+// the cost of keeping the whole output in a heap buffer, while demangling.
+#define RUST_DEMANGLE_FLAG_MEMOIZE_BACKREFS 2
+
+// Only print part of the symbol's path (e.g. for attributing profiling samples
+// to crates, or aggregating them by function name), i.e. its crate root (for
+// `impl` items, the crate of the `impl`), and/or (separated by `::`) its last
+// component (e.g. `new` for `<alloc::vec::Vec<T>>::new`), without its generic
+// args. Everything else is only parsed (still validating the whole symbol,
+// so these never succeed where full demangling wouldn't), without printing it
+// (or following any backrefs into it), and any suffix (e.g. `.cold`) is also
+// left out. For legacy symbols, the crate root is the first component (which
+// for `impl` items, is the `impl` itself, e.g. `<T as core::fmt::Debug>`).
+#define RUST_DEMANGLE_FLAG_CRATE_ONLY 4
+#define RUST_DEMANGLE_FLAG_LEAF_ONLY 8
+
+// Leave out all generic args (e.g. `core::iter::Map::next`, instead of
+// `core::iter::Map<I, F>::next`), without demangling them at all (legacy
+// symbols don't have any, other than in the names of `impl`s).
+#define RUST_DEMANGLE_FLAG_NO_GENERICS 16
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// The output is passed to `callback` in (buffered) chunks, as it's produced.
+// On failure (i.e. when `false` is returned), any output already passed to
+// `callback` is incomplete, and should be discarded.
 bool rust_demangle_with_callback(
     const char *mangled, int flags,
     void (*callback)(const char *data, size_t len, void *opaque), void *opaque
 );
 char *rust_demangle(const char *mangled, int flags);
 
+// Like the above, but taking the symbol as `len` bytes, with no need for
+// `mangled` to be NUL-terminated (e.g. for slices of a `.strtab`).
+bool rust_demangle_with_callback_n(
+    const char *mangled, size_t len, int flags,
+    void (*callback)(const char *data, size_t len, void *opaque), void *opaque
+);
+char *rust_demangle_n(const char *mangled, size_t len, int flags);
+
+// Additional configuration for `rust_demangle_with_options`, where `0` always
+// selects the default (i.e. a zero-initialized `struct` behaves the same as
+// the functions above, other than `flags`).
+struct rust_demangle_options {
+    // `RUST_DEMANGLE_FLAG_*` bits, as taken by the functions above.
+    int flags;
+
+    // Maximum nesting depth (of paths, types, constants and backrefs), past
+    // which demangling fails (or, if only reached by following backrefs, the
+    // backref demangles to `{recursion limit reached}` instead), matching
+    // `rustc-demangle`, if left as `RUST_DEMANGLE_DEFAULT_MAX_DEPTH`.
+    // Demangling recurses once per level, so this also bounds stack usage
+    // (to roughly 200 bytes per level on common 64-bit targets, i.e. ~100KiB
+    // by default), and can be lowered for threads with very small stacks.
+    size_t max_depth;
+
+    // Maximum length of the output (excluding any suffix, e.g. `.cold`), past
+    // which printing stops, and `{size limit reached}` is printed instead of
+    // the rest (see `RUST_DEMANGLE_TOO_BIG`), matching `rustc-demangle`, if
+    // left as `RUST_DEMANGLE_DEFAULT_MAX_OUTPUT`. Backrefs can make the output
+    // exponentially larger than the symbol, so this bounds the time taken by
+    // (and memory used for) demangling, for any input.
+    size_t max_output;
+
+    // Maximum nesting depth of generic args printed (e.g. `1` only prints the
+    // outermost ones, as in `Map<Filter<...>, F>`), past which each list of
+    // them (including `dyn Trait<...>` bindings) is collapsed, and maximum
+    // number of generic args printed in each list (e.g. `2` for `Foo<A, B,
+    // ...>`), or `0` (the default) for no limit. An ellipsis (U+2026, in
+    // UTF-8) is printed in place of whatever is left out, which is only
+    // parsed (without following any backrefs in it).
+    size_t max_generic_depth;
+    size_t max_generic_args;
+};
+#define RUST_DEMANGLE_DEFAULT_MAX_DEPTH 500
+#define RUST_DEMANGLE_DEFAULT_MAX_OUTPUT 1000000
+
+// Result of `rust_demangle_with_options` (where only failure is `0`, so that
+// it can also be used like the `bool` returned by the functions above).
+enum rust_demangle_status {
+    RUST_DEMANGLE_FAILED = 0,
+    RUST_DEMANGLE_OK,
+
+    // Demangling succeeded, but the output was cut short by `max_output`.
+    // The functions above don't distinguish this from `RUST_DEMANGLE_OK`.
+    RUST_DEMANGLE_TOO_BIG,
+};
+enum rust_demangle_status rust_demangle_with_options(
+    const char *mangled, size_t len,
+    const struct rust_demangle_options *options,
+    void (*callback)(const char *data, size_t len, void *opaque), void *opaque
+);
+
+// Structure of the output (see `rust_demangle_with_events`), as a tree of
+// paths, types, consts and generic args (each a `BEGIN_*` event, followed by
+// the events for everything nested in it, then the matching `END_*` event),
+// with crates, namespaces, lifetimes and binders as leaves (single events).
+enum rust_demangle_event_kind {
+    RUST_DEMANGLE_EVENT_BEGIN_PATH,
+    RUST_DEMANGLE_EVENT_END_PATH,
+    RUST_DEMANGLE_EVENT_BEGIN_TYPE,
+    RUST_DEMANGLE_EVENT_END_TYPE,
+    RUST_DEMANGLE_EVENT_BEGIN_CONST,
+    RUST_DEMANGLE_EVENT_END_CONST,
+    // The `<...>` of a path, or of a trait object's associated type bindings.
+    RUST_DEMANGLE_EVENT_BEGIN_GENERICS,
+    RUST_DEMANGLE_EVENT_END_GENERICS,
+
+    RUST_DEMANGLE_EVENT_CRATE,
+    RUST_DEMANGLE_EVENT_NAMESPACE,
+    RUST_DEMANGLE_EVENT_LIFETIME,
+    // Late-bound lifetimes (e.g. `for<'a, 'b>`) of `fn` pointers and `dyn`.
+    RUST_DEMANGLE_EVENT_BINDER,
+};
+struct rust_demangle_event {
+    enum rust_demangle_event_kind kind;
+
+    // The tag (i.e. first character) of the v0 mangling of paths, types and
+    // consts (see the RFC), e.g. `N` for nested paths (or `M`, `X` and `Y` for
+    // `impl`s), `R` for references, or `h` for `u8`, and `C` for crates, `L`
+    // for lifetimes, and `G` for binders. For namespaces, it's the namespace
+    // itself, e.g. `C` for closures (and lowercase if unspecified), and for
+    // generics, `I` (or `p` if there are only associated type bindings).
+    // Legacy symbols are a single path of a crate and namespaces, all with `0`.
+    char tag;
+
+    // Byte ranges (as `[start, end)`) in the mangled symbol, and in the output,
+    // taken by this event (only known up to `start` for `BEGIN_*` events, with
+    // `end` set to the same position). For crates and namespaces, the ranges
+    // are only those of the disambiguator and identifier (in the symbol) and
+    // of the identifier alone (in the output, which may be empty).
+    size_t mangled_start;
+    size_t mangled_end;
+    size_t output_start;
+    size_t output_end;
+
+    // Only for crates and namespaces (and `0` for legacy symbols).
+    uint64_t disambiguator;
+
+    // For lifetimes, the de Bruijn index (with `0` for the erased `'_`), and
+    // for binders, the number of lifetimes bound.
+    uint64_t lifetime;
+};
+
+// Like `rust_demangle_with_options`, but also calling `on_event` (with the
+// same `opaque`), as demangling goes, with events describing the structure
+// of the output, that tools can use instead of parsing the output again.
+// Either `callback` or `on_event` may be `NULL`, if not needed.
+// Backrefs (`B...` in v0 symbols) are followed, so their targets may be seen
+// multiple times (and `RUST_DEMANGLE_FLAG_MEMOIZE_BACKREFS` is ignored), while
+// the `impl` paths and instantiating crates (which aren't printed) are never
+// seen. If an error occurs while following a backref (which only affects its
+// output, e.g. `{invalid syntax}`), anything it began is ended by whatever
+// encloses it, so that every `BEGIN_*` event is always matched. Anything
+// begun while following a backref, but only ended after leaving it (due to
+// such errors, or for the `<...>` of a `dyn Trait<...>` path, which is kept
+// open for its associated type bindings), has the mangled range of its `END_*`
+// event start at the backref instead (unlike its `BEGIN_*` event). On failure,
+// like the output, any events already passed to `on_event` are incomplete,
+// and should be discarded.
+enum rust_demangle_status rust_demangle_with_events(
+    const char *mangled, size_t len,
+    const struct rust_demangle_options *options,
+    void (*callback)(const char *data, size_t len, void *opaque),
+    void (*on_event)(const struct rust_demangle_event *event, void *opaque),
+    void *opaque
+);
+
+// Demangle into the caller-provided `out` buffer (of `cap` bytes), without
+// allocating, always NUL-terminating it (unless `cap` is `0`), and truncating
+// the output if it doesn't fit. Like `snprintf`, `*needed` (if not `NULL`) is
+// set to the length of the whole output (excluding the NUL terminator), so
+// truncation happened if `*needed >= cap`.
+// On failure, `false` is returned, and the output (and `*needed`) is empty.
+bool rust_demangle_into(
+    const char *mangled, char *out, size_t cap, size_t *needed, int flags
+);
+bool rust_demangle_into_n(
+    const char *mangled, size_t len, char *out, size_t cap, size_t *needed,
+    int flags
+);
+
+// Mangling scheme of a Rust symbol (see `rust_demangle_classify`).
+enum rust_demangle_scheme {
+    RUST_DEMANGLE_SCHEME_NONE = 0,
+    RUST_DEMANGLE_SCHEME_LEGACY,
+    RUST_DEMANGLE_SCHEME_V0,
+};
+
+// Check whether the `len` bytes of `mangled` are a Rust symbol, and which
+// mangling scheme it uses, without producing any output (or allocating), e.g.
+// to decide which demangler (if any) should handle a symbol. The symbol is
+// still fully validated (backrefs aside, which are only followed to print
+// them), so `RUST_DEMANGLE_SCHEME_NONE` is returned exactly when demangling
+// it would fail (other than by running out of memory). Like with demangling,
+// that includes some C++ symbols which are also valid legacy Rust symbols
+// (e.g. `_ZN3foo3barEv`).
+enum rust_demangle_scheme
+rust_demangle_classify(const char *mangled, size_t len);
+
+// Compute a 64-bit fingerprint (FNV-1a) of the demangling of the `len` bytes
+// of `mangled`, as it's produced (i.e. without keeping it in memory), e.g. to
+// aggregate data about symbols by integer keys. `RUST_DEMANGLE_FLAG_VERBOSE` is
+// ignored, so none of the hashes which change between builds (i.e. crate
+// disambiguators, and the `h...` at the end of legacy symbols), or `.llvm.`
+// suffixes, are included, and the fingerprint of an item stays the same across
+// builds (as long as its path, and mangling scheme, do). Returns `false` (with
+// a fingerprint of `0`) if `mangled` can't be demangled.
+bool rust_demangle_fingerprint(
+    const char *mangled, size_t len, int flags, uint64_t *fingerprint
+);
+
+// Demangle `n` symbols at once, where `lens[i]` is the length of `syms[i]`
+// (or, if `lens` is `NULL`, all of `syms` are NUL-terminated), returning a
+// single allocation (to release with `free`, or `RUST_DEMANGLE_FREE`, if that
+// was overridden, see `rust-demangle.c`) with all of the output, or `NULL` if
+// allocating it failed. Each `offsets[i]` is set to the position, in the
+// returned allocation, of the NUL-terminated demangling of `syms[i]`, or to
+// `RUST_DEMANGLE_BATCH_FAILED` if it couldn't be demangled.
+#define RUST_DEMANGLE_BATCH_FAILED ((size_t)-1)
+char *rust_demangle_batch(
+    const char *const *syms, const size_t *lens, size_t n, int flags,
+    size_t *offsets
+);
+
+// Reusable state for demangling many symbols one at a time (e.g. in a
+// long-running symbolizer thread), which keeps all of the memory demangling
+// needs (i.e. the output, and scratch space) around between symbols, so that,
+// once it's grown large enough for the symbols seen, demangling doesn't
+// allocate at all. `reserve` is the output length to reserve space for
+// upfront, and `options` is copied. Returns `NULL` if allocation failed.
+// A context must not be used by multiple threads at the same time.
+struct rust_demangle_ctx;
+struct rust_demangle_ctx *rust_demangle_ctx_new(
+    const struct rust_demangle_options *options, size_t reserve
+);
+void rust_demangle_ctx_free(struct rust_demangle_ctx *ctx);
+
+// Demangle the `len` bytes of `mangled`, returning its NUL-terminated output
+// (with its length in `*out_len`, if not `NULL`), owned by `ctx`, and only
+// valid until it's used again (or reset, or freed), or `NULL` if `mangled`
+// can't be demangled (or allocation failed).
+const char *rust_demangle_ctx_demangle(
+    struct rust_demangle_ctx *ctx, const char *mangled, size_t len,
+    size_t *out_len
+);
+
+// Release any memory `ctx` has grown to hold (e.g. for an unusually large
+// symbol), going back to only the space reserved upfront, and reset its stats.
+void rust_demangle_ctx_reset(struct rust_demangle_ctx *ctx);
+
+struct rust_demangle_ctx_stats {
+    // Symbols demangled (or attempted) since the context was created (or
+    // reset), and how many of them had to allocate more memory.
+    size_t symbols;
+    size_t allocations;
+
+    // Length of the longest output so far, and the total size of the memory
+    // currently held by the context (i.e. its high-water mark, since reset).
+    size_t peak_output;
+    size_t reserved_bytes;
+};
+void rust_demangle_ctx_get_stats(
+    const struct rust_demangle_ctx *ctx, struct rust_demangle_ctx_stats *stats
+);
+
+// Demangle many symbols (e.g. all of those in a binary), keeping each one's
+// output in memory, like `rust_demangle_batch`, but with the output of their
+// leading paths (i.e. crate roots and modules, e.g. `core::iter::adapters`,
+// which most symbols in a binary share with many others) interned, keyed by
+// their mangled form, so that each is only demangled (and stored) once, and
+// each symbol only keeps the rest of its output, and the index of its prefix.
+// Returns `NULL` if allocating the batch failed.
+struct rust_demangle_prefix_batch;
+struct rust_demangle_prefix_batch *rust_demangle_prefix_batch_new(int flags);
+void rust_demangle_prefix_batch_free(struct rust_demangle_prefix_batch *batch);
+
+// Demangle the `len` bytes of `mangled`, and add it to the batch, returning
+// its index (i.e. the number of symbols added before it), or, if allocation
+// failed (after which the batch can only be freed), the value below.
+// Symbols which can't be demangled are still added (so that indices always
+// line up with the order of `rust_demangle_prefix_batch_add` calls).
+#define RUST_DEMANGLE_PREFIX_BATCH_FAILED ((size_t)-1)
+size_t rust_demangle_prefix_batch_add(
+    struct rust_demangle_prefix_batch *batch, const char *mangled, size_t len
+);
+
+// Render the whole output of the symbol at `index` (i.e. the same as
+// `rust_demangle` would produce), with the same semantics as
+// `rust_demangle_into`, returning `false` (with empty output) if `index` is
+// out of bounds, or the symbol had failed to demangle.
+bool rust_demangle_prefix_batch_render(
+    const struct rust_demangle_prefix_batch *batch, size_t index, char *out,
+    size_t cap, size_t *needed
+);
+
+struct rust_demangle_prefix_batch_stats {
+    size_t symbols;
+    size_t prefixes;
+
+    // Symbols whose prefix had already been interned (and wasn't demangled).
+    size_t hits;
+
+    // Total length of the output of all the (interned) prefixes, and of the
+    // rest of the output of all the symbols (i.e. what's kept in memory).
+    size_t prefix_bytes;
+    size_t suffix_bytes;
+};
+void rust_demangle_prefix_batch_get_stats(
+    const struct rust_demangle_prefix_batch *batch,
+    struct rust_demangle_prefix_batch_stats *stats
+);
+
+// Streaming text filter (like `c++filt`), which replaces every Rust symbol in
+// arbitrary text with its demangling, passing all other text through, to the
+// `callback` (as-is, i.e. with pointers into the data passed to `_write`).
+// Symbols may be split between chunks of text, and will still be demangled.
+struct rust_demangle_filter;
+// Returns `NULL` if allocating the filter failed.
+struct rust_demangle_filter *rust_demangle_filter_new(
+    int flags, void (*callback)(const char *data, size_t len, void *opaque),
+    void *opaque
+);
+void rust_demangle_filter_write(
+    struct rust_demangle_filter *filter, const char *data, size_t len
+);
+// Flush any remaining output, and release the filter.
+void rust_demangle_filter_finish(struct rust_demangle_filter *filter);
+
+#ifdef RUST_DEMANGLE_PTHREADS
+// Like `rust_demangle_batch`, but splitting the work between `num_threads`
+// threads (or, if `0`, as many as there are CPUs available). Only available
+// if both `rust-demangle.c` and users of this header are compiled with
+// `RUST_DEMANGLE_PTHREADS` defined.
+char *rust_demangle_batch_parallel(
+    const char *const *syms, const size_t *lens, size_t n, int flags,
+    size_t *offsets, size_t num_threads
+);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,30 @@
+// Allocation functions that `rust-demangle.c` is configured to use (through
+// `RUST_DEMANGLE_REALLOC`/`RUST_DEMANGLE_FREE`, see `build.rs`), counting
+// every allocation (including reallocations), for tests and benchmarks.
+
+#include "alloc-counter.h"
+
+#include <stdlib.h>
+
+static size_t alloc_count;
+
+void *rust_demangle_test_realloc(void *ptr, size_t size) {
+#ifdef __GNUC__
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+#else
+    alloc_count++;
+#endif
+    return realloc(ptr, size);
+}
+
+void rust_demangle_test_free(void *ptr) {
+    free(ptr);
+}
+
+size_t rust_demangle_test_alloc_count(void) {
+#ifdef __GNUC__
+    return __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+#else
+    return alloc_count;
+#endif
+}
@@ -0,0 +1,8 @@
+// Included (with `-include`, see `build.rs`) before `rust-demangle.c`, to
+// declare the functions `RUST_DEMANGLE_REALLOC`/`RUST_DEMANGLE_FREE` refer to.
+
+#include <stddef.h>
+
+void *rust_demangle_test_realloc(void *ptr, size_t size);
+void rust_demangle_test_free(void *ptr);
+size_t rust_demangle_test_alloc_count(void);
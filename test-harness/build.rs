@@ -4,8 +4,50 @@ fn main() {
     println!("cargo:rerun-if-changed={}", src);
     println!("cargo:rerun-if-changed={}", header);
 
-    cc::Build::new()
-        .file("../rust-demangle.c")
+    let mut build = cc::Build::new();
+    if std::env::var_os("CARGO_CFG_UNIX").is_some() {
+        build.define("RUST_DEMANGLE_PTHREADS", None);
+
+        let elf_src = "../rust-demangle-elf.c";
+        let elf_header = "../rust-demangle-elf.h";
+        println!("cargo:rerun-if-changed={}", elf_src);
+        println!("cargo:rerun-if-changed={}", elf_header);
+        build.file(elf_src);
+    }
+
+    // Count allocations made by `rust-demangle.c` (see `alloc-counter.c`).
+    let alloc_counter_src = "alloc-counter.c";
+    let alloc_counter_header =
+        std::path::Path::new(&std::env::var_os("CARGO_MANIFEST_DIR").unwrap())
+            .join("alloc-counter.h");
+    println!("cargo:rerun-if-changed={}", alloc_counter_src);
+    println!("cargo:rerun-if-changed={}", alloc_counter_header.display());
+    let force_include = if build.get_compiler().is_like_msvc() {
+        "/FI"
+    } else {
+        "-include"
+    };
+    build
+        .define("RUST_DEMANGLE_REALLOC", "rust_demangle_test_realloc")
+        .define("RUST_DEMANGLE_FREE", "rust_demangle_test_free")
+        .flag(force_include)
+        .flag(alloc_counter_header.to_str().unwrap())
+        .file(alloc_counter_src);
+
+    let cache_src = "../rust-demangle-cache.c";
+    let cache_header = "../rust-demangle-cache.h";
+    println!("cargo:rerun-if-changed={}", cache_src);
+    println!("cargo:rerun-if-changed={}", cache_header);
+    build.file(cache_src);
+
+    let tree_src = "../rust-demangle-tree.c";
+    let tree_header = "../rust-demangle-tree.h";
+    println!("cargo:rerun-if-changed={}", tree_src);
+    println!("cargo:rerun-if-changed={}", tree_header);
+    build.file(tree_src);
+
+    build
+        .file(src)
         .flag_if_supported("-std=c99")
         .flag_if_supported("-pedantic")
         .warnings(true)
@@ -0,0 +1,229 @@
+//! Benchmark of the C port (`rust_demangle` and `rust_demangle_with_callback`)
+//! against `rustc-demangle`, over synthetic (but reproducible) symbol corpora
+//! (see the `gen` module of the test harness).
+//!
+//! Usage: `cargo run -q --release --example bench [corpus name filter]`
+
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::env;
+use std::ffi::CString;
+use std::fmt::Write;
+use std::os::raw::{c_char, c_void};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::time::{Duration, Instant};
+
+use rust_demangle_c_test_harness::ffi::*;
+use rust_demangle_c_test_harness::gen::{symbols, Shape, Symbol};
+
+/// Counts Rust allocations (the C ones are counted by `alloc-counter.c`).
+struct CountingAlloc;
+
+static RUST_ALLOCS: AtomicUsize = AtomicUsize::new(0);
+
+unsafe impl GlobalAlloc for CountingAlloc {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        RUST_ALLOCS.fetch_add(1, Ordering::Relaxed);
+        System.alloc(layout)
+    }
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        RUST_ALLOCS.fetch_add(1, Ordering::Relaxed);
+        System.realloc(ptr, layout, new_size)
+    }
+}
+
+#[global_allocator]
+static GLOBAL: CountingAlloc = CountingAlloc;
+
+fn alloc_count() -> usize {
+    RUST_ALLOCS.load(Ordering::Relaxed) + unsafe { rust_demangle_test_alloc_count() }
+}
+
+struct Corpus {
+    name: &'static str,
+    syms: Vec<String>,
+}
+
+fn corpora() -> Vec<Corpus> {
+    const N: usize = 10_000;
+
+    // Baseline shape, with each corpus enabling only what it focuses on.
+    let plain = Shape {
+        generic_depth: 0,
+        backref_density: 0.0,
+        punycode_density: 0.0,
+        const_generic_density: 0.0,
+        closure_density: 0.0,
+        llvm_suffix_density: 0.0,
+        ..Shape::default()
+    };
+    let corpus = |name, seed, shape, mangling: fn(Symbol) -> String| Corpus {
+        name,
+        syms: symbols(seed, shape, N).map(mangling).collect(),
+    };
+    vec![
+        corpus("legacy", 1, plain, |s| s.legacy),
+        corpus("v0", 2, plain, |s| s.v0),
+        corpus(
+            "v0-generics",
+            3,
+            Shape {
+                generic_depth: 6,
+                generic_args: 3,
+                ..plain
+            },
+            |s| s.v0,
+        ),
+        corpus(
+            "v0-backrefs",
+            4,
+            Shape {
+                generic_depth: 4,
+                generic_args: 3,
+                backref_density: 0.5,
+                ..plain
+            },
+            |s| s.v0_compressed,
+        ),
+        corpus(
+            "punycode",
+            5,
+            Shape {
+                punycode_density: 0.7,
+                ..plain
+            },
+            |s| s.v0,
+        ),
+        corpus(
+            "const-generics",
+            6,
+            Shape {
+                generic_depth: 1,
+                generic_args: 3,
+                const_generic_density: 0.9,
+                ..plain
+            },
+            |s| s.v0,
+        ),
+    ]
+}
+
+/// Run `f` (over the whole corpus) repeatedly, returning the average time
+/// and number of allocations, per pass.
+fn measure(mut f: impl FnMut()) -> (Duration, f64) {
+    f();
+
+    let (mut passes, start, start_allocs) = (0u32, Instant::now(), alloc_count());
+    while passes < 3 || start.elapsed() < Duration::from_millis(200) {
+        f();
+        passes += 1;
+    }
+    let allocs = alloc_count() - start_allocs;
+    (start.elapsed() / passes, allocs as f64 / passes as f64)
+}
+
+fn main() {
+    let filter = env::args().nth(1);
+
+    println!(
+        "{:<15} {:<7} {:<28} {:>9} {:>9} {:>11}",
+        "corpus", "verbose", "implementation", "ns/sym", "MB/s", "allocs/sym"
+    );
+    for corpus in corpora() {
+        if filter
+            .as_ref()
+            .map_or(false, |f| !corpus.name.contains(f.as_str()))
+        {
+            continue;
+        }
+
+        let c_syms: Vec<CString> = corpus
+            .syms
+            .iter()
+            .map(|s| CString::new(&s[..]).unwrap())
+            .collect();
+        let total_bytes: usize = corpus.syms.iter().map(|s| s.len()).sum();
+
+        for verbose in [false, true] {
+            let flags = verbose as i32;
+
+            // Sanity check: every symbol in the corpus has to be valid.
+            for (sym, c_sym) in corpus.syms.iter().zip(&c_syms) {
+                let out = unsafe { rust_demangle(c_sym.as_ptr(), flags) };
+                assert!(!out.is_null(), "{} failed to demangle {}", corpus.name, sym);
+                unsafe { free(out) };
+            }
+
+            let report = |name: &str, (time, allocs): (Duration, f64)| {
+                let n = corpus.syms.len() as f64;
+                println!(
+                    "{:<15} {:<7} {:<28} {:>9.1} {:>9.1} {:>11.2}",
+                    corpus.name,
+                    verbose,
+                    name,
+                    time.as_nanos() as f64 / n,
+                    total_bytes as f64 / time.as_secs_f64() / 1e6,
+                    allocs / n,
+                );
+            };
+
+            report(
+                "rust_demangle",
+                measure(|| {
+                    for sym in &c_syms {
+                        unsafe { free(rust_demangle(sym.as_ptr(), flags)) };
+                    }
+                }),
+            );
+
+            unsafe extern "C" fn count_len(_data: *const c_char, len: usize, opaque: *mut c_void) {
+                *(opaque as *mut usize) += len;
+            }
+            let mut out_len = 0usize;
+            for (name, flags) in [
+                ("rust_demangle_with_callback", flags),
+                (
+                    "  + MEMOIZE_BACKREFS",
+                    flags | RUST_DEMANGLE_FLAG_MEMOIZE_BACKREFS,
+                ),
+            ] {
+                report(
+                    name,
+                    measure(|| {
+                        for sym in &c_syms {
+                            unsafe {
+                                rust_demangle_with_callback(
+                                    sym.as_ptr(),
+                                    flags,
+                                    count_len,
+                                    &mut out_len as *mut usize as *mut c_void,
+                                );
+                            }
+                        }
+                    }),
+                );
+            }
+
+            // NOTE: `rustc-demangle` hides the hash with `{:#}`, which
+            // is equivalent to non-verbose mode in the C port.
+            let mut out = String::new();
+            report(
+                "rustc_demangle",
+                measure(|| {
+                    for sym in &corpus.syms {
+                        out.clear();
+                        let demangled = rustc_demangle::demangle(sym);
+                        if verbose {
+                            write!(out, "{}", demangled).unwrap();
+                        } else {
+                            write!(out, "{:#}", demangled).unwrap();
+                        }
+                    }
+                }),
+            );
+            std::hint::black_box((out_len, &out));
+        }
+    }
+}
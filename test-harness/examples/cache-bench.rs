@@ -0,0 +1,96 @@
+//! Benchmark for the thread-safe (sharded) cache from `rust-demangle-cache.c`,
+//! with threads looking up overlapping sets of symbols, skewed towards some
+//! "hot" symbols (like the stack frames in profiler samples would be).
+//!
+//! Usage: `cargo run -q --release --example cache-bench [max threads]`
+
+#[cfg(unix)]
+fn main() {
+    use rust_demangle_c_test_harness::ffi::*;
+    use std::os::raw::c_char;
+    use std::time::Instant;
+
+    struct SharedCache(*mut RustDemangleSharedCache);
+    unsafe impl Sync for SharedCache {}
+
+    let max_threads: usize = std::env::args()
+        .nth(1)
+        .map_or(64, |s| s.parse().expect("expected number of threads"));
+
+    // A mix of `legacy` and `v0` symbols, of varying lengths.
+    let syms: Vec<String> = (0..100_000)
+        .map(|i| {
+            let ident = format!("function_{}_{}", i, "x".repeat(i % 50));
+            if i % 2 == 0 {
+                format!(
+                    "_ZN5crate6module{}{}17h05af221e174051e9E",
+                    ident.len(),
+                    ident
+                )
+            } else {
+                format!("_RNvNtCs1234_5crate6module{}{}", ident.len(), ident)
+            }
+        })
+        .collect();
+
+    let lookups_per_thread = 1_000_000;
+
+    println!("threads  Mlookups/s  hit rate");
+    let mut num_threads = 1;
+    while num_threads <= max_threads {
+        let cache = SharedCache(unsafe { rust_demangle_shared_cache_new(64 << 20, 0, 0) });
+        assert!(!cache.0.is_null());
+
+        let start = Instant::now();
+        std::thread::scope(|s| {
+            for t in 0..num_threads {
+                let (cache, syms) = (&cache, &syms);
+                s.spawn(move || {
+                    // xorshift64, seeded per thread.
+                    let mut state = 0x9e3779b97f4a7c15u64 ^ (t as u64 + 1);
+                    let mut buf = [0u8; 256];
+                    for _ in 0..lookups_per_thread {
+                        state ^= state << 13;
+                        state ^= state >> 7;
+                        state ^= state << 17;
+                        // Skewed towards low indices (i.e. "hot" symbols).
+                        let r = (state >> 11) as f64 / (1u64 << 53) as f64;
+                        let sym = &syms[(r * r * r * syms.len() as f64) as usize];
+                        unsafe {
+                            rust_demangle_shared_cache_lookup_into(
+                                cache.0,
+                                sym.as_ptr() as *const c_char,
+                                sym.len(),
+                                buf.as_mut_ptr() as *mut c_char,
+                                buf.len(),
+                                std::ptr::null_mut(),
+                            );
+                        }
+                    }
+                });
+            }
+        });
+        let elapsed = start.elapsed();
+
+        let mut stats = RustDemangleCacheStats::default();
+        unsafe {
+            rust_demangle_shared_cache_get_stats(cache.0, &mut stats);
+            rust_demangle_shared_cache_free(cache.0);
+        }
+
+        let total = (num_threads * lookups_per_thread) as f64;
+        println!(
+            "{:7}  {:10.2}  {:7.2}%",
+            num_threads,
+            total / elapsed.as_secs_f64() / 1e6,
+            stats.hits as f64 / total * 100.0
+        );
+
+        num_threads *= 2;
+    }
+}
+
+#[cfg(not(unix))]
+fn main() {
+    eprintln!("cache-bench: the shared cache requires pthreads");
+}
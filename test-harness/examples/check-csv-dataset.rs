@@ -1,29 +1,327 @@
+//! Check the C port against `rustc-demangle` on (potentially very large) CSV
+//! datasets of mangled symbols, e.g. real ones (see the README), or synthetic
+//! ones generated by the `gen-corpus` example.
+//!
+//! Usage: `cargo run -q --release --example check-csv-dataset -- \
+//!     [-j threads] [--diffs N] path/to/syms/*.csv`
+//!
+//! Each file is memory-mapped and split into chunks (at line boundaries),
+//! which worker threads then take turns checking, reusing their buffers.
+//! Instead of stopping at the first mismatch, all of them are counted, and
+//! the first `--diffs` (by default, 10) of them (in file order) are shown.
+//! Unreadable files, and lines which aren't valid UTF-8, are also reported
+//! (and make the check fail), without stopping it.
+
 use std::env;
 use std::fs::File;
-use std::io::prelude::*;
-use std::io::BufReader;
+use std::ops::Deref;
 use std::path::PathBuf;
+use std::process;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::thread;
+use std::time::Instant;
+
+use rust_demangle_c_test_harness::{compare, CompareBuffers, Mismatch};
+
+const HEADER: &str = "legacy+generics,legacy,mw,mw+compression,v0,v0+compression";
+
+/// Columns (of `HEADER`) holding Rust symbols, i.e. all but the MSVC ones.
+const RUST_COLUMNS: [usize; 4] = [0, 1, 4, 5];
+
+/// Chunks are split off at the first line boundary after this many bytes.
+const CHUNK_SIZE: usize = 1 << 20;
+
+/// Read-only view of a whole file, memory-mapped where possible.
+enum Contents {
+    #[cfg(unix)]
+    Mapped(*const u8, usize),
+    Read(Vec<u8>),
+}
+
+// SAFETY: the mapping is read-only, and only unmapped on drop.
+unsafe impl Sync for Contents {}
 
-use rust_demangle_c_test_harness::demangle;
+#[cfg(unix)]
+mod sys {
+    use std::os::raw::{c_int, c_void};
+
+    pub const PROT_READ: c_int = 1;
+    pub const MAP_PRIVATE: c_int = 2;
+
+    extern "C" {
+        // NOTE: `off_t` is assumed to be pointer-sized, but it doesn't
+        // matter much, as the offset is always `0` anyway.
+        pub fn mmap(
+            addr: *mut c_void,
+            len: usize,
+            prot: c_int,
+            flags: c_int,
+            fd: c_int,
+            offset: isize,
+        ) -> *mut c_void;
+        pub fn munmap(addr: *mut c_void, len: usize) -> c_int;
+    }
+}
+
+impl Contents {
+    fn open(path: &PathBuf) -> std::io::Result<Self> {
+        #[cfg(unix)]
+        {
+            use std::os::unix::io::AsRawFd;
+
+            let file = File::open(path)?;
+            let len = file.metadata()?.len() as usize;
+            if len > 0 {
+                let ptr = unsafe {
+                    sys::mmap(
+                        std::ptr::null_mut(),
+                        len,
+                        sys::PROT_READ,
+                        sys::MAP_PRIVATE,
+                        file.as_raw_fd(),
+                        0,
+                    )
+                };
+                // NOTE: `MAP_FAILED` is `(void *) -1`, and if mapping
+                // failed for any reason, the file is just read instead.
+                if ptr as usize != usize::MAX {
+                    return Ok(Contents::Mapped(ptr as *const u8, len));
+                }
+            }
+        }
+        std::fs::read(path).map(Contents::Read)
+    }
+}
+
+impl Deref for Contents {
+    type Target = [u8];
+    fn deref(&self) -> &[u8] {
+        match self {
+            #[cfg(unix)]
+            &Contents::Mapped(ptr, len) => unsafe { std::slice::from_raw_parts(ptr, len) },
+            Contents::Read(data) => data,
+        }
+    }
+}
+
+impl Drop for Contents {
+    fn drop(&mut self) {
+        #[cfg(unix)]
+        if let &mut Contents::Mapped(ptr, len) = self {
+            unsafe {
+                sys::munmap(ptr as *mut _, len);
+            }
+        }
+    }
+}
+
+/// Split `data` into chunks of (about) `CHUNK_SIZE` bytes, each ending right
+/// after a newline (or at the end of `data`).
+fn chunks(mut data: &[u8]) -> Vec<&[u8]> {
+    let mut chunks = vec![];
+    while !data.is_empty() {
+        let end = data
+            .get(CHUNK_SIZE..)
+            .and_then(|rest| rest.iter().position(|&b| b == b'\n'))
+            .map_or(data.len(), |i| CHUNK_SIZE + i + 1);
+        let (chunk, rest) = data.split_at(end);
+        chunks.push(chunk);
+        data = rest;
+    }
+    chunks
+}
+
+#[derive(Default)]
+struct Report {
+    symbols: usize,
+    mismatches: usize,
+    // The first few mismatches, each with the index of the chunk it's in.
+    diffs: Vec<(usize, Mismatch)>,
+    // Lines which couldn't be checked at all (i.e. not valid UTF-8), and the
+    // first few of them, each with its byte offset (in the file).
+    bad_lines: usize,
+    errors: Vec<(usize, String)>,
+}
+
+impl Report {
+    fn merge(&mut self, other: Report, max_diffs: usize) {
+        self.symbols += other.symbols;
+        self.mismatches += other.mismatches;
+        self.diffs.extend(other.diffs);
+        self.diffs.sort_by_key(|&(chunk, _)| chunk);
+        self.diffs.truncate(max_diffs);
+        self.bad_lines += other.bad_lines;
+        self.errors.extend(other.errors);
+        self.errors.sort_by_key(|&(offset, _)| offset);
+        self.errors.truncate(max_diffs);
+    }
+
+    fn failed(&self) -> bool {
+        self.mismatches > 0 || self.bad_lines > 0
+    }
+}
+
+/// Check the symbols in `chunk` (the `chunk_idx`-th one, starting at byte
+/// `offset` of its file).
+fn check_chunk(
+    chunk_idx: usize,
+    offset: usize,
+    chunk: &[u8],
+    bufs: &mut CompareBuffers,
+    max_diffs: usize,
+    report: &mut Report,
+) {
+    let mut line_start = offset;
+    for line in chunk.split_inclusive(|&b| b == b'\n') {
+        let line_offset = line_start;
+        line_start += line.len();
+
+        let line = match std::str::from_utf8(line) {
+            Ok(line) => line.trim_end_matches(['\n', '\r']),
+            Err(e) => {
+                report.bad_lines += 1;
+                if report.errors.len() < max_diffs {
+                    report
+                        .errors
+                        .push((line_offset, format!("invalid UTF-8: {}", e)));
+                }
+                continue;
+            }
+        };
+        for (column, mangling) in line.split(',').enumerate() {
+            if mangling.is_empty() || !RUST_COLUMNS.contains(&column) {
+                continue;
+            }
+            report.symbols += 1;
+            for verbose in [false, true] {
+                if let Err(mismatch) = compare(mangling, verbose, bufs) {
+                    report.mismatches += 1;
+                    if report.diffs.len() < max_diffs {
+                        report.diffs.push((chunk_idx, mismatch));
+                    }
+                }
+            }
+        }
+    }
+}
 
 // HACK(eddyb) this is only an `example` so that `cargo run` doesn't do anything.
-// FIXME(eddyb) document this better and provide datasets for it.
 fn main() {
-    let header = "legacy+generics,legacy,mw,mw+compression,v0,v0+compression";
+    let mut jobs = thread::available_parallelism().map_or(1, |n| n.get());
+    let mut max_diffs = 10;
+    let mut paths = vec![];
+
+    let mut args = env::args_os().skip(1);
+    while let Some(arg) = args.next() {
+        let mut value = |name: &str| -> usize {
+            args.next()
+                .and_then(|v| v.to_str()?.parse().ok())
+                .unwrap_or_else(|| panic!("expected a number after `{}`", name))
+        };
+        match arg.to_str() {
+            Some("-j") => jobs = value("-j").max(1),
+            Some("--diffs") => max_diffs = value("--diffs"),
+            _ => paths.push(PathBuf::from(arg)),
+        }
+    }
 
-    for path in env::args_os().skip(1).map(PathBuf::from) {
-        let mut lines = BufReader::new(File::open(path).unwrap())
-            .lines()
-            .map(|l| l.unwrap());
+    let start = Instant::now();
+    let (mut total, mut total_bytes, mut bad_files) = (Report::default(), 0, 0);
+    for path in paths {
+        let file_start = Instant::now();
+        let contents = match Contents::open(&path) {
+            Ok(contents) => contents,
+            Err(e) => {
+                eprintln!("{}: {}", path.display(), e);
+                bad_files += 1;
+                continue;
+            }
+        };
 
-        assert_eq!(lines.next().unwrap(), header);
+        let header_len = contents
+            .iter()
+            .position(|&b| b == b'\n')
+            .map_or(contents.len(), |i| i + 1);
+        let header = std::str::from_utf8(&contents[..header_len]).unwrap_or("");
+        if header.trim_end() != HEADER {
+            eprintln!(
+                "{}: unexpected header {:?} (expected {:?})",
+                path.display(),
+                header.trim_end(),
+                HEADER
+            );
+            bad_files += 1;
+            continue;
+        }
 
-        for line in lines {
-            for mangling in line.split(',').skip(4) {
-                for verbose in [false, true] {
-                    demangle(mangling).to_string_maybe_verbose(verbose);
-                }
+        let chunks = chunks(&contents[header_len..]);
+        let chunk_offsets: Vec<_> = chunks
+            .iter()
+            .scan(header_len, |offset, chunk| {
+                let start = *offset;
+                *offset += chunk.len();
+                Some(start)
+            })
+            .collect();
+        let next_chunk = AtomicUsize::new(0);
+        let mut report = Report::default();
+        thread::scope(|s| {
+            let workers: Vec<_> = (0..jobs)
+                .map(|_| {
+                    s.spawn(|| {
+                        let (mut bufs, mut report) = (CompareBuffers::default(), Report::default());
+                        loop {
+                            let i = next_chunk.fetch_add(1, Ordering::Relaxed);
+                            let Some(chunk) = chunks.get(i) else {
+                                break report;
+                            };
+                            let offset = chunk_offsets[i];
+                            check_chunk(i, offset, chunk, &mut bufs, max_diffs, &mut report);
+                        }
+                    })
+                })
+                .collect();
+            for worker in workers {
+                report.merge(worker.join().unwrap(), max_diffs);
             }
+        });
+
+        let elapsed = file_start.elapsed().as_secs_f64();
+        eprintln!(
+            "{}: {} symbols, {} mismatches ({:.0} symbols/s, {:.1} MB/s)",
+            path.display(),
+            report.symbols,
+            report.mismatches,
+            report.symbols as f64 / elapsed,
+            contents.len() as f64 / elapsed / 1e6,
+        );
+        for (_, mismatch) in &report.diffs {
+            eprintln!("{}", mismatch);
+        }
+        if report.bad_lines > 0 {
+            eprintln!("{}: {} bad lines", path.display(), report.bad_lines);
         }
+        for (offset, error) in &report.errors {
+            eprintln!("{}: byte {}: {}", path.display(), offset, error);
+        }
+
+        total_bytes += contents.len();
+        total.merge(report, 0);
+    }
+
+    let elapsed = start.elapsed().as_secs_f64();
+    eprintln!(
+        "total: {} symbols, {} mismatches ({:.0} symbols/s, {:.1} MB/s, {} threads)",
+        total.symbols,
+        total.mismatches,
+        total.symbols as f64 / elapsed,
+        total_bytes as f64 / elapsed / 1e6,
+        jobs,
+    );
+    if bad_files > 0 {
+        eprintln!("{} files couldn't be checked", bad_files);
+    }
+    if total.failed() || bad_files > 0 {
+        process::exit(1);
     }
 }
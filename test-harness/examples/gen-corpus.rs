@@ -0,0 +1,58 @@
+//! Generate a synthetic corpus of symbols (see the `gen` module of the test
+//! harness), in the CSV format `check-csv-dataset` reads, e.g.:
+//! `cargo run -q --release --example gen-corpus -- count=1000000 seed=1 \
+//!     generic_depth=4 punycode_density=0.2 > syms.csv`
+//!
+//! Every `Shape` field (see `gen.rs`) can be set this way, in addition to
+//! `count` (number of symbols) and `seed`.
+
+use std::env;
+use std::io::{self, BufWriter, Write};
+
+use rust_demangle_c_test_harness::gen::{symbols, Shape};
+
+fn main() {
+    let mut count = 100_000usize;
+    let mut seed = 0u64;
+    let mut shape = Shape::default();
+
+    for arg in env::args().skip(1) {
+        let (key, value) = arg
+            .split_once('=')
+            .unwrap_or_else(|| panic!("expected `key=value`, found `{}`", arg));
+        let int = || -> usize { value.parse().expect("expected an integer") };
+        let prob = || -> f64 { value.parse().expect("expected a probability") };
+        match key {
+            "count" => count = int(),
+            "seed" => seed = int() as u64,
+            "path_depth" => shape.path_depth = int(),
+            "generic_depth" => shape.generic_depth = int(),
+            "generic_args" => shape.generic_args = int(),
+            "backref_density" => shape.backref_density = prob(),
+            "punycode_density" => shape.punycode_density = prob(),
+            "const_generic_density" => shape.const_generic_density = prob(),
+            "closure_density" => shape.closure_density = prob(),
+            "llvm_suffix_density" => shape.llvm_suffix_density = prob(),
+            _ => panic!("unknown parameter `{}`", key),
+        }
+    }
+
+    let stdout = io::stdout();
+    let mut out = BufWriter::new(stdout.lock());
+
+    // NOTE: there's no generics in the generated `legacy` symbols, nor
+    // any MSVC-style ("mw") ones, so those columns are filled in/left empty.
+    writeln!(
+        out,
+        "legacy+generics,legacy,mw,mw+compression,v0,v0+compression"
+    )
+    .unwrap();
+    for sym in symbols(seed, shape, count) {
+        writeln!(
+            out,
+            "{},{},,,{},{}",
+            sym.legacy, sym.legacy, sym.v0, sym.v0_compressed
+        )
+        .unwrap();
+    }
+}
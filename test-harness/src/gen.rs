@@ -0,0 +1,637 @@
+//! Seeded generator of synthetic (but valid) Rust symbols, for load testing
+//! and benchmarks, with a controllable [`Shape`].
+//!
+//! Each symbol is generated as a tree (of paths, types and constants), which
+//! is then mangled with both the `legacy` and `v0` schemes, the latter both
+//! with and without backrefs (i.e. compression), from the same tree.
+
+use std::collections::HashMap;
+use std::fmt::Write;
+use std::rc::Rc;
+
+/// Parameters controlling what the generated symbols look like.
+#[derive(Copy, Clone, Debug)]
+pub struct Shape {
+    /// Maximum number of modules between the crate root and the item.
+    pub path_depth: usize,
+    /// Maximum nesting depth of generic arguments (`0` disables generics).
+    pub generic_depth: usize,
+    /// Maximum number of generic arguments in one list.
+    pub generic_args: usize,
+    /// Probability of reusing a crate root or type already used in the same
+    /// symbol (which `v0` compression turns into backrefs).
+    pub backref_density: f64,
+    /// Probability of an identifier being non-ASCII (`v0` punycode).
+    pub punycode_density: f64,
+    /// Probability of a generic argument being a `const` (not a type).
+    pub const_generic_density: f64,
+    /// Probability of a closure being appended to the path.
+    pub closure_density: f64,
+    /// Probability of a `.llvm.*` suffix being added to the symbol.
+    pub llvm_suffix_density: f64,
+}
+
+impl Default for Shape {
+    fn default() -> Self {
+        Shape {
+            path_depth: 3,
+            generic_depth: 2,
+            generic_args: 2,
+            backref_density: 0.3,
+            punycode_density: 0.05,
+            const_generic_density: 0.1,
+            closure_density: 0.1,
+            llvm_suffix_density: 0.02,
+        }
+    }
+}
+
+/// One symbol, mangled in several ways (which all demangle the same, other
+/// than `legacy` lacking generic arguments, and having a hash instead).
+#[derive(Clone, Debug)]
+pub struct Symbol {
+    pub legacy: String,
+    pub v0: String,
+    /// `v0`, with backrefs replacing any repeated paths/types/consts.
+    pub v0_compressed: String,
+}
+
+#[derive(Clone, PartialEq, Eq, Hash)]
+enum Path {
+    Crate {
+        disambiguator: u64,
+        name: String,
+    },
+    Nested {
+        ns: char,
+        parent: Rc<Path>,
+        disambiguator: u64,
+        ident: String,
+    },
+    Generic {
+        path: Rc<Path>,
+        args: Vec<GenericArg>,
+    },
+}
+
+#[derive(Clone, PartialEq, Eq, Hash)]
+enum Type {
+    Basic(char),
+    Ref { mutable: bool, ty: Rc<Type> },
+    Slice(Rc<Type>),
+    Tuple(Vec<Type>),
+    Path(Rc<Path>),
+}
+
+#[derive(Clone, PartialEq, Eq, Hash)]
+enum GenericArg {
+    Type(Type),
+    Const(Const),
+}
+
+#[derive(Clone, PartialEq, Eq, Hash)]
+enum Const {
+    Int {
+        ty: char,
+        negative: bool,
+        value: u64,
+    },
+    Bool(bool),
+    Char(char),
+}
+
+const WORDS: &[&str] = &[
+    "core",
+    "alloc",
+    "fmt",
+    "iter",
+    "vec",
+    "into_iter",
+    "map",
+    "fold",
+    "collect",
+    "insert",
+    "get",
+    "serde",
+    "de",
+    "visit_map",
+    "runtime",
+    "poll",
+    "drop_in_place",
+    "rustc_middle",
+    "ty",
+    "query",
+    "_private",
+];
+
+const TYPE_WORDS: &[&str] = &[
+    "Vec", "Box", "Option", "HashMap", "Future", "TyCtxt", "Arc", "Cell",
+];
+
+const UNICODE_WORDS: &[&str] = &[
+    "საჭმელად",
+    "გემრიელი",
+    "данные",
+    "обработка",
+    "処理",
+    "データ",
+    "café",
+    "naïve",
+    "γράμμα",
+    "ä",
+    "ferris_🦀_crab",
+];
+
+const CRATES: &[&str] = &["std", "core", "alloc", "serde", "tokio", "my_crate"];
+
+/// Deterministic (xorshift64*) RNG, so that generated symbols only depend on
+/// the seed (and `Shape`).
+struct Rng(u64);
+
+impl Rng {
+    fn next(&mut self) -> u64 {
+        self.0 ^= self.0 >> 12;
+        self.0 ^= self.0 << 25;
+        self.0 ^= self.0 >> 27;
+        self.0.wrapping_mul(0x2545f4914f6cdd1d)
+    }
+    fn below(&mut self, n: usize) -> usize {
+        (self.next() % n as u64) as usize
+    }
+    fn chance(&mut self, p: f64) -> bool {
+        ((self.next() >> 11) as f64 / (1u64 << 53) as f64) < p
+    }
+    fn pick<'a>(&mut self, xs: &[&'a str]) -> &'a str {
+        xs[self.below(xs.len())]
+    }
+}
+
+pub struct Generator {
+    rng: Rng,
+    shape: Shape,
+
+    // Per-symbol pools of what can be reused (see `Shape::backref_density`).
+    crates: Vec<Rc<Path>>,
+    types: Vec<Type>,
+}
+
+impl Generator {
+    pub fn new(seed: u64, shape: Shape) -> Self {
+        Generator {
+            // NOTE: xorshift can't have a zero state.
+            rng: Rng(
+                match (seed ^ 0x9e3779b97f4a7c15).wrapping_mul(0xbf58476d1ce4e5b9) {
+                    0 => 1,
+                    state => state,
+                },
+            ),
+            shape,
+            crates: vec![],
+            types: vec![],
+        }
+    }
+
+    pub fn next_symbol(&mut self) -> Symbol {
+        self.crates.clear();
+        self.types.clear();
+
+        let mut path = self.gen_crate();
+        for _ in 0..self.rng.below(self.shape.path_depth + 1) {
+            let ident = self.gen_ident(WORDS);
+            path = Rc::new(Path::Nested {
+                ns: 't',
+                parent: path,
+                disambiguator: 0,
+                ident,
+            });
+        }
+        let ident = self.gen_ident(WORDS);
+        path = Rc::new(Path::Nested {
+            ns: 'v',
+            parent: path,
+            disambiguator: 0,
+            ident,
+        });
+        if self.rng.chance(self.shape.closure_density) {
+            path = Rc::new(Path::Nested {
+                ns: 'C',
+                parent: path,
+                disambiguator: self.rng.below(3) as u64,
+                ident: String::new(),
+            });
+        }
+        let legacy_path = path.clone();
+        if self.shape.generic_depth > 0 && self.rng.chance(0.5) {
+            let args = self.gen_generic_args(self.shape.generic_depth - 1);
+            path = Rc::new(Path::Generic { path, args });
+        }
+
+        let mut legacy = String::from("_ZN");
+        encode_legacy_path(&mut legacy, &legacy_path);
+        write!(legacy, "17h{:016x}E", self.rng.next()).unwrap();
+
+        let mut v0 = V0Encoder::new(false);
+        v0.path(&path);
+        let mut v0_compressed = V0Encoder::new(true);
+        v0_compressed.path(&path);
+
+        let mut symbol = Symbol {
+            legacy,
+            v0: format!("_R{}", v0.out),
+            v0_compressed: format!("_R{}", v0_compressed.out),
+        };
+
+        if self.rng.chance(self.shape.llvm_suffix_density) {
+            let suffix = format!(".llvm.{:X}", self.rng.next());
+            symbol.legacy += &suffix;
+            symbol.v0 += &suffix;
+            symbol.v0_compressed += &suffix;
+        }
+
+        symbol
+    }
+
+    fn gen_ident(&mut self, words: &[&str]) -> String {
+        if self.rng.chance(self.shape.punycode_density) {
+            return self.rng.pick(UNICODE_WORDS).to_string();
+        }
+        let word = self.rng.pick(words);
+        match self.rng.below(4) {
+            0 => format!("{}{}", word, self.rng.below(100)),
+            _ => word.to_string(),
+        }
+    }
+
+    fn gen_crate(&mut self) -> Rc<Path> {
+        if !self.crates.is_empty() && self.rng.chance(self.shape.backref_density) {
+            return self.crates[self.rng.below(self.crates.len())].clone();
+        }
+        let krate = Rc::new(Path::Crate {
+            disambiguator: self.rng.next() >> 4,
+            name: self.rng.pick(CRATES).to_string(),
+        });
+        self.crates.push(krate.clone());
+        krate
+    }
+
+    fn gen_generic_args(&mut self, depth: usize) -> Vec<GenericArg> {
+        (0..1 + self.rng.below(self.shape.generic_args.max(1)))
+            .map(|_| {
+                if self.rng.chance(self.shape.const_generic_density) {
+                    GenericArg::Const(self.gen_const())
+                } else {
+                    GenericArg::Type(self.gen_type(depth))
+                }
+            })
+            .collect()
+    }
+
+    fn gen_type(&mut self, depth: usize) -> Type {
+        if !self.types.is_empty() && self.rng.chance(self.shape.backref_density) {
+            return self.types[self.rng.below(self.types.len())].clone();
+        }
+
+        let ty = match if depth == 0 { 0 } else { self.rng.below(6) } {
+            0 => Type::Basic(
+                self.rng
+                    .pick(&["l", "m", "j", "h", "b", "e", "u", "c"])
+                    .as_bytes()[0] as char,
+            ),
+            1 => Type::Ref {
+                mutable: self.rng.chance(0.3),
+                ty: Rc::new(self.gen_type(depth - 1)),
+            },
+            2 => Type::Slice(Rc::new(self.gen_type(depth - 1))),
+            3 => Type::Tuple(
+                (0..1 + self.rng.below(3))
+                    .map(|_| self.gen_type(depth - 1))
+                    .collect(),
+            ),
+            _ => {
+                let parent = self.gen_crate();
+                let ident = self.gen_ident(TYPE_WORDS);
+                let path = Rc::new(Path::Nested {
+                    ns: 't',
+                    parent,
+                    disambiguator: 0,
+                    ident,
+                });
+                let args = self.gen_generic_args(depth - 1);
+                Type::Path(Rc::new(Path::Generic { path, args }))
+            }
+        };
+        if !matches!(ty, Type::Basic(_)) {
+            self.types.push(ty.clone());
+        }
+        ty
+    }
+
+    fn gen_const(&mut self) -> Const {
+        match self.rng.below(4) {
+            0 => Const::Bool(self.rng.chance(0.5)),
+            1 => Const::Char(
+                self.rng
+                    .pick(&["a", "ä", "🦀", "\n"])
+                    .chars()
+                    .next()
+                    .unwrap(),
+            ),
+            2 => Const::Int {
+                ty: self.rng.pick(&["a", "s", "l", "x"]).as_bytes()[0] as char,
+                negative: self.rng.chance(0.5),
+                value: 1 + self.rng.below(100) as u64,
+            },
+            _ => Const::Int {
+                ty: self.rng.pick(&["h", "t", "m", "j", "y"]).as_bytes()[0] as char,
+                negative: false,
+                value: 1 + self.rng.below(1 << 16) as u64,
+            },
+        }
+    }
+}
+
+/// Iterator of `count` symbols, from `Generator::new(seed, shape)`.
+pub fn symbols(seed: u64, shape: Shape, count: usize) -> impl Iterator<Item = Symbol> {
+    let mut generator = Generator::new(seed, shape);
+    (0..count).map(move |_| generator.next_symbol())
+}
+
+fn encode_legacy_path(out: &mut String, path: &Path) {
+    let ident = match path {
+        Path::Crate { name, .. } => name.clone(),
+        Path::Nested {
+            ns: 'C', parent, ..
+        } => {
+            encode_legacy_path(out, parent);
+            "{{closure}}".to_string()
+        }
+        Path::Nested { parent, ident, .. } => {
+            encode_legacy_path(out, parent);
+            ident.clone()
+        }
+        Path::Generic { path, .. } => return encode_legacy_path(out, path),
+    };
+
+    // Like `rustc`, escape anything other than ASCII alphanumerics and `_`
+    // (e.g. the braces of `{{closure}}`, as `$u7b$` and `$u7d$`) by codepoint.
+    let mut escaped = String::new();
+    for c in ident.chars() {
+        if c.is_ascii_alphanumeric() || c == '_' {
+            escaped.push(c);
+        } else {
+            write!(escaped, "$u{:x}$", c as u32).unwrap();
+        }
+    }
+    if escaped.starts_with('$') {
+        escaped.insert(0, '_');
+    }
+    write!(out, "{}{}", escaped.len(), escaped).unwrap();
+}
+
+/// `v0` "base-62 number", with `_` for `0`, otherwise `x - 1` and `_`.
+fn push_integer_62(out: &mut String, x: u64) {
+    if x > 0 {
+        let mut digits = vec![];
+        let mut x = x - 1;
+        loop {
+            let d = (x % 62) as u8;
+            digits.push(match d {
+                0..=9 => b'0' + d,
+                10..=35 => b'a' + (d - 10),
+                _ => b'A' + (d - 36),
+            });
+            x /= 62;
+            if x == 0 {
+                break;
+            }
+        }
+        digits.reverse();
+        out.push_str(std::str::from_utf8(&digits).unwrap());
+    }
+    out.push('_');
+}
+
+struct V0Encoder {
+    out: String,
+    compress: bool,
+
+    // Positions (relative to after `_R`) of everything which can be
+    // referred to by backrefs.
+    paths: HashMap<Path, usize>,
+    types: HashMap<Type, usize>,
+    consts: HashMap<Const, usize>,
+}
+
+impl V0Encoder {
+    fn new(compress: bool) -> Self {
+        V0Encoder {
+            out: String::new(),
+            compress,
+            paths: HashMap::new(),
+            types: HashMap::new(),
+            consts: HashMap::new(),
+        }
+    }
+
+    /// Emit a backref (and return `true`) if `x` was already emitted,
+    /// otherwise record its position (and return `false`).
+    fn backref<T: Clone + Eq + std::hash::Hash>(
+        out: &mut String,
+        compress: bool,
+        positions: &mut HashMap<T, usize>,
+        x: &T,
+    ) -> bool {
+        if !compress {
+            return false;
+        }
+        if let Some(&pos) = positions.get(x) {
+            out.push('B');
+            push_integer_62(out, pos as u64);
+            return true;
+        }
+        positions.insert(x.clone(), out.len());
+        false
+    }
+
+    fn ident(&mut self, ident: &str) {
+        let (prefix, encoded) = if ident.is_ascii() {
+            ("", ident.to_string())
+        } else {
+            ("u", punycode_encode(ident).replace('-', "_"))
+        };
+        let sep = if encoded.starts_with(|c: char| c.is_ascii_digit() || c == '_') {
+            "_"
+        } else {
+            ""
+        };
+        write!(self.out, "{}{}{}{}", prefix, encoded.len(), sep, encoded).unwrap();
+    }
+
+    fn disambiguator(&mut self, disambiguator: u64) {
+        if disambiguator > 0 {
+            self.out.push('s');
+            push_integer_62(&mut self.out, disambiguator - 1);
+        }
+    }
+
+    fn path(&mut self, path: &Path) {
+        if Self::backref(&mut self.out, self.compress, &mut self.paths, path) {
+            return;
+        }
+        match path {
+            Path::Crate {
+                disambiguator,
+                name,
+            } => {
+                self.out.push('C');
+                self.disambiguator(*disambiguator);
+                self.ident(name);
+            }
+            Path::Nested {
+                ns,
+                parent,
+                disambiguator,
+                ident,
+            } => {
+                self.out.push('N');
+                self.out.push(*ns);
+                self.path(parent);
+                self.disambiguator(*disambiguator);
+                self.ident(ident);
+            }
+            Path::Generic { path, args } => {
+                self.out.push('I');
+                self.path(path);
+                for arg in args {
+                    match arg {
+                        GenericArg::Type(ty) => self.ty(ty),
+                        GenericArg::Const(ct) => {
+                            self.out.push('K');
+                            self.konst(ct);
+                        }
+                    }
+                }
+                self.out.push('E');
+            }
+        }
+    }
+
+    fn ty(&mut self, ty: &Type) {
+        if let Type::Basic(c) = ty {
+            self.out.push(*c);
+            return;
+        }
+        if Self::backref(&mut self.out, self.compress, &mut self.types, ty) {
+            return;
+        }
+        match ty {
+            Type::Basic(_) => unreachable!(),
+            Type::Ref { mutable, ty } => {
+                self.out.push(if *mutable { 'Q' } else { 'R' });
+                self.ty(ty);
+            }
+            Type::Slice(ty) => {
+                self.out.push('S');
+                self.ty(ty);
+            }
+            Type::Tuple(tys) => {
+                self.out.push('T');
+                for ty in tys {
+                    self.ty(ty);
+                }
+                self.out.push('E');
+            }
+            Type::Path(path) => self.path(path),
+        }
+    }
+
+    fn konst(&mut self, ct: &Const) {
+        if Self::backref(&mut self.out, self.compress, &mut self.consts, ct) {
+            return;
+        }
+        match *ct {
+            Const::Int {
+                ty,
+                negative,
+                value,
+            } => {
+                self.out.push(ty);
+                if negative {
+                    self.out.push('n');
+                }
+                write!(self.out, "{:x}_", value).unwrap();
+            }
+            Const::Bool(b) => write!(self.out, "b{}_", b as u8).unwrap(),
+            Const::Char(c) => write!(self.out, "c{:x}_", c as u32).unwrap(),
+        }
+    }
+}
+
+/// RFC 3492 Punycode encoding (without any of the IDNA parts).
+pub fn punycode_encode(input: &str) -> String {
+    const BASE: u32 = 36;
+    const T_MIN: u32 = 1;
+    const T_MAX: u32 = 26;
+    fn digit(d: u32) -> char {
+        (if d < 26 {
+            b'a' + d as u8
+        } else {
+            b'0' + (d - 26) as u8
+        }) as char
+    }
+    fn adapt(mut delta: u32, num_points: u32, first_time: bool) -> u32 {
+        delta /= if first_time { 700 } else { 2 };
+        delta += delta / num_points;
+        let mut k = 0;
+        while delta > ((BASE - T_MIN) * T_MAX) / 2 {
+            delta /= BASE - T_MIN;
+            k += BASE;
+        }
+        k + (BASE - T_MIN + 1) * delta / (delta + 38)
+    }
+
+    let chars: Vec<u32> = input.chars().map(|c| c as u32).collect();
+    let mut out: String = input.chars().filter(|c| c.is_ascii()).collect();
+    let basic_len = out.len() as u32;
+    if basic_len > 0 {
+        out.push('-');
+    }
+
+    let (mut n, mut delta, mut bias, mut h) = (0x80u32, 0u32, 72u32, basic_len);
+    while (h as usize) < chars.len() {
+        let m = chars.iter().copied().filter(|&c| c >= n).min().unwrap();
+        delta += (m - n) * (h + 1);
+        n = m;
+        for &c in &chars {
+            if c < n {
+                delta += 1;
+            }
+            if c == n {
+                let mut q = delta;
+                let mut k = BASE;
+                loop {
+                    let t = if k <= bias {
+                        T_MIN
+                    } else if k >= bias + T_MAX {
+                        T_MAX
+                    } else {
+                        k - bias
+                    };
+                    if q < t {
+                        break;
+                    }
+                    out.push(digit(t + (q - t) % (BASE - t)));
+                    q = (q - t) / (BASE - t);
+                    k += BASE;
+                }
+                out.push(digit(q));
+                bias = adapt(delta, h + 1, h == basic_len);
+                delta = 0;
+                h += 1;
+            }
+        }
+        delta += 1;
+        n += 1;
+    }
+    out
+}
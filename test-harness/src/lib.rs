@@ -1,5 +1,7 @@
 use std::fmt;
 
+pub mod gen;
+
 // HACK(eddyb) helper macros for tests.
 #[macro_export]
 macro_rules! assert_contains {
@@ -26,6 +28,389 @@ macro_rules! assert_ends_with {
     }};
 }
 
+/// Declarations for the `rust-demangle.h` C API (and `free`, to release
+/// the C strings returned by `rust_demangle`).
+pub mod ffi {
+    use std::os::raw::{c_char, c_void};
+
+    pub const RUST_DEMANGLE_FLAG_VERBOSE: i32 = 1;
+    pub const RUST_DEMANGLE_FLAG_MEMOIZE_BACKREFS: i32 = 2;
+    pub const RUST_DEMANGLE_FLAG_CRATE_ONLY: i32 = 4;
+    pub const RUST_DEMANGLE_FLAG_LEAF_ONLY: i32 = 8;
+    pub const RUST_DEMANGLE_FLAG_NO_GENERICS: i32 = 16;
+
+    pub const RUST_DEMANGLE_BATCH_FAILED: usize = usize::MAX;
+    pub const RUST_DEMANGLE_PREFIX_BATCH_FAILED: usize = usize::MAX;
+
+    extern "C" {
+        pub fn rust_demangle_with_callback(
+            mangled: *const c_char,
+            flags: i32,
+            callback: unsafe extern "C" fn(data: *const c_char, len: usize, opaque: *mut c_void),
+            opaque: *mut c_void,
+        ) -> bool;
+        pub fn rust_demangle(mangled: *const c_char, flags: i32) -> *mut c_char;
+        pub fn rust_demangle_n(mangled: *const c_char, len: usize, flags: i32) -> *mut c_char;
+        pub fn rust_demangle_with_options(
+            mangled: *const c_char,
+            len: usize,
+            options: *const RustDemangleOptions,
+            callback: unsafe extern "C" fn(data: *const c_char, len: usize, opaque: *mut c_void),
+            opaque: *mut c_void,
+        ) -> RustDemangleStatus;
+        pub fn rust_demangle_with_events(
+            mangled: *const c_char,
+            len: usize,
+            options: *const RustDemangleOptions,
+            callback: Option<
+                unsafe extern "C" fn(data: *const c_char, len: usize, opaque: *mut c_void),
+            >,
+            on_event: Option<
+                unsafe extern "C" fn(event: *const RustDemangleEvent, opaque: *mut c_void),
+            >,
+            opaque: *mut c_void,
+        ) -> RustDemangleStatus;
+        pub fn rust_demangle_into(
+            mangled: *const c_char,
+            out: *mut c_char,
+            cap: usize,
+            needed: *mut usize,
+            flags: i32,
+        ) -> bool;
+        pub fn rust_demangle_into_n(
+            mangled: *const c_char,
+            len: usize,
+            out: *mut c_char,
+            cap: usize,
+            needed: *mut usize,
+            flags: i32,
+        ) -> bool;
+        pub fn rust_demangle_fingerprint(
+            mangled: *const c_char,
+            len: usize,
+            flags: i32,
+            fingerprint: *mut u64,
+        ) -> bool;
+        pub fn rust_demangle_classify(mangled: *const c_char, len: usize) -> RustDemangleScheme;
+        pub fn rust_demangle_batch(
+            syms: *const *const c_char,
+            lens: *const usize,
+            n: usize,
+            flags: i32,
+            offsets: *mut usize,
+        ) -> *mut c_char;
+        #[cfg(unix)]
+        pub fn rust_demangle_batch_parallel(
+            syms: *const *const c_char,
+            lens: *const usize,
+            n: usize,
+            flags: i32,
+            offsets: *mut usize,
+            num_threads: usize,
+        ) -> *mut c_char;
+        pub fn rust_demangle_ctx_new(
+            options: *const RustDemangleOptions,
+            reserve: usize,
+        ) -> *mut RustDemangleCtx;
+        pub fn rust_demangle_ctx_free(ctx: *mut RustDemangleCtx);
+        pub fn rust_demangle_ctx_demangle(
+            ctx: *mut RustDemangleCtx,
+            mangled: *const c_char,
+            len: usize,
+            out_len: *mut usize,
+        ) -> *const c_char;
+        pub fn rust_demangle_ctx_reset(ctx: *mut RustDemangleCtx);
+        pub fn rust_demangle_ctx_get_stats(
+            ctx: *const RustDemangleCtx,
+            stats: *mut RustDemangleCtxStats,
+        );
+        pub fn rust_demangle_prefix_batch_new(flags: i32) -> *mut RustDemanglePrefixBatch;
+        pub fn rust_demangle_prefix_batch_free(batch: *mut RustDemanglePrefixBatch);
+        pub fn rust_demangle_prefix_batch_add(
+            batch: *mut RustDemanglePrefixBatch,
+            mangled: *const c_char,
+            len: usize,
+        ) -> usize;
+        pub fn rust_demangle_prefix_batch_render(
+            batch: *const RustDemanglePrefixBatch,
+            index: usize,
+            out: *mut c_char,
+            cap: usize,
+            needed: *mut usize,
+        ) -> bool;
+        pub fn rust_demangle_prefix_batch_get_stats(
+            batch: *const RustDemanglePrefixBatch,
+            stats: *mut RustDemanglePrefixBatchStats,
+        );
+        pub fn rust_demangle_filter_new(
+            flags: i32,
+            callback: unsafe extern "C" fn(data: *const c_char, len: usize, opaque: *mut c_void),
+            opaque: *mut c_void,
+        ) -> *mut RustDemangleFilter;
+        pub fn rust_demangle_filter_write(
+            filter: *mut RustDemangleFilter,
+            data: *const c_char,
+            len: usize,
+        );
+        pub fn rust_demangle_filter_finish(filter: *mut RustDemangleFilter);
+        pub fn free(ptr: *mut c_char);
+
+        /// Number of allocations (including reallocations) made so far by
+        /// `rust-demangle.c` (counted by `alloc-counter.c`).
+        pub fn rust_demangle_test_alloc_count() -> usize;
+    }
+
+    extern "C" {
+        pub fn rust_demangle_cache_new(max_bytes: usize, flags: i32) -> *mut RustDemangleCache;
+        pub fn rust_demangle_cache_free(cache: *mut RustDemangleCache);
+        pub fn rust_demangle_cache_lookup(
+            cache: *mut RustDemangleCache,
+            mangled: *const c_char,
+            len: usize,
+            demangled_len: *mut usize,
+        ) -> *const c_char;
+        pub fn rust_demangle_cache_get_stats(
+            cache: *const RustDemangleCache,
+            stats: *mut RustDemangleCacheStats,
+        );
+    }
+
+    extern "C" {
+        pub fn rust_demangle_tree_new(flags: i32) -> *mut RustDemangleTree;
+        pub fn rust_demangle_tree_free(tree: *mut RustDemangleTree);
+        pub fn rust_demangle_tree_add(
+            tree: *mut RustDemangleTree,
+            mangled: *const c_char,
+            len: usize,
+        ) -> usize;
+        pub fn rust_demangle_tree_render(
+            tree: *const RustDemangleTree,
+            index: usize,
+            out: *mut c_char,
+            cap: usize,
+            needed: *mut usize,
+        ) -> bool;
+        pub fn rust_demangle_tree_encode(
+            tree: *const RustDemangleTree,
+            len: *mut usize,
+        ) -> *mut c_char;
+        pub fn rust_demangle_tree_decode(data: *const c_char, len: usize) -> *mut RustDemangleTree;
+        pub fn rust_demangle_tree_get_stats(
+            tree: *const RustDemangleTree,
+            stats: *mut RustDemangleTreeStats,
+        );
+    }
+
+    #[cfg(unix)]
+    extern "C" {
+        pub fn rust_demangle_shared_cache_new(
+            max_bytes: usize,
+            num_shards: usize,
+            flags: i32,
+        ) -> *mut RustDemangleSharedCache;
+        pub fn rust_demangle_shared_cache_free(shared: *mut RustDemangleSharedCache);
+        pub fn rust_demangle_shared_cache_lookup_into(
+            shared: *mut RustDemangleSharedCache,
+            mangled: *const c_char,
+            len: usize,
+            out: *mut c_char,
+            cap: usize,
+            needed: *mut usize,
+        ) -> bool;
+        pub fn rust_demangle_shared_cache_get_stats(
+            shared: *mut RustDemangleSharedCache,
+            stats: *mut RustDemangleCacheStats,
+        );
+    }
+
+    pub const RUST_DEMANGLE_DEFAULT_MAX_DEPTH: usize = 500;
+    pub const RUST_DEMANGLE_DEFAULT_MAX_OUTPUT: usize = 1_000_000;
+
+    /// `struct rust_demangle_options`.
+    #[repr(C)]
+    #[derive(Copy, Clone, Default)]
+    pub struct RustDemangleOptions {
+        pub flags: i32,
+        pub max_depth: usize,
+        pub max_output: usize,
+        pub max_generic_depth: usize,
+        pub max_generic_args: usize,
+    }
+
+    /// `enum rust_demangle_status`.
+    #[repr(C)]
+    #[derive(Copy, Clone, Debug, PartialEq, Eq)]
+    pub enum RustDemangleStatus {
+        Failed = 0,
+        Ok,
+        TooBig,
+    }
+
+    /// `enum rust_demangle_scheme`.
+    #[repr(C)]
+    #[derive(Copy, Clone, Debug, PartialEq, Eq)]
+    pub enum RustDemangleScheme {
+        None = 0,
+        Legacy,
+        V0,
+    }
+
+    /// `enum rust_demangle_event_kind`.
+    #[repr(C)]
+    #[derive(Copy, Clone, Debug, PartialEq, Eq)]
+    pub enum RustDemangleEventKind {
+        BeginPath,
+        EndPath,
+        BeginType,
+        EndType,
+        BeginConst,
+        EndConst,
+        BeginGenerics,
+        EndGenerics,
+        Crate,
+        Namespace,
+        Lifetime,
+        Binder,
+    }
+
+    /// `struct rust_demangle_event`.
+    #[repr(C)]
+    #[derive(Copy, Clone, Debug)]
+    pub struct RustDemangleEvent {
+        pub kind: RustDemangleEventKind,
+        pub tag: c_char,
+        pub mangled_start: usize,
+        pub mangled_end: usize,
+        pub output_start: usize,
+        pub output_end: usize,
+        pub disambiguator: u64,
+        pub lifetime: u64,
+    }
+
+    /// Opaque `struct rust_demangle_shared_cache`.
+    #[cfg(unix)]
+    #[repr(C)]
+    pub struct RustDemangleSharedCache {
+        _private: [u8; 0],
+    }
+
+    /// Opaque `struct rust_demangle_cache`.
+    #[repr(C)]
+    pub struct RustDemangleCache {
+        _private: [u8; 0],
+    }
+
+    /// `struct rust_demangle_cache_stats`.
+    #[repr(C)]
+    #[derive(Copy, Clone, Default, Debug)]
+    pub struct RustDemangleCacheStats {
+        pub hits: usize,
+        pub misses: usize,
+        pub evictions: usize,
+        pub entries: usize,
+        pub bytes: usize,
+    }
+
+    pub const RUST_DEMANGLE_TREE_FAILED: usize = usize::MAX;
+
+    /// Opaque `struct rust_demangle_tree`.
+    #[repr(C)]
+    pub struct RustDemangleTree {
+        _private: [u8; 0],
+    }
+
+    /// `struct rust_demangle_tree_stats`.
+    #[repr(C)]
+    #[derive(Copy, Clone, Default, Debug)]
+    pub struct RustDemangleTreeStats {
+        pub symbols: usize,
+        pub nodes: usize,
+        pub node_bytes: usize,
+        pub text_bytes: usize,
+    }
+
+    #[cfg(unix)]
+    extern "C" {
+        pub fn rust_demangle_elf_symbols(
+            path: *const c_char,
+            flags: i32,
+            callback: unsafe extern "C" fn(
+                addr: u64,
+                name: *const c_char,
+                len: usize,
+                opaque: *mut c_void,
+            ),
+            opaque: *mut c_void,
+        ) -> bool;
+        pub fn rust_demangle_elf_symbols_mem(
+            data: *const c_void,
+            size: usize,
+            flags: i32,
+            callback: unsafe extern "C" fn(
+                addr: u64,
+                name: *const c_char,
+                len: usize,
+                opaque: *mut c_void,
+            ),
+            opaque: *mut c_void,
+        ) -> bool;
+        pub fn rust_demangle_elf_table_new(
+            path: *const c_char,
+            flags: i32,
+        ) -> *mut RustDemangleElfTable;
+        pub fn rust_demangle_elf_table_free(table: *mut RustDemangleElfTable);
+    }
+
+    /// `struct rust_demangle_elf_table`.
+    #[cfg(unix)]
+    #[repr(C)]
+    pub struct RustDemangleElfTable {
+        pub len: usize,
+        pub addrs: *mut u64,
+        pub offsets: *mut usize,
+        pub names: *mut c_char,
+    }
+
+    /// Opaque `struct rust_demangle_ctx`.
+    #[repr(C)]
+    pub struct RustDemangleCtx {
+        _private: [u8; 0],
+    }
+
+    /// `struct rust_demangle_ctx_stats`.
+    #[repr(C)]
+    #[derive(Copy, Clone, Default, Debug)]
+    pub struct RustDemangleCtxStats {
+        pub symbols: usize,
+        pub allocations: usize,
+        pub peak_output: usize,
+        pub reserved_bytes: usize,
+    }
+
+    /// Opaque `struct rust_demangle_prefix_batch`.
+    #[repr(C)]
+    pub struct RustDemanglePrefixBatch {
+        _private: [u8; 0],
+    }
+
+    /// `struct rust_demangle_prefix_batch_stats`.
+    #[repr(C)]
+    #[derive(Copy, Clone, Default, Debug)]
+    pub struct RustDemanglePrefixBatchStats {
+        pub symbols: usize,
+        pub prefixes: usize,
+        pub hits: usize,
+        pub prefix_bytes: usize,
+        pub suffix_bytes: usize,
+    }
+
+    /// Opaque `struct rust_demangle_filter`.
+    #[repr(C)]
+    pub struct RustDemangleFilter {
+        _private: [u8; 0],
+    }
+}
+
 /// `rustc_demangle::Demangle` wrapper that will also attempt demanging with
 /// `rust-demangle.c`'s `rust_demangle` when formatted, and assert equality.
 ///
@@ -107,16 +492,101 @@ impl Demangle<'_> {
         let c = demangle_via_c(self.original, verbose).unwrap_or_else(|_| self.original.to_owned());
         if rust != c && !equal_modulo_unicode_escapes(&rust, &c) {
             panic!(
-                "Rust vs C demangling difference:\
+                "{}",
+                Mismatch {
+                    mangled: self.original.to_owned(),
+                    verbose,
+                    rust,
+                    c,
+                }
+            );
+        }
+
+        rust
+    }
+}
+
+/// Difference between the Rust and C demangling of a symbol.
+#[derive(Debug)]
+pub struct Mismatch {
+    pub mangled: String,
+    pub verbose: bool,
+    pub rust: String,
+    pub c: String,
+}
+
+impl fmt::Display for Mismatch {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(
+            f,
+            "Rust vs C demangling difference{verbose}:\
             \n mangled: {mangled:?}\
             \n    rust: {rust:?}\
             \n       c: {c:?}\
             \n",
-                mangled = self.original
-            );
+            verbose = if self.verbose { " (verbose)" } else { "" },
+            mangled = self.mangled,
+            rust = self.rust,
+            c = self.c,
+        )
+    }
+}
+
+/// Buffers reused by `compare` across calls, to avoid allocating per symbol.
+#[derive(Default)]
+pub struct CompareBuffers {
+    rust: String,
+    c: Vec<u8>,
+}
+
+/// Lighter (and non-panicking) counterpart to `to_string_maybe_verbose`, for
+/// checking large numbers of symbols: only `rust_demangle_into_n` is used on
+/// the C side, writing into `bufs` (which only grow, as needed).
+pub fn compare(mangled: &str, verbose: bool, bufs: &mut CompareBuffers) -> Result<(), Mismatch> {
+    use fmt::Write;
+    use std::os::raw::c_char;
+
+    let rust = &mut bufs.rust;
+    rust.clear();
+    if verbose {
+        write!(rust, "{}", rustc_demangle::demangle(mangled)).unwrap();
+    } else {
+        write!(rust, "{:#}", rustc_demangle::demangle(mangled)).unwrap();
+    }
+
+    let c = &mut bufs.c;
+    let c = loop {
+        if c.len() < 64 {
+            c.resize(64, 0);
         }
+        let mut needed = 0;
+        let success = unsafe {
+            ffi::rust_demangle_into_n(
+                mangled.as_ptr() as *const c_char,
+                mangled.len(),
+                c.as_mut_ptr() as *mut c_char,
+                c.len(),
+                &mut needed,
+                verbose as i32,
+            )
+        };
+        if !success {
+            break mangled.as_bytes();
+        }
+        if needed < c.len() {
+            break &c[..needed];
+        }
+        c.resize(needed + 1, 0);
+    };
 
-        rust
+    match std::str::from_utf8(c) {
+        Ok(c) if rust == c || equal_modulo_unicode_escapes(rust, c) => Ok(()),
+        _ => Err(Mismatch {
+            mangled: mangled.to_owned(),
+            verbose,
+            rust: rust.clone(),
+            c: String::from_utf8_lossy(c).into_owned(),
+        }),
     }
 }
 
@@ -124,24 +594,79 @@ fn demangle_via_c(mangled: &str, verbose: bool) -> Result<String, ()> {
     use std::ffi::{CStr, CString};
     use std::os::raw::c_char;
 
-    extern "C" {
-        fn rust_demangle(mangled: *const c_char, flags: i32) -> *mut c_char;
-        fn free(ptr: *mut c_char);
+    use ffi::*;
+
+    unsafe fn take_c_string(out: *mut c_char) -> Result<String, ()> {
+        if out.is_null() {
+            Err(())
+        } else {
+            let s = CStr::from_ptr(out).to_string_lossy().into_owned();
+            free(out);
+            Ok(s)
+        }
     }
 
     let flags = if verbose { 1 } else { 0 };
+
+    // NOTE: `rust_demangle_n` is given the original bytes, without
+    // any NUL terminator, so it can't accidentally rely on one.
+    let out_n = unsafe {
+        take_c_string(rust_demangle_n(
+            mangled.as_ptr() as *const c_char,
+            mangled.len(),
+            flags,
+        ))
+    };
+
+    // Memoizing backrefs must not change the output in any way.
+    let out_memoized = unsafe {
+        take_c_string(rust_demangle_n(
+            mangled.as_ptr() as *const c_char,
+            mangled.len(),
+            flags | RUST_DEMANGLE_FLAG_MEMOIZE_BACKREFS,
+        ))
+    };
+    assert_eq!(
+        out_memoized, out_n,
+        "memoized vs non-memoized backrefs difference for {:?}",
+        mangled
+    );
+
+    // Also check `rust_demangle_into_n`, both with enough space for the
+    // whole output, and with only a few bytes (to force truncation).
+    for cap in [out_n.as_ref().map_or(0, |s| s.len() + 1), 8] {
+        let mut buf = vec![0xffu8; cap];
+        let mut needed = usize::MAX;
+        let success = unsafe {
+            rust_demangle_into_n(
+                mangled.as_ptr() as *const c_char,
+                mangled.len(),
+                buf.as_mut_ptr() as *mut c_char,
+                cap,
+                &mut needed,
+                flags,
+            )
+        };
+        assert_eq!(success, out_n.is_ok());
+        let expected = out_n.as_deref().unwrap_or("").as_bytes();
+        assert_eq!(needed, expected.len());
+        if cap > 0 {
+            let written = expected.len().min(cap - 1);
+            assert_eq!(&buf[..written], &expected[..written]);
+            assert_eq!(buf[written], 0);
+        }
+    }
+
     let Ok(mangled) = CString::new(mangled) else {
         // C can't handle strings containing nul bytes
+        assert!(out_n.is_err());
         return Err(());
     };
-    let out = unsafe { rust_demangle(mangled.as_ptr(), flags) };
-    if out.is_null() {
-        Err(())
-    } else {
-        unsafe {
-            let s = CStr::from_ptr(out).to_string_lossy().into_owned();
-            free(out);
-            Ok(s)
-        }
-    }
+    let out = unsafe { take_c_string(rust_demangle(mangled.as_ptr(), flags)) };
+    assert_eq!(
+        out, out_n,
+        "`rust_demangle` vs `rust_demangle_n` difference for {:?}",
+        mangled
+    );
+    out
 }
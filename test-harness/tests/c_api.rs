@@ -0,0 +1,1382 @@
+//! Tests for APIs specific to the C port (i.e. not copied from `rustc-demangle`).
+
+use rust_demangle_c_test_harness::ffi::*;
+use rust_demangle_c_test_harness::gen::{symbols, Shape};
+use std::ffi::CStr;
+use std::os::raw::{c_char, c_void};
+
+fn demangle_into(mangled: &CStr, cap: usize) -> (bool, Vec<u8>, usize) {
+    let mut buf = vec![0xffu8; cap];
+    let mut needed = usize::MAX;
+    let success = unsafe {
+        rust_demangle_into(
+            mangled.as_ptr(),
+            buf.as_mut_ptr() as *mut c_char,
+            cap,
+            &mut needed,
+            0,
+        )
+    };
+    (success, buf, needed)
+}
+
+#[test]
+fn into_fits() {
+    let (success, buf, needed) = demangle_into(c"_RNvNtCsbmNqQUJIY6D_4core3foo3bar", 64);
+    assert!(success);
+    assert_eq!(needed, "core::foo::bar".len());
+    assert_eq!(&buf[..needed + 1], b"core::foo::bar\0");
+}
+
+#[test]
+fn into_exact_fit() {
+    let (success, buf, needed) = demangle_into(c"_ZN3foo3barE", 9);
+    assert!(success);
+    assert_eq!(needed, 8);
+    assert_eq!(&buf[..], b"foo::bar\0");
+}
+
+#[test]
+fn into_truncated() {
+    let (success, buf, needed) = demangle_into(c"_ZN3foo3barE", 8);
+    assert!(success);
+    assert_eq!(needed, 8);
+    assert_eq!(&buf[..], b"foo::ba\0");
+
+    let (success, buf, needed) = demangle_into(c"_ZN3foo3barE", 1);
+    assert!(success);
+    assert_eq!(needed, 8);
+    assert_eq!(&buf[..], b"\0");
+
+    let (success, buf, needed) = demangle_into(c"_ZN3foo3barE", 0);
+    assert!(success);
+    assert_eq!(needed, 8);
+    assert!(buf.is_empty());
+}
+
+#[test]
+fn into_invalid() {
+    let (success, buf, needed) = demangle_into(c"_ZN3foo3bar", 16);
+    assert!(!success);
+    assert_eq!(needed, 0);
+    assert_eq!(buf[0], 0);
+}
+
+#[test]
+fn into_null_needed() {
+    let mut buf = [0xffu8; 4];
+    let success = unsafe {
+        rust_demangle_into(
+            c"_ZN3foo3barE".as_ptr(),
+            buf.as_mut_ptr() as *mut c_char,
+            buf.len(),
+            std::ptr::null_mut(),
+            0,
+        )
+    };
+    assert!(success);
+    assert_eq!(&buf, b"foo\0");
+}
+
+#[test]
+fn empty_legacy_ident() {
+    // Empty components (whose identifiers have no characters to point to)
+    // are printed as-is, including last ones (checked for being a hash).
+    let (success, buf, needed) = demangle_into(c"_ZN3foo0E", 16);
+    assert!(success);
+    assert_eq!(&buf[..needed + 1], b"foo::\0");
+    let (success, buf, needed) = demangle_into(c"_ZN3foo03barE", 16);
+    assert!(success);
+    assert_eq!(&buf[..needed + 1], b"foo::::bar\0");
+}
+
+#[test]
+fn integer_overflow() {
+    // Base-62 numbers (here, a crate disambiguator) and identifier lengths
+    // which don't fit are invalid, instead of wrapping around.
+    for sym in [
+        c"_RNvCs7fffffffffffffff_1a1b",
+        c"_RNvCsZZZZZZZZZZZ_1a1b",
+        c"_RNvC18446744073709551617a1b",
+        c"_RNvC18446744073709551616_1a",
+    ] {
+        let (success, _, needed) = demangle_into(sym, 16);
+        assert!(!success, "{:?}", sym);
+        assert_eq!(needed, 0);
+    }
+    let (success, buf, needed) = demangle_into(c"_RNvCsZZZZZZZZZZ_1a1b", 16);
+    assert!(success);
+    assert_eq!(&buf[..needed + 1], b"a::b\0");
+}
+
+#[test]
+fn const_str_utf8() {
+    let (success, buf, needed) = demangle_into(c"_RIC0KRef09f9880_E", 32);
+    assert!(success);
+    assert_eq!(&buf[..needed + 1], b"::<\"\\u{1f600}\">\0");
+
+    // Anything `str::from_utf8` would reject is invalid, i.e. truncated
+    // sequences (even when followed by the `_` terminator and more of the
+    // symbol), overlong encodings and surrogates.
+    for sym in [
+        c"_RIC0KRee2_E",
+        c"_RIC0KRee282_E",
+        c"_RIC0KRec080_E",
+        c"_RIC0KRee08080_E",
+        c"_RIC0KReeda080_E",
+    ] {
+        let (success, _, needed) = demangle_into(sym, 32);
+        assert!(!success, "{:?}", sym);
+        assert_eq!(needed, 0);
+    }
+}
+
+#[test]
+fn const_char_max() {
+    // U+10FFFF is the last valid `char` (and only U+110000 onwards isn't).
+    let (success, buf, needed) = demangle_into(c"_RIC0Kc10ffff_E", 32);
+    assert!(success);
+    assert_eq!(&buf[..needed + 1], b"::<'\\u{10ffff}'>\0");
+    let (success, buf, needed) = demangle_into(c"_RIC0KRef48fbfbf_E", 32);
+    assert!(success);
+    assert_eq!(&buf[..needed + 1], b"::<\"\\u{10ffff}\">\0");
+    let (success, _, _) = demangle_into(c"_RIC0Kc110000_E", 32);
+    assert!(!success);
+}
+
+#[test]
+fn callback_output_is_coalesced() {
+    unsafe extern "C" fn callback(data: *const c_char, len: usize, opaque: *mut c_void) {
+        let chunks = &mut *(opaque as *mut Vec<Vec<u8>>);
+        chunks.push(std::slice::from_raw_parts(data as *const u8, len).to_vec());
+    }
+
+    let mut chunks: Vec<Vec<u8>> = vec![];
+    let success = unsafe {
+        rust_demangle_with_callback(
+            c"_RINbNbCskIICzLVDPPb_5alloc5alloc8box_freeDINbNiB4_5boxed5FnBoxuEp6OutputuEL_ECs1iopQbuBiw2_3std".as_ptr(),
+            0,
+            callback,
+            &mut chunks as *mut _ as *mut c_void,
+        )
+    };
+    assert!(success);
+    assert_eq!(
+        chunks,
+        [b"alloc::alloc::box_free::<dyn alloc::boxed::FnBox<(), Output = ()>>".to_vec()]
+    );
+
+    // Output larger than any internal buffer still has to come out right.
+    let mut long_sym = String::from("_ZN");
+    let mut expected = vec![];
+    for i in 0..100 {
+        let ident = format!("segment{:03}", i);
+        long_sym += &format!("{}{}", ident.len(), ident);
+        if i > 0 {
+            expected.extend_from_slice(b"::");
+        }
+        expected.extend_from_slice(ident.as_bytes());
+    }
+    long_sym += "E";
+    let long_sym = std::ffi::CString::new(long_sym).unwrap();
+
+    chunks.clear();
+    let success = unsafe {
+        rust_demangle_with_callback(
+            long_sym.as_ptr(),
+            0,
+            callback,
+            &mut chunks as *mut _ as *mut c_void,
+        )
+    };
+    assert!(success);
+    assert!(chunks.len() > 1 && chunks.len() < 10);
+    assert_eq!(chunks.concat(), expected);
+}
+
+#[test]
+fn failed_output_is_discarded() {
+    // The suffix is only rejected after printing the rest, by which point
+    // more than a buffer's worth of output has been passed to the callback.
+    let sym = format!("_ZN{}3fooE@@", "5hello".repeat(80));
+    let c_sym = std::ffi::CString::new(sym.clone()).unwrap();
+
+    unsafe extern "C" fn callback(data: *const c_char, len: usize, opaque: *mut c_void) {
+        let out = &mut *(opaque as *mut Vec<u8>);
+        out.extend_from_slice(std::slice::from_raw_parts(data as *const u8, len));
+    }
+    let mut out: Vec<u8> = vec![];
+    let success = unsafe {
+        rust_demangle_with_callback(
+            c_sym.as_ptr(),
+            0,
+            callback,
+            &mut out as *mut _ as *mut c_void,
+        )
+    };
+    assert!(!success);
+    assert!(out.len() > 256);
+
+    // So anything printing either the output or the original symbol (like
+    // `rust-demangle-filt`) has to get the whole output first.
+    assert!(unsafe { rust_demangle(c_sym.as_ptr(), 0) }.is_null());
+    let (success, buf, needed) = demangle_into(&c_sym, 1024);
+    assert!(!success);
+    assert_eq!(needed, 0);
+    assert_eq!(buf[0], 0);
+
+    let unterminated = &sym[..sym.len() - "E@@".len()];
+    assert_eq!(
+        filter_chunks([unterminated.as_bytes(), b" x"], 0),
+        format!("{} x", unterminated).into_bytes()
+    );
+}
+
+#[test]
+fn batch() {
+    let syms = [
+        "_RNvNtCsbmNqQUJIY6D_4core3foo3bar",
+        "not a symbol",
+        "_ZN3foo17h05af221e174051e9E",
+        "_RNqCs4fqI2P2rA04_11utf8_identsu30____7hkackfecea1cbdathfdh9hlq6y",
+        "_ZN3foo3bar",
+        "_RNvC3foo3bar.llvm.1234",
+    ];
+    let expected = [
+        Some("core::foo::bar"),
+        None,
+        Some("foo"),
+        Some("utf8_idents::საჭმელად_გემრიელი_სადილი"),
+        None,
+        Some("foo::bar"),
+    ];
+
+    // Symbols are passed as (non-NUL-terminated) slices of one string.
+    let all: String = syms.concat();
+    let mut ptrs = vec![];
+    let mut lens = vec![];
+    let mut pos = 0;
+    for sym in syms {
+        ptrs.push(all[pos..].as_ptr() as *const c_char);
+        lens.push(sym.len());
+        pos += sym.len();
+    }
+
+    let mut offsets = vec![0; syms.len()];
+    let out = unsafe {
+        rust_demangle_batch(
+            ptrs.as_ptr(),
+            lens.as_ptr(),
+            syms.len(),
+            0,
+            offsets.as_mut_ptr(),
+        )
+    };
+    assert!(!out.is_null());
+    for (&offset, expected) in offsets.iter().zip(expected) {
+        match expected {
+            Some(expected) => {
+                let s = unsafe { CStr::from_ptr(out.add(offset)) };
+                assert_eq!(s.to_str().unwrap(), expected);
+            }
+            None => assert_eq!(offset, RUST_DEMANGLE_BATCH_FAILED),
+        }
+    }
+    unsafe { free(out) };
+
+    // Empty batches still succeed.
+    let out =
+        unsafe { rust_demangle_batch(ptrs.as_ptr(), std::ptr::null(), 0, 0, offsets.as_mut_ptr()) };
+    assert!(!out.is_null());
+    unsafe { free(out) };
+}
+
+#[cfg(unix)]
+#[test]
+fn batch_parallel() {
+    // Enough symbols for many chunks, with some invalid ones sprinkled in.
+    let syms: Vec<std::ffi::CString> = (0..10_000)
+        .map(|i| {
+            let sym = match i % 4 {
+                0 => format!("_ZN3foo{}bar{}E", 3 + i.to_string().len(), i),
+                1 => format!("_RNvCs{}_5crate{}f{}", i, 1 + i.to_string().len(), i),
+                2 => format!("invalid{}", i),
+                _ => format!("_RINvC3foo3barTmmEE.llvm.{}", i),
+            };
+            std::ffi::CString::new(sym).unwrap()
+        })
+        .collect();
+    let ptrs: Vec<_> = syms.iter().map(|s| s.as_ptr()).collect();
+
+    let mut offsets = vec![0; syms.len()];
+    let out = unsafe {
+        rust_demangle_batch(
+            ptrs.as_ptr(),
+            std::ptr::null(),
+            ptrs.len(),
+            1,
+            offsets.as_mut_ptr(),
+        )
+    };
+    assert!(!out.is_null());
+    let failed = offsets
+        .iter()
+        .filter(|&&o| o == RUST_DEMANGLE_BATCH_FAILED)
+        .count();
+    assert_eq!(failed, syms.len() / 4);
+
+    for num_threads in [0, 1, 2, 3, 8, 64] {
+        let mut parallel_offsets = vec![0; syms.len()];
+        let parallel_out = unsafe {
+            rust_demangle_batch_parallel(
+                ptrs.as_ptr(),
+                std::ptr::null(),
+                ptrs.len(),
+                1,
+                parallel_offsets.as_mut_ptr(),
+                num_threads,
+            )
+        };
+        assert!(!parallel_out.is_null());
+
+        // The output should be identical, including the order in the arena.
+        assert_eq!(offsets, parallel_offsets);
+        let total_len = offsets
+            .iter()
+            .rev()
+            .find(|&&o| o != RUST_DEMANGLE_BATCH_FAILED)
+            .map(|&o| {
+                o + unsafe { CStr::from_ptr(out.add(o)) }
+                    .to_bytes_with_nul()
+                    .len()
+            })
+            .unwrap();
+        unsafe {
+            assert_eq!(
+                std::slice::from_raw_parts(out, total_len),
+                std::slice::from_raw_parts(parallel_out, total_len)
+            );
+            free(parallel_out);
+        }
+    }
+    unsafe { free(out) };
+}
+
+fn prefix_batch_render(batch: *const RustDemanglePrefixBatch, index: usize) -> Option<String> {
+    let mut needed = usize::MAX;
+    let success = unsafe {
+        rust_demangle_prefix_batch_render(batch, index, std::ptr::null_mut(), 0, &mut needed)
+    };
+    if !success {
+        assert_eq!(needed, 0);
+        return None;
+    }
+    let mut buf = vec![0xffu8; needed + 1];
+    let mut needed2 = usize::MAX;
+    assert!(unsafe {
+        rust_demangle_prefix_batch_render(
+            batch,
+            index,
+            buf.as_mut_ptr() as *mut c_char,
+            buf.len(),
+            &mut needed2,
+        )
+    });
+    assert_eq!(needed, needed2);
+    Some(
+        CStr::from_bytes_with_nul(&buf)
+            .unwrap()
+            .to_str()
+            .unwrap()
+            .to_string(),
+    )
+}
+
+#[test]
+fn prefix_batch() {
+    let mut syms: Vec<String> = [
+        "_RNvNtCsbmNqQUJIY6D_4core3foo3bar",
+        "_RNvNtCsbmNqQUJIY6D_4core3foo3baz",
+        "_RINvNtCsbmNqQUJIY6D_4core3foo3bazNtB4_3QuxE",
+        "_RNvNtCsbmNqQUJIY6D_4core3foo3baz.llvm.1234",
+        "_RNvNtCs1234_4core3foo3bar",
+        "_RNvMNtCsbmNqQUJIY6D_4core3fooNtB2_3Foo3new",
+        "_RNvNtCsbmNqQUJIY6D_4core3fo",
+        "not a symbol",
+        "_ZN4core3foo3bar17h05af221e174051e9E",
+        "_ZN4core3foo3baz17h05af221e174051e9E",
+        "_ZN4core3foo17h05af221e174051e9E",
+        "_ZN4core3foo3$LT$u8$GT$E",
+        "_ZN4core3foo3bar",
+    ]
+    .iter()
+    .map(|s| s.to_string())
+    .collect();
+    for sym in symbols(3, Shape::default(), 300) {
+        syms.extend([sym.legacy, sym.v0, sym.v0_compressed]);
+    }
+
+    for flags in [
+        0,
+        RUST_DEMANGLE_FLAG_VERBOSE,
+        RUST_DEMANGLE_FLAG_MEMOIZE_BACKREFS,
+    ] {
+        let batch = unsafe { rust_demangle_prefix_batch_new(flags) };
+        assert!(!batch.is_null());
+
+        // Adding everything twice, the second time only hits the same prefixes.
+        for round in 0..2 {
+            for (i, sym) in syms.iter().enumerate() {
+                let index = unsafe {
+                    rust_demangle_prefix_batch_add(batch, sym.as_ptr() as *const c_char, sym.len())
+                };
+                assert_eq!(index, round * syms.len() + i);
+            }
+        }
+        for (i, sym) in syms.iter().chain(&syms).enumerate() {
+            let expected = unsafe {
+                let out = rust_demangle_n(sym.as_ptr() as *const c_char, sym.len(), flags);
+                (!out.is_null()).then(|| {
+                    let s = CStr::from_ptr(out).to_str().unwrap().to_string();
+                    free(out);
+                    s
+                })
+            };
+            assert_eq!(prefix_batch_render(batch, i), expected, "{}", sym);
+        }
+        assert_eq!(prefix_batch_render(batch, 2 * syms.len()), None);
+
+        let mut stats = RustDemanglePrefixBatchStats::default();
+        unsafe { rust_demangle_prefix_batch_get_stats(batch, &mut stats) };
+        assert_eq!(stats.symbols, 2 * syms.len());
+        assert!(stats.hits >= syms.len() / 2, "{:?}", stats);
+
+        // Truncated output still reports the whole length.
+        let expected = prefix_batch_render(batch, 0).unwrap();
+        let mut buf = [0xffu8; 8];
+        let mut needed = 0;
+        assert!(unsafe {
+            rust_demangle_prefix_batch_render(
+                batch,
+                0,
+                buf.as_mut_ptr() as *mut c_char,
+                buf.len(),
+                &mut needed,
+            )
+        });
+        assert_eq!(needed, expected.len());
+        assert_eq!(&buf[..7], &expected.as_bytes()[..7]);
+        assert_eq!(buf[7], 0);
+
+        unsafe { rust_demangle_prefix_batch_free(batch) };
+    }
+
+    // `core::foo` is only demangled once for the first 4 symbols (and again for
+    // the 5th, whose crate has another disambiguator), and not at all for the
+    // `impl` (whose path starts with the `impl` itself, not `core`).
+    let batch = unsafe { rust_demangle_prefix_batch_new(0) };
+    for sym in &syms[..6] {
+        unsafe { rust_demangle_prefix_batch_add(batch, sym.as_ptr() as *const c_char, sym.len()) };
+    }
+    let mut stats = RustDemanglePrefixBatchStats::default();
+    unsafe { rust_demangle_prefix_batch_get_stats(batch, &mut stats) };
+    assert_eq!((stats.symbols, stats.prefixes, stats.hits), (6, 2, 3));
+    assert_eq!(stats.prefix_bytes, 2 * "core::foo".len());
+    unsafe { rust_demangle_prefix_batch_free(batch) };
+}
+
+fn filter_chunks<'a>(chunks: impl IntoIterator<Item = &'a [u8]>, flags: i32) -> Vec<u8> {
+    unsafe extern "C" fn callback(data: *const c_char, len: usize, opaque: *mut c_void) {
+        let out = &mut *(opaque as *mut Vec<u8>);
+        out.extend_from_slice(std::slice::from_raw_parts(data as *const u8, len));
+    }
+
+    let mut out = vec![];
+    unsafe {
+        let filter = rust_demangle_filter_new(flags, callback, &mut out as *mut _ as *mut c_void);
+        assert!(!filter.is_null());
+        for chunk in chunks {
+            rust_demangle_filter_write(filter, chunk.as_ptr() as *const c_char, chunk.len());
+        }
+        rust_demangle_filter_finish(filter);
+    }
+    out
+}
+
+#[test]
+fn filter() {
+    let input = "\
+        at _RNvNtCsbmNqQUJIY6D_4core3foo3bar+0x10\n\
+        _ZN3foo17h05af221e174051e9E (_ZN3foo3bar, x_ZN3foo3barE, _ZN3foo3barE)\n\
+        __ZN3foo3barE: _RNvC3foo3bar.llvm.1234 _R _Z __ _ \n\
+        _RINbNbCskIICzLVDPPb_5alloc5alloc8box_freeDINbNiB4_5boxed5FnBoxuEp6OutputuEL_ECs1iopQbuBiw2_3std\n\
+        _ZN3foo3barE";
+    let expected = "\
+        at core::foo::bar+0x10\n\
+        foo (_ZN3foo3bar, x_ZN3foo3barE, foo::bar)\n\
+        foo::bar: foo::bar _R _Z __ _ \n\
+        alloc::alloc::box_free::<dyn alloc::boxed::FnBox<(), Output = ()>>\n\
+        foo::bar";
+    let input = input.as_bytes();
+
+    let out = filter_chunks([input], 0);
+    assert_eq!(std::str::from_utf8(&out).unwrap(), expected);
+
+    // Splitting the input into chunks anywhere must not change the output.
+    for chunk_size in 1..input.len() {
+        let out = filter_chunks(input.chunks(chunk_size), 0);
+        assert_eq!(
+            std::str::from_utf8(&out).unwrap(),
+            expected,
+            "chunk_size={}",
+            chunk_size
+        );
+    }
+    for split in 0..=input.len() {
+        let out = filter_chunks([&input[..split], &[][..], &input[split..]], 0);
+        assert_eq!(
+            std::str::from_utf8(&out).unwrap(),
+            expected,
+            "split={}",
+            split
+        );
+    }
+
+    assert_eq!(
+        filter_chunks([&b"_ZN3foo17h05af221e174051e9E"[..]], 1),
+        b"foo::h05af221e174051e9"
+    );
+    assert_eq!(filter_chunks([], 0), b"");
+}
+
+fn demangle_with_options(
+    mangled: &str,
+    options: RustDemangleOptions,
+) -> (RustDemangleStatus, String) {
+    unsafe extern "C" fn callback(data: *const c_char, len: usize, opaque: *mut c_void) {
+        let out = &mut *(opaque as *mut Vec<u8>);
+        out.extend_from_slice(std::slice::from_raw_parts(data as *const u8, len));
+    }
+
+    let mut out = vec![];
+    let status = unsafe {
+        rust_demangle_with_options(
+            mangled.as_ptr() as *const c_char,
+            mangled.len(),
+            &options,
+            callback,
+            &mut out as *mut _ as *mut c_void,
+        )
+    };
+    (status, String::from_utf8(out).unwrap())
+}
+
+fn demangle_with_max_depth(mangled: &str, max_depth: usize) -> Option<String> {
+    let options = RustDemangleOptions {
+        max_depth,
+        ..Default::default()
+    };
+    match demangle_with_options(mangled, options) {
+        (RustDemangleStatus::Failed, _) => None,
+        (_, out) => Some(out),
+    }
+}
+
+#[test]
+fn max_depth() {
+    let sym = "_RINvC1a1fRRRRRRRRRRaE";
+    let expected = "a::f::<&&&&&&&&&&i8>";
+    assert_eq!(demangle_with_max_depth(sym, 0).as_deref(), Some(expected));
+    assert_eq!(demangle_with_max_depth(sym, 11).as_deref(), Some(expected));
+    assert_eq!(demangle_with_max_depth(sym, 10), None);
+    assert_eq!(demangle_with_max_depth(sym, 1), None);
+
+    // Only the backref (to `RRRa`, nested in another `RR`) goes too deep.
+    let sym = "_RINvC1a1fRRRRaRRB9_E";
+    assert_eq!(
+        demangle_with_max_depth(sym, 0).as_deref(),
+        Some("a::f::<&&&&i8, &&&&i8>")
+    );
+    assert_eq!(
+        demangle_with_max_depth(sym, 6).as_deref(),
+        Some("a::f::<&&&&i8, &&&{recursion limit reached}>")
+    );
+    assert_eq!(demangle_with_max_depth(sym, 4), None);
+
+    // Deep nesting without backrefs must not overflow the stack.
+    let mut sym = String::from("_RINvC1a1f");
+    for _ in 0..100_000 {
+        sym.push('R');
+    }
+    sym.push_str("aE");
+    assert_eq!(demangle_with_max_depth(&sym, 0), None);
+}
+
+#[test]
+fn backrefs_must_point_backwards() {
+    // Backrefs to themselves, or past themselves, are invalid.
+    assert_eq!(demangle_with_max_depth("_RINvC1a1faB8_E", 0), None);
+    assert_eq!(demangle_with_max_depth("_RINvC1a1fB9_aaE", 0), None);
+    assert_eq!(
+        demangle_with_max_depth("_RINvC1a1faB7_E", 0).as_deref(),
+        Some("a::f::<i8, i8>")
+    );
+}
+
+#[test]
+fn max_output() {
+    let with_max_output = |mangled, max_output| {
+        let options = RustDemangleOptions {
+            max_output,
+            ..Default::default()
+        };
+        let (status, out) = demangle_with_options(mangled, options);
+        (
+            status,
+            if status == RustDemangleStatus::Failed {
+                None
+            } else {
+                Some(out)
+            },
+        )
+    };
+
+    let sym = "_RNvC1a1bC1c.cold";
+    assert_eq!(
+        with_max_output(sym, 0),
+        (RustDemangleStatus::Ok, Some("a::b.cold".to_string()))
+    );
+    assert_eq!(
+        with_max_output(sym, 4),
+        (RustDemangleStatus::Ok, Some("a::b.cold".to_string()))
+    );
+    // The suffix is still printed (and never counts towards the limit).
+    assert_eq!(
+        with_max_output(sym, 3),
+        (
+            RustDemangleStatus::TooBig,
+            Some("a::{size limit reached}.cold".to_string())
+        )
+    );
+
+    // The rest of the symbol is still validated after hitting the limit.
+    assert_eq!(
+        with_max_output("_RINvC1a1bRRaE", 1),
+        (
+            RustDemangleStatus::TooBig,
+            Some("a{size limit reached}".to_string())
+        )
+    );
+    assert_eq!(
+        with_max_output("_RINvC1a1bRR?E", 1),
+        (RustDemangleStatus::Failed, None)
+    );
+
+    // Backrefs can't blow up the output past the (default) limit.
+    let (status, out) = with_max_output("_RMC0FGZZZ_Eu", 0);
+    assert_eq!(status, RustDemangleStatus::TooBig);
+    let out = out.unwrap();
+    assert!(out.ends_with("{size limit reached}"));
+    assert!(out.len() <= RUST_DEMANGLE_DEFAULT_MAX_OUTPUT + "{size limit reached}".len());
+}
+
+#[test]
+fn memoize_backrefs() {
+    let map = "core::iter::Map<core::filter::Filter<core::slice::iter::Iter<u8>>>";
+    let pair = |x: &str| format!("({}, {})", x, x);
+    let syms = [
+        // The same backref, printed under different binders.
+        (
+            "_RINvC1a1fFG_RL0_hEuFG_Ba_EuFG0_Ba_EuE",
+            "a::f::<for<'a> fn(&'a u8), for<'a> fn(&'a u8), for<'a, 'b> fn(&'b u8)>".to_string(),
+        ),
+        // The same backref, first printed shallower than the depth limit.
+        (
+            "_RINvC1a1fRRaB7_RRRRB7_E",
+            "a::f::<&&i8, &&i8, &&&&&&i8>".to_string(),
+        ),
+        // Like the above, but the limit may be hit inside a nested backref.
+        (
+            "_RINvC1a1fRRaTB7_ERRRRBa_Ba_E",
+            "a::f::<&&i8, (&&i8,), &&&&(&&i8,), (&&i8,)>".to_string(),
+        ),
+        // Each tuple refers to the previous one twice.
+        (
+            "_RINvC1a1fINtNtCs1234_4core4iter3MapINtNtBc_6filter6FilterINtNtNtBc_5slice4iter4IterhEEETB7_B7_ETB1n_B1n_ETB1v_B1v_EE",
+            format!(
+                "a::f::<{}, {}, {}, {}>",
+                map,
+                pair(map),
+                pair(&pair(map)),
+                pair(&pair(&pair(map)))
+            ),
+        ),
+    ];
+    for (sym, expected) in syms {
+        // Also checks the C port against `rustc-demangle`.
+        assert_eq!(
+            format!("{:#}", rust_demangle_c_test_harness::demangle(sym)),
+            expected
+        );
+        let memoized = RustDemangleOptions {
+            flags: RUST_DEMANGLE_FLAG_MEMOIZE_BACKREFS,
+            ..Default::default()
+        };
+        assert_eq!(
+            demangle_with_options(sym, memoized),
+            (RustDemangleStatus::Ok, expected)
+        );
+
+        // Memoization must not change where any of the limits are hit.
+        for max_depth in 1..12 {
+            for max_output in 1..sym.len() * 4 {
+                let options = RustDemangleOptions {
+                    flags: 0,
+                    max_depth,
+                    max_output,
+                    ..Default::default()
+                };
+                let memoized = RustDemangleOptions {
+                    flags: RUST_DEMANGLE_FLAG_MEMOIZE_BACKREFS,
+                    ..options
+                };
+                assert_eq!(
+                    demangle_with_options(sym, memoized),
+                    demangle_with_options(sym, options),
+                    "{} (max_depth={}, max_output={})",
+                    sym,
+                    max_depth,
+                    max_output
+                );
+            }
+        }
+    }
+}
+
+#[test]
+fn punycode() {
+    // Invalid punycode is printed back (in its standard form) instead.
+    for (sym, expected) in [
+        ("_RNvC1au6ab_99z", "a::a\u{2a04}b"),
+        ("_RNvC1au4ab_9", "a::punycode{ab-9}"),
+        ("_RNvC1au5ab_zz", "a::punycode{ab-zz}"),
+    ] {
+        assert_eq!(
+            format!("{:#}", rust_demangle_c_test_harness::demangle(sym)),
+            expected
+        );
+    }
+
+    // Unlike `rustc-demangle`, the C port can also decode punycode which is
+    // too long for a fixed-size buffer (by falling back to the heap).
+    let ident = format!("{}_a", "a".repeat(200));
+    let sym = std::ffi::CString::new(format!("_RNvC1au{}{}", ident.len(), ident)).unwrap();
+    let out = unsafe { rust_demangle(sym.as_ptr(), 0) };
+    assert!(!out.is_null());
+    let demangled = unsafe { CStr::from_ptr(out) }.to_str().unwrap().to_string();
+    unsafe { free(out) };
+    assert_eq!(demangled, format!("a::\u{80}{}", "a".repeat(200)));
+}
+
+#[test]
+fn partial_paths() {
+    const CRATE: i32 = RUST_DEMANGLE_FLAG_CRATE_ONLY;
+    const LEAF: i32 = RUST_DEMANGLE_FLAG_LEAF_ONLY;
+    const NO_GENERICS: i32 = RUST_DEMANGLE_FLAG_NO_GENERICS;
+
+    let demangle = |mangled: &str, flags: i32| {
+        let options = RustDemangleOptions {
+            flags,
+            ..Default::default()
+        };
+        match demangle_with_options(mangled, options) {
+            (RustDemangleStatus::Failed, _) => None,
+            (_, out) => Some(out),
+        }
+    };
+
+    for (mangled, crate_only, leaf_only, both, no_generics) in [
+        (
+            "_ZN4core3ptr13drop_in_place17h05af221e174051e9E.cold",
+            "core",
+            "drop_in_place",
+            "core::drop_in_place",
+            "core::ptr::drop_in_place.cold",
+        ),
+        ("_ZN3fooE", "foo", "foo", "foo", "foo"),
+        (
+            "_RNvNtCsbmNqQUJIY6D_4core3foo3bar.cold",
+            "core",
+            "bar",
+            "core::bar",
+            "core::foo::bar.cold",
+        ),
+        (
+            "_RINvNtC3std3mem8align_ofINtC3std3VecdEE",
+            "std",
+            "align_of",
+            "std::align_of",
+            "std::mem::align_of",
+        ),
+        (
+            "_RNCNvNtCsbmNqQUJIY6D_4core3foo3bar0B4_",
+            "core",
+            "{closure#0}",
+            "core::{closure#0}",
+            "core::foo::bar::{closure#0}",
+        ),
+        // `impl` items are attributed to the crate of the `impl`.
+        (
+            "_RNvMNtC5alloc3vecINtB2_3VecNtC4core3FooE3new",
+            "alloc",
+            "new",
+            "alloc::new",
+            "<alloc::vec::Vec>::new",
+        ),
+        (
+            "_RNvXNtC5alloc3vecNtC4core3FooNtNtBh_3fmt5Debug3fmt",
+            "alloc",
+            "fmt",
+            "alloc::fmt",
+            "<core::Foo as core::fmt::Debug>::fmt",
+        ),
+        // `<T as Trait>` paths don't have an `impl`, so the trait is used.
+        (
+            "_RNvYNtC3foo3BarNtC3baz5Trait4meth",
+            "baz",
+            "meth",
+            "baz::meth",
+            "<foo::Bar as baz::Trait>::meth",
+        ),
+        // Backrefs leading to the crate root are still followed.
+        (
+            "_RNvYNtC3foo3BarNtB4_5Trait4meth",
+            "foo",
+            "meth",
+            "foo::meth",
+            "<foo::Bar as foo::Trait>::meth",
+        ),
+    ] {
+        assert_eq!(demangle(mangled, CRATE).as_deref(), Some(crate_only));
+        assert_eq!(demangle(mangled, LEAF).as_deref(), Some(leaf_only));
+        assert_eq!(demangle(mangled, CRATE | LEAF).as_deref(), Some(both));
+        assert_eq!(demangle(mangled, NO_GENERICS).as_deref(), Some(no_generics));
+    }
+
+    // The rest of the symbol is still validated (but without following the
+    // backrefs in it, like errors in them don't affect full demangling).
+    assert_eq!(demangle("_RNvNtC4core3foo3bar$", CRATE), None);
+    assert_eq!(demangle("_RINvC1a1faB8_E", LEAF), None);
+    assert_eq!(
+        demangle("_RINvC1a1fRRaRRB7_E", NO_GENERICS).as_deref(),
+        Some("a::f")
+    );
+
+    for sym in symbols(17, Shape::default(), 300) {
+        for mangled in [&sym.legacy, &sym.v0, &sym.v0_compressed] {
+            let full = demangle(mangled, 0).unwrap();
+            for flags in [CRATE, LEAF, CRATE | LEAF, NO_GENERICS] {
+                let partial = demangle(mangled, flags).unwrap();
+                assert!(partial.len() <= full.len(), "{}", mangled);
+            }
+            assert!(!demangle(mangled, NO_GENERICS).unwrap().contains("::<"));
+        }
+    }
+}
+
+#[test]
+fn generic_limits() {
+    let demangle = |mangled: &str, max_generic_depth: usize, max_generic_args: usize| {
+        let options = RustDemangleOptions {
+            max_generic_depth,
+            max_generic_args,
+            ..Default::default()
+        };
+        match demangle_with_options(mangled, options) {
+            (RustDemangleStatus::Failed, _) => None,
+            (_, out) => Some(out),
+        }
+    };
+
+    let nested = "_RINvC1a1fINtC1b3MapINtBa_6FilterhEmEE";
+    assert_eq!(
+        demangle(nested, 0, 0).as_deref(),
+        Some("a::f::<b::Map<b::Filter<u8>, u32>>")
+    );
+    assert_eq!(demangle(nested, 1, 0).as_deref(), Some("a::f::<b::Map<…>>"));
+    assert_eq!(
+        demangle(nested, 2, 0).as_deref(),
+        Some("a::f::<b::Map<b::Filter<…>, u32>>")
+    );
+    assert_eq!(
+        demangle(nested, 0, 1).as_deref(),
+        Some("a::f::<b::Map<b::Filter<u8>, …>>")
+    );
+
+    let many = "_RINvC1a1fhtmyE";
+    assert_eq!(demangle(many, 0, 2).as_deref(), Some("a::f::<u8, u16, …>"));
+    assert_eq!(
+        demangle(many, 0, 4).as_deref(),
+        Some("a::f::<u8, u16, u32, u64>")
+    );
+
+    // `dyn Trait` bindings are part of the same list as its generic args.
+    let dyn_trait = "_RINvC1a1fDINtC1b5TraitmtEp4Itemhp3FooaEL_E";
+    assert_eq!(
+        demangle(dyn_trait, 1, 0).as_deref(),
+        Some("a::f::<dyn b::Trait<…>>")
+    );
+    assert_eq!(
+        demangle(dyn_trait, 0, 3).as_deref(),
+        Some("a::f::<dyn b::Trait<u32, u16, Item = u8, …>>")
+    );
+
+    // An error in a backref doesn't leave a collapsed list behind (here, the
+    // backref is into the crate name, read as a `dyn` type erroring at `pZ`).
+    let dyn_error = "_RINvC14DNtC1b1Tp1XhpZ1fB5_hE";
+    assert_eq!(
+        demangle(dyn_error, 0, 0).as_deref(),
+        Some(
+            "DNtC1b1Tp1XhpZ::f::<dyn b::T<X = u8, {invalid syntax}\
+             {invalid syntax}, u8>"
+        )
+    );
+    assert_eq!(
+        demangle(dyn_error, 1, 0).as_deref(),
+        Some("DNtC1b1Tp1XhpZ::f::<dyn b::T<…, u8>")
+    );
+    assert_eq!(
+        demangle(dyn_error, 0, 1).as_deref(),
+        Some("DNtC1b1Tp1XhpZ::f::<dyn b::T<X = u8, …, …>")
+    );
+
+    // An ellipsis which doesn't fit ends the output, like anything else.
+    let options = RustDemangleOptions {
+        max_output: 12,
+        max_generic_args: 1,
+        ..Default::default()
+    };
+    assert_eq!(
+        demangle_with_options("_RINvC1a1fRuRuE", options),
+        (
+            RustDemangleStatus::TooBig,
+            "a::f::<&(){size limit reached}".to_string()
+        )
+    );
+
+    // Limits apply the same way with memoized backrefs, and events are
+    // still well-formed.
+    for sym in symbols(19, Shape::default(), 300) {
+        for mangled in [&sym.v0, &sym.v0_compressed] {
+            for (max_generic_depth, max_generic_args) in [(1, 0), (2, 1), (0, 2)] {
+                let mut options = RustDemangleOptions {
+                    max_generic_depth,
+                    max_generic_args,
+                    ..Default::default()
+                };
+                let out = demangle_with_options(mangled, options);
+                options.flags = RUST_DEMANGLE_FLAG_MEMOIZE_BACKREFS;
+                assert_eq!(demangle_with_options(mangled, options), out);
+                options.flags = 0;
+                assert_eq!(demangle_events(mangled, options).unwrap().0, out.1);
+            }
+        }
+    }
+}
+
+/// Demangle with `rust_demangle_with_events`, checking that the events are
+/// well-formed (and that the output is unaffected), and rendering them as a
+/// tree, with leaves showing their output (e.g. `crate[std]`).
+fn demangle_events(mangled: &str, options: RustDemangleOptions) -> Option<(String, String)> {
+    type State = (Vec<u8>, Vec<RustDemangleEvent>);
+    unsafe extern "C" fn callback(data: *const c_char, len: usize, opaque: *mut c_void) {
+        let (out, _) = &mut *(opaque as *mut State);
+        out.extend_from_slice(std::slice::from_raw_parts(data as *const u8, len));
+    }
+    unsafe extern "C" fn on_event(event: *const RustDemangleEvent, opaque: *mut c_void) {
+        let (_, events) = &mut *(opaque as *mut State);
+        events.push(*event);
+    }
+
+    let mut state: State = (vec![], vec![]);
+    let status = unsafe {
+        rust_demangle_with_events(
+            mangled.as_ptr() as *const c_char,
+            mangled.len(),
+            &options,
+            Some(callback),
+            Some(on_event),
+            &mut state as *mut _ as *mut c_void,
+        )
+    };
+    if status == RustDemangleStatus::Failed {
+        return None;
+    }
+    let (out, events) = state;
+    let out = String::from_utf8(out).unwrap();
+    assert_eq!(
+        demangle_with_options(mangled, options),
+        (status, out.clone())
+    );
+
+    use RustDemangleEventKind::*;
+    let mut tree = vec![];
+    let mut open: Vec<RustDemangleEvent> = vec![];
+    for event in events {
+        assert!(event.mangled_start <= event.mangled_end && event.mangled_end <= mangled.len());
+        assert!(event.output_start <= event.output_end && event.output_end <= out.len());
+        let tag = match event.tag as u8 {
+            0 => '0',
+            tag => tag as char,
+        };
+        let text = &out[event.output_start..event.output_end];
+        let name = match event.kind {
+            BeginPath | BeginType | BeginConst | BeginGenerics => {
+                assert_eq!(event.mangled_start, event.mangled_end);
+                assert_eq!(event.output_start, event.output_end);
+                open.push(event);
+                tree.push(format!(
+                    "{}:{}(",
+                    match event.kind {
+                        BeginPath => "path",
+                        BeginType => "type",
+                        BeginConst => "const",
+                        _ => "generics",
+                    },
+                    tag
+                ));
+                continue;
+            }
+            EndPath | EndType | EndConst | EndGenerics => {
+                let begin = open.pop().unwrap();
+                assert_eq!(begin.kind as u32 + 1, event.kind as u32);
+                assert_eq!(begin.tag, event.tag);
+                assert_eq!(begin.output_start, event.output_start);
+
+                // Only ended after leaving the backref it was begun in,
+                // so shown with the syntax from that backref onwards.
+                if begin.mangled_start != event.mangled_start {
+                    assert!(begin.mangled_start < event.mangled_start);
+                    assert_eq!(mangled.as_bytes()[event.mangled_start], b'B');
+                    tree.push(format!(
+                        ")@{}",
+                        &mangled[event.mangled_start..event.mangled_end]
+                    ));
+                } else {
+                    tree.push(")".to_string());
+                }
+                continue;
+            }
+            Crate => "crate".to_string(),
+            Namespace => format!("ns:{}", tag),
+            Lifetime => "lifetime".to_string(),
+            Binder => "binder".to_string(),
+        };
+        tree.push(format!("{}[{}]", name, text));
+    }
+    assert!(open.is_empty());
+
+    let tree = tree.join(" ").replace("( ", "(").replace(" )", ")");
+    Some((out, tree))
+}
+
+#[test]
+fn events() {
+    for (sym, expected_out, expected_tree) in [
+        (
+            "_ZN4core3ptr13drop_in_place17h0123456789abcdefE",
+            "core::ptr::drop_in_place",
+            "path:0(crate[core] ns:0[ptr] ns:0[drop_in_place])",
+        ),
+        (
+            "_RNCNvCs1234_3foo3bar0B3_",
+            "foo::bar::{closure#0}",
+            "path:N(path:N(path:C(crate[foo]) ns:v[bar]) ns:C[])",
+        ),
+        (
+            "_RNvMNtC1a1bINtB2_3FooFG_RL0_hEuE3new",
+            "<a::b::Foo<for<'a> fn(&'a u8)>>::new",
+            "path:N(path:M(type:I(path:I(path:N(path:N(path:C(crate[a]) ns:t[b]) \
+             ns:t[Foo]) generics:I(type:F(binder[for<'a> ] type:R(lifetime['a] \
+             type:h())))))) ns:v[new])",
+        ),
+        (
+            "_RINvC1a1fDNtC1b1Tp1XhEL_KRe616263_E",
+            "a::f::<dyn b::T<X = u8>, \"abc\">",
+            "path:I(path:N(path:C(crate[a]) ns:v[f]) generics:I(type:D(path:N(\
+             path:C(crate[b]) ns:t[T]) generics:p(type:h())) const:R()))",
+        ),
+        (
+            "_RINvC1a1fINtC1b1TtEDB7_p1XhEL_E",
+            "a::f::<b::T<u16>, dyn b::T<u16, X = u8>>",
+            "path:I(path:N(path:C(crate[a]) ns:v[f]) generics:I(type:I(path:I(\
+             path:N(path:C(crate[b]) ns:t[T]) generics:I(type:t()))) type:D(\
+             path:I(path:N(path:C(crate[b]) ns:t[T]) generics:I(type:t() \
+             type:h())@B7_p1Xh)@B7_p1Xh)))",
+        ),
+    ] {
+        assert_eq!(
+            demangle_events(sym, RustDemangleOptions::default()),
+            Some((expected_out.to_string(), expected_tree.to_string())),
+            "{}",
+            sym
+        );
+    }
+
+    // Backrefs are followed, and anything left open by an error in one
+    // (here, hitting the depth limit) is ended by whatever encloses it, with
+    // the syntax from the backref onwards.
+    let options = RustDemangleOptions {
+        max_depth: 6,
+        ..Default::default()
+    };
+    assert_eq!(
+        demangle_events("_RINvC1a1fRRaRRB7_E", options),
+        Some((
+            "a::f::<&&i8, &&&{recursion limit reached}>".to_string(),
+            "path:I(path:N(path:C(crate[a]) ns:v[f]) generics:I(type:R(type:R(\
+             type:a())) type:R(type:R(type:R(type:R()@B7_)@B7_))))"
+                .to_string()
+        ))
+    );
+
+    for sym in symbols(7, Shape::default(), 1000) {
+        for mangled in [&sym.legacy, &sym.v0, &sym.v0_compressed] {
+            for flags in [0, RUST_DEMANGLE_FLAG_VERBOSE] {
+                for max_output in [0, 40] {
+                    let options = RustDemangleOptions {
+                        flags,
+                        max_output,
+                        ..Default::default()
+                    };
+                    assert!(demangle_events(mangled, options).is_some());
+                }
+            }
+        }
+    }
+}
+
+fn classify(mangled: &str) -> RustDemangleScheme {
+    unsafe { rust_demangle_classify(mangled.as_ptr() as *const c_char, mangled.len()) }
+}
+
+fn demangles(mangled: &str) -> bool {
+    let out = unsafe { rust_demangle_n(mangled.as_ptr() as *const c_char, mangled.len(), 0) };
+    unsafe { free(out) };
+    !out.is_null()
+}
+
+#[test]
+fn classify_scheme() {
+    assert_eq!(classify("_ZN3foo3barE"), RustDemangleScheme::Legacy);
+    assert_eq!(classify("__ZN3foo3barE"), RustDemangleScheme::Legacy);
+    assert_eq!(
+        classify("_ZN3foo3barE.llvm.1234"),
+        RustDemangleScheme::Legacy
+    );
+    assert_eq!(classify("_RNvC6_123foo3bar"), RustDemangleScheme::V0);
+    assert_eq!(classify("RNvC6_123foo3bar"), RustDemangleScheme::V0);
+
+    // Backrefs are only followed for printing, so errors in them don't count.
+    assert_eq!(classify("_RINvC1a1fRRaRRB7_E"), RustDemangleScheme::V0);
+
+    // Invalid punycode is still printed (as `punycode{...}`).
+    assert_eq!(classify("_RNvC1a3u1_a"), RustDemangleScheme::V0);
+
+    for not_rust in [
+        "",
+        "main",
+        "_Z3foov",
+        "_ZNSt6vectorIiSaIiEE9push_backERKi",
+        "_ZN3foo3bar",
+        "_RNvC6_123foo",
+        "_RINvC1a1faB8_E",
+        "_RNvC6_123foo3bar$",
+    ] {
+        assert_eq!(classify(not_rust), RustDemangleScheme::None, "{}", not_rust);
+        assert!(!demangles(not_rust), "{}", not_rust);
+    }
+
+    // Always agrees with demangling (including for every truncation).
+    for sym in symbols(13, Shape::default(), 300) {
+        assert_eq!(classify(&sym.legacy), RustDemangleScheme::Legacy);
+        assert_eq!(classify(&sym.v0), RustDemangleScheme::V0);
+        assert_eq!(classify(&sym.v0_compressed), RustDemangleScheme::V0);
+        for mangled in [&sym.legacy, &sym.v0_compressed] {
+            for len in 0..mangled.len() {
+                let truncated = &mangled[..len];
+                let expected = classify(truncated) != RustDemangleScheme::None;
+                assert_eq!(demangles(truncated), expected, "{}", truncated);
+            }
+        }
+    }
+}
+
+fn fingerprint(mangled: &str, flags: i32) -> Option<u64> {
+    let mut fingerprint = u64::MAX;
+    let success = unsafe {
+        rust_demangle_fingerprint(
+            mangled.as_ptr() as *const c_char,
+            mangled.len(),
+            flags,
+            &mut fingerprint,
+        )
+    };
+    if !success {
+        assert_eq!(fingerprint, 0);
+        return None;
+    }
+    Some(fingerprint)
+}
+
+#[test]
+fn fingerprints() {
+    fn fnv1a(data: &[u8]) -> u64 {
+        data.iter().fold(0xcbf29ce484222325, |hash, &b| {
+            (hash ^ b as u64).wrapping_mul(0x100000001b3)
+        })
+    }
+
+    // Hashes which change between builds are ignored.
+    let legacy = fingerprint("_ZN4core3foo3bar17h05af221e174051e9E", 0);
+    assert_eq!(legacy, Some(fnv1a(b"core::foo::bar")));
+    assert_eq!(
+        fingerprint("_ZN4core3foo3bar17h1234567890abcdefE", 0),
+        legacy
+    );
+    assert_eq!(
+        fingerprint("_ZN4core3foo3bar17h05af221e174051e9E.llvm.1234", 0),
+        legacy
+    );
+    let v0 = fingerprint("_RNvNtCsbmNqQUJIY6D_4core3foo3bar", 0);
+    assert_eq!(v0, legacy);
+    assert_eq!(fingerprint("_RNvNtCs1234_4core3foo3bar", 0), v0);
+    assert_eq!(
+        fingerprint("_RNvNtCs1234_4core3foo3bar", RUST_DEMANGLE_FLAG_VERBOSE),
+        v0
+    );
+
+    // Anything else still matters (including other suffixes).
+    assert_ne!(fingerprint("_RNvNtCs1234_4core3foo3baz", 0), v0);
+    assert_ne!(fingerprint("_RNvNtCs1234_4core3foo3bar.cold", 0), v0);
+    assert_eq!(fingerprint("_RNvNtCs1234_4core3foo", 0), None);
+
+    // Always the same as hashing the output (even when it's long enough to
+    // be passed to the callback in many chunks).
+    let mut corpus = vec![format!("_RNvC1a{}{}", 9000, "b".repeat(9000))];
+    for sym in symbols(23, Shape::default(), 300) {
+        corpus.extend([sym.legacy, sym.v0, sym.v0_compressed]);
+    }
+    for mangled in &corpus {
+        for flags in [
+            0,
+            RUST_DEMANGLE_FLAG_MEMOIZE_BACKREFS,
+            RUST_DEMANGLE_FLAG_NO_GENERICS,
+        ] {
+            let out =
+                unsafe { rust_demangle_n(mangled.as_ptr() as *const c_char, mangled.len(), flags) };
+            assert!(!out.is_null());
+            let expected = fnv1a(unsafe { CStr::from_ptr(out) }.to_bytes());
+            unsafe { free(out) };
+            assert_eq!(fingerprint(mangled, flags), Some(expected), "{}", mangled);
+        }
+    }
+}
+
+fn ctx_demangle(ctx: *mut RustDemangleCtx, mangled: &str) -> Option<String> {
+    let mut len = usize::MAX;
+    let out = unsafe {
+        rust_demangle_ctx_demangle(
+            ctx,
+            mangled.as_ptr() as *const c_char,
+            mangled.len(),
+            &mut len,
+        )
+    };
+    if out.is_null() {
+        assert_eq!(len, 0);
+        return None;
+    }
+    let out = unsafe { CStr::from_ptr(out) }.to_str().unwrap();
+    assert_eq!(out.len(), len);
+    Some(out.to_string())
+}
+
+fn ctx_stats(ctx: *const RustDemangleCtx) -> RustDemangleCtxStats {
+    let mut stats = RustDemangleCtxStats::default();
+    unsafe { rust_demangle_ctx_get_stats(ctx, &mut stats) };
+    stats
+}
+
+#[test]
+fn ctx() {
+    let mut corpus = vec![
+        "_RNvNtCsbmNqQUJIY6D_4core3foo3bar".to_string(),
+        "not a symbol".to_string(),
+        // Long punycode (decoded in the scratch space, not on the stack).
+        format!("_RNvC1au{}{}_a", 202, "a".repeat(200)),
+    ];
+    for sym in symbols(29, Shape::default(), 300) {
+        corpus.extend([sym.legacy, sym.v0, sym.v0_compressed]);
+    }
+
+    for options in [
+        RustDemangleOptions::default(),
+        RustDemangleOptions {
+            flags: RUST_DEMANGLE_FLAG_MEMOIZE_BACKREFS | RUST_DEMANGLE_FLAG_VERBOSE,
+            ..Default::default()
+        },
+        RustDemangleOptions {
+            max_output: 20,
+            max_generic_args: 1,
+            ..Default::default()
+        },
+    ] {
+        let ctx = unsafe { rust_demangle_ctx_new(&options, 64) };
+        assert!(!ctx.is_null());
+        let initial = ctx_stats(ctx);
+        assert_eq!(initial.symbols, 0);
+        assert_eq!(initial.allocations, 0);
+        assert!(initial.reserved_bytes > 64, "{:?}", initial);
+
+        // Always the same output as demangling each symbol on its own.
+        for mangled in &corpus {
+            let (status, expected) = demangle_with_options(mangled, options);
+            let expected = if status == RustDemangleStatus::Failed {
+                None
+            } else {
+                Some(expected)
+            };
+            assert_eq!(ctx_demangle(ctx, mangled), expected, "{}", mangled);
+        }
+        let stats = ctx_stats(ctx);
+        assert_eq!(stats.symbols, corpus.len());
+        assert!(stats.allocations > 0, "{:?}", stats);
+        assert!(stats.reserved_bytes > initial.reserved_bytes, "{:?}", stats);
+
+        // Once grown large enough, there are no more allocations.
+        for mangled in &corpus {
+            ctx_demangle(ctx, mangled);
+        }
+        let again = ctx_stats(ctx);
+        assert_eq!(again.symbols, 2 * corpus.len());
+        assert_eq!(again.allocations, stats.allocations);
+        assert_eq!(again.peak_output, stats.peak_output);
+        assert_eq!(again.reserved_bytes, stats.reserved_bytes);
+
+        // Resetting goes back to only the space reserved upfront.
+        unsafe { rust_demangle_ctx_reset(ctx) };
+        let reset = ctx_stats(ctx);
+        assert_eq!(reset.symbols, 0);
+        assert_eq!(reset.allocations, 0);
+        assert_eq!(reset.peak_output, 0);
+        assert_eq!(reset.reserved_bytes, initial.reserved_bytes);
+        assert_eq!(
+            ctx_demangle(ctx, &corpus[0]),
+            Some(demangle_with_options(&corpus[0], options).1)
+        );
+        assert_eq!(ctx_stats(ctx).allocations, 0);
+
+        unsafe { rust_demangle_ctx_free(ctx) };
+    }
+}
@@ -0,0 +1,227 @@
+//! Tests for the `rust-demangle-cache.c` companion module.
+
+use rust_demangle_c_test_harness::ffi::*;
+use std::os::raw::c_char;
+
+struct Cache(*mut RustDemangleCache);
+
+impl Cache {
+    fn new(max_bytes: usize, flags: i32) -> Self {
+        let cache = unsafe { rust_demangle_cache_new(max_bytes, flags) };
+        assert!(!cache.is_null());
+        Cache(cache)
+    }
+
+    fn lookup(&mut self, mangled: &str) -> Option<String> {
+        let mut len = usize::MAX;
+        let out = unsafe {
+            rust_demangle_cache_lookup(
+                self.0,
+                mangled.as_ptr() as *const c_char,
+                mangled.len(),
+                &mut len,
+            )
+        };
+        if out.is_null() {
+            return None;
+        }
+        let out = unsafe { std::slice::from_raw_parts(out as *const u8, len + 1) };
+        assert_eq!(out[len], 0);
+        Some(String::from_utf8(out[..len].to_vec()).unwrap())
+    }
+
+    fn stats(&self) -> RustDemangleCacheStats {
+        let mut stats = RustDemangleCacheStats::default();
+        unsafe { rust_demangle_cache_get_stats(self.0, &mut stats) };
+        stats
+    }
+}
+
+impl Drop for Cache {
+    fn drop(&mut self) {
+        unsafe { rust_demangle_cache_free(self.0) };
+    }
+}
+
+fn sym(i: usize) -> String {
+    let ident = format!("function{}", i);
+    format!("_ZN5crate{}{}17h05af221e174051e9E", ident.len(), ident)
+}
+
+#[test]
+fn hits_and_misses() {
+    let mut cache = Cache::new(1 << 20, 0);
+
+    for _ in 0..3 {
+        assert_eq!(cache.lookup("_ZN3foo3barE").as_deref(), Some("foo::bar"));
+        assert_eq!(
+            cache.lookup("_RNvNtCsbmNqQUJIY6D_4core3foo3bar").as_deref(),
+            Some("core::foo::bar")
+        );
+        assert_eq!(cache.lookup("_ZN3foo3bar"), None);
+        assert_eq!(cache.lookup(""), None);
+    }
+
+    let stats = cache.stats();
+    assert_eq!((stats.hits, stats.misses, stats.evictions), (8, 4, 0));
+    assert_eq!(stats.entries, 4);
+    assert!(stats.bytes <= 1 << 20);
+
+    // The cache is keyed by the exact bytes, not a NUL-terminated prefix.
+    assert_eq!(cache.lookup("_ZN3foo3barE_").as_deref(), None);
+    assert_eq!(cache.lookup(&"_ZN3foo3barE"[..10]), None);
+    assert_eq!(cache.stats().misses, 6);
+
+    let mut verbose = Cache::new(1 << 20, 1);
+    assert_eq!(
+        verbose.lookup(&sym(0)).as_deref(),
+        Some("crate::function0::h05af221e174051e9")
+    );
+}
+
+#[test]
+fn eviction() {
+    // Too small to hold all of the symbols.
+    let max_bytes = 16 << 10;
+    let mut cache = Cache::new(max_bytes, 0);
+
+    for round in 0..3 {
+        for i in 0..1000 {
+            assert_eq!(
+                cache.lookup(&sym(i)).unwrap(),
+                format!("crate::function{}", i)
+            );
+
+            // Keep one symbol "hot", so it should never get evicted.
+            assert_eq!(cache.lookup(&sym(0)).unwrap(), "crate::function0");
+
+            let stats = cache.stats();
+            assert!(
+                stats.bytes <= max_bytes,
+                "round={} i={}: {:?}",
+                round,
+                i,
+                stats
+            );
+        }
+    }
+
+    let stats = cache.stats();
+    assert!(stats.evictions > 0);
+    assert!(stats.entries > 10);
+    assert_eq!(stats.hits + stats.misses, 6000);
+    assert_eq!(stats.misses, stats.entries + stats.evictions);
+    assert!(stats.hits >= 3000 - 1);
+
+    // Too small to hold anything at all, but still usable.
+    let mut tiny = Cache::new(0, 0);
+    assert_eq!(tiny.lookup(&sym(1)).as_deref(), Some("crate::function1"));
+    assert_eq!(tiny.lookup(&sym(1)).as_deref(), Some("crate::function1"));
+    assert_eq!(tiny.stats().entries, 0);
+}
+
+#[cfg(unix)]
+#[test]
+fn shared() {
+    struct SharedCache(*mut RustDemangleSharedCache);
+    unsafe impl Sync for SharedCache {}
+
+    impl SharedCache {
+        fn lookup(&self, mangled: &str) -> Option<String> {
+            // Deliberately small, to also exercise truncation.
+            let mut buf = [0u8; 24];
+            let mut needed = usize::MAX;
+            let success = unsafe {
+                rust_demangle_shared_cache_lookup_into(
+                    self.0,
+                    mangled.as_ptr() as *const c_char,
+                    mangled.len(),
+                    buf.as_mut_ptr() as *mut c_char,
+                    buf.len(),
+                    &mut needed,
+                )
+            };
+            let len = buf.iter().position(|&b| b == 0).unwrap();
+            assert_eq!(len, needed.min(buf.len() - 1));
+            if !success {
+                assert_eq!(needed, 0);
+                return None;
+            }
+            Some(String::from_utf8(buf[..len].to_vec()).unwrap())
+        }
+    }
+
+    impl Drop for SharedCache {
+        fn drop(&mut self) {
+            unsafe { rust_demangle_shared_cache_free(self.0) };
+        }
+    }
+
+    // Small enough to force evictions.
+    let max_bytes = 64 << 10;
+    let cache = SharedCache(unsafe { rust_demangle_shared_cache_new(max_bytes, 8, 0) });
+    assert!(!cache.0.is_null());
+
+    std::thread::scope(|s| {
+        for t in 0..8 {
+            let cache = &cache;
+            s.spawn(move || {
+                for round in 0..3 {
+                    for i in 0..2000 {
+                        // Threads overlap, but start from different symbols.
+                        let i = (i + t * 250) % 2000;
+                        let expected = format!("crate::function{}", i);
+                        let expected = &expected[..expected.len().min(23)];
+                        assert_eq!(cache.lookup(&sym(i)).as_deref(), Some(expected));
+                        if i % 10 == round {
+                            assert_eq!(cache.lookup("_ZN3foo3bar"), None);
+                        }
+                    }
+                }
+            });
+        }
+    });
+
+    let mut stats = RustDemangleCacheStats::default();
+    unsafe { rust_demangle_shared_cache_get_stats(cache.0, &mut stats) };
+    assert_eq!(stats.hits + stats.misses, 8 * 3 * (2000 + 200));
+    assert!(stats.hits > 0 && stats.evictions > 0);
+    assert!(stats.bytes <= max_bytes);
+}
+
+#[cfg(unix)]
+#[test]
+fn shared_small_budget() {
+    let lookup = |cache: *mut RustDemangleSharedCache, mangled: &str| {
+        let mut buf = [0u8; 64];
+        let success = unsafe {
+            rust_demangle_shared_cache_lookup_into(
+                cache,
+                mangled.as_ptr() as *const c_char,
+                mangled.len(),
+                buf.as_mut_ptr() as *mut c_char,
+                buf.len(),
+                std::ptr::null_mut(),
+            )
+        };
+        assert!(success);
+    };
+
+    // Too small for the default number of shards to each get a usable part
+    // of it, and shard counts too large for any budget, only use fewer.
+    for (max_bytes, num_shards) in [(32 << 10, 0), (1 << 20, usize::MAX)] {
+        let cache = unsafe { rust_demangle_shared_cache_new(max_bytes, num_shards, 0) };
+        assert!(!cache.is_null());
+        for _ in 0..2 {
+            for i in 0..50 {
+                lookup(cache, &sym(i));
+            }
+        }
+
+        let mut stats = RustDemangleCacheStats::default();
+        unsafe { rust_demangle_shared_cache_get_stats(cache, &mut stats) };
+        assert_eq!((stats.hits, stats.misses), (50, 50));
+        assert!(stats.bytes <= max_bytes);
+        unsafe { rust_demangle_shared_cache_free(cache) };
+    }
+}
@@ -0,0 +1,129 @@
+//! Tests for the `rust-demangle-elf.c` companion module, using the ELF file
+//! of the test binary itself.
+#![cfg(target_os = "linux")]
+
+use rust_demangle_c_test_harness::ffi::*;
+use std::ffi::CStr;
+use std::os::raw::{c_char, c_void};
+
+unsafe extern "C" fn collect(addr: u64, name: *const c_char, len: usize, opaque: *mut c_void) {
+    let syms = &mut *(opaque as *mut Vec<(u64, String)>);
+    let name = std::slice::from_raw_parts(name as *const u8, len);
+    assert_eq!(*name.as_ptr().add(len), 0);
+    syms.push((addr, String::from_utf8_lossy(name).into_owned()));
+}
+
+fn self_exe_symbols(flags: i32) -> Vec<(u64, String)> {
+    let mut syms = vec![];
+    let success = unsafe {
+        rust_demangle_elf_symbols(
+            c"/proc/self/exe".as_ptr(),
+            flags,
+            collect,
+            &mut syms as *mut _ as *mut c_void,
+        )
+    };
+    assert!(success);
+    syms
+}
+
+#[inline(never)]
+fn marker_function_for_elf_tests() -> usize {
+    std::hint::black_box(42)
+}
+
+#[inline(never)]
+fn other_marker_function_for_elf_tests() -> usize {
+    std::hint::black_box(43)
+}
+
+#[test]
+fn symbols_of_self() {
+    let syms = self_exe_symbols(0);
+    assert!(!syms.is_empty());
+
+    let addr_of = |name: &str| {
+        syms.iter()
+            .find(|(_, sym)| sym == name)
+            .unwrap_or_else(|| panic!("demangled symbol `{}` not found", name))
+            .0
+    };
+    // The binary may be loaded anywhere, but the distance is the same.
+    assert_eq!(
+        addr_of("elf::other_marker_function_for_elf_tests")
+            .wrapping_sub(addr_of("elf::marker_function_for_elf_tests")),
+        (other_marker_function_for_elf_tests as usize as u64)
+            .wrapping_sub(marker_function_for_elf_tests as usize as u64)
+    );
+
+    // Nothing that still looks like a Rust symbol should remain.
+    for (_, name) in &syms {
+        assert!(rustc_demangle::try_demangle(name).is_err(), "{}", name);
+    }
+    // Non-Rust symbols are passed through.
+    assert!(syms.iter().any(|(_, name)| name == "main"));
+
+    let verbose = self_exe_symbols(1);
+    assert_eq!(syms.len(), verbose.len());
+    assert!(verbose
+        .iter()
+        .any(|(_, name)| name.starts_with("elf::marker_function_for_elf_tests::h")));
+}
+
+#[test]
+fn table_of_self() {
+    let syms = self_exe_symbols(0);
+
+    let table = unsafe { rust_demangle_elf_table_new(c"/proc/self/exe".as_ptr(), 0) };
+    assert!(!table.is_null());
+    unsafe {
+        let t = &*table;
+        assert_eq!(t.len, syms.len());
+        for (i, (addr, name)) in syms.iter().enumerate() {
+            assert_eq!(*t.addrs.add(i), *addr);
+            let s = CStr::from_ptr(t.names.add(*t.offsets.add(i)));
+            assert_eq!(s.to_string_lossy(), *name);
+        }
+        rust_demangle_elf_table_free(table);
+    }
+}
+
+#[test]
+fn invalid() {
+    let table = unsafe { rust_demangle_elf_table_new(c"/nonexistent".as_ptr(), 0) };
+    assert!(table.is_null());
+    assert_eq!(
+        std::io::Error::last_os_error().kind(),
+        std::io::ErrorKind::NotFound
+    );
+
+    let data = std::fs::read("/proc/self/exe").unwrap();
+    for len in [0, 4, 16, 64] {
+        let mut syms: Vec<(u64, String)> = vec![];
+        let success = unsafe {
+            rust_demangle_elf_symbols_mem(
+                data.as_ptr() as *const c_void,
+                len,
+                0,
+                collect,
+                &mut syms as *mut _ as *mut c_void,
+            )
+        };
+        // The ELF header alone is valid, but its section headers are missing.
+        assert!(!success, "len={}", len);
+        assert!(syms.is_empty());
+    }
+
+    let mut syms: Vec<(u64, String)> = vec![];
+    let success = unsafe {
+        rust_demangle_elf_symbols_mem(
+            data.as_ptr() as *const c_void,
+            data.len(),
+            0,
+            collect,
+            &mut syms as *mut _ as *mut c_void,
+        )
+    };
+    assert!(success);
+    assert_eq!(syms, self_exe_symbols(0));
+}
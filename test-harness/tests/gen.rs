@@ -0,0 +1,82 @@
+//! Tests for the synthetic symbol generator (`gen` module), which also serve
+//! as randomized tests of the C port, against `rustc-demangle`.
+
+use rust_demangle_c_test_harness::demangle;
+use rust_demangle_c_test_harness::gen::{symbols, Shape};
+
+fn check(shape: Shape) {
+    for sym in symbols(0x5eed, shape, 2000) {
+        // `rustc` never leaves braces unescaped in legacy symbols.
+        assert!(!sym.legacy.contains(['{', '}']), "{:?}", sym);
+        if sym.v0.contains("NCNv") {
+            assert!(
+                format!("{:#}", demangle(&sym.legacy)).ends_with("::{{closure}}"),
+                "{:?}",
+                sym
+            );
+        }
+
+        for verbose in [false, true] {
+            let v0 = demangle(&sym.v0).to_string_maybe_verbose(verbose);
+            let v0_compressed = demangle(&sym.v0_compressed).to_string_maybe_verbose(verbose);
+            assert_eq!(v0, v0_compressed, "{:?}", sym);
+            assert_ne!(v0, sym.v0, "{:?}", sym);
+
+            let legacy = demangle(&sym.legacy).to_string_maybe_verbose(verbose);
+            assert_ne!(legacy, sym.legacy, "{:?}", sym);
+        }
+    }
+}
+
+#[test]
+fn default_shape() {
+    check(Shape::default());
+}
+
+#[test]
+fn extreme_shapes() {
+    check(Shape {
+        path_depth: 10,
+        generic_depth: 6,
+        generic_args: 4,
+        backref_density: 0.8,
+        punycode_density: 0.5,
+        const_generic_density: 0.5,
+        closure_density: 0.5,
+        llvm_suffix_density: 0.5,
+    });
+    check(Shape {
+        path_depth: 0,
+        generic_depth: 0,
+        generic_args: 0,
+        backref_density: 0.0,
+        punycode_density: 0.0,
+        const_generic_density: 0.0,
+        closure_density: 0.0,
+        llvm_suffix_density: 0.0,
+    });
+}
+
+#[test]
+fn compression() {
+    let shape = Shape {
+        backref_density: 0.9,
+        generic_depth: 4,
+        ..Shape::default()
+    };
+    let (mut v0_len, mut compressed_len) = (0, 0);
+    for sym in symbols(1, shape, 1000) {
+        v0_len += sym.v0.len();
+        compressed_len += sym.v0_compressed.len();
+    }
+    assert!(compressed_len < v0_len);
+}
+
+#[test]
+fn deterministic() {
+    let a: Vec<_> = symbols(42, Shape::default(), 100).map(|s| s.v0).collect();
+    let b: Vec<_> = symbols(42, Shape::default(), 100).map(|s| s.v0).collect();
+    let c: Vec<_> = symbols(43, Shape::default(), 100).map(|s| s.v0).collect();
+    assert_eq!(a, b);
+    assert_ne!(a, c);
+}
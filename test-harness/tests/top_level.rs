@@ -191,8 +191,6 @@ fn handle_bang() {
     );
 }
 
-// FIXME(eddyb) port recursion limits to C.
-#[ignore = "stack overflow"]
 #[test]
 fn limit_recursion() {
     assert_contains!(
@@ -205,8 +203,6 @@ fn limit_recursion() {
     );
 }
 
-// FIXME(eddyb) port the relevant functionality to C.
-#[ignore = "would slowly use up all RAM before being OOM-killed"]
 #[test]
 fn limit_output_oom_hazard() {
     assert_ends_with!(
@@ -216,8 +212,6 @@ fn limit_output_oom_hazard() {
     );
 }
 
-// FIXME(eddyb) port the relevant functionality to C.
-#[should_panic]
 #[test]
 fn limit_output() {
     // NOTE(eddyb) somewhat reduced version of the above, effectively
@@ -0,0 +1,237 @@
+//! Tests for the `rust-demangle-tree.c` companion module.
+
+use rust_demangle_c_test_harness::ffi::*;
+use rust_demangle_c_test_harness::gen::{symbols, Shape};
+use std::ffi::CStr;
+use std::os::raw::c_char;
+
+struct Tree(*mut RustDemangleTree);
+
+impl Tree {
+    fn new(flags: i32) -> Self {
+        let tree = unsafe { rust_demangle_tree_new(flags) };
+        assert!(!tree.is_null());
+        Tree(tree)
+    }
+
+    fn decode(data: &[u8]) -> Option<Self> {
+        let tree = unsafe { rust_demangle_tree_decode(data.as_ptr() as *const c_char, data.len()) };
+        if tree.is_null() {
+            None
+        } else {
+            Some(Tree(tree))
+        }
+    }
+
+    fn add(&mut self, mangled: &str) -> usize {
+        let index = unsafe {
+            rust_demangle_tree_add(self.0, mangled.as_ptr() as *const c_char, mangled.len())
+        };
+        assert_ne!(index, RUST_DEMANGLE_TREE_FAILED);
+        index
+    }
+
+    fn render_into(&self, index: usize, cap: usize) -> (bool, Vec<u8>, usize) {
+        let mut buf = vec![0xffu8; cap];
+        let mut needed = usize::MAX;
+        let success = unsafe {
+            rust_demangle_tree_render(
+                self.0,
+                index,
+                buf.as_mut_ptr() as *mut c_char,
+                cap,
+                &mut needed,
+            )
+        };
+        (success, buf, needed)
+    }
+
+    fn render(&self, index: usize) -> Option<String> {
+        let (success, _, needed) = self.render_into(index, 0);
+        if !success {
+            assert_eq!(needed, 0);
+            return None;
+        }
+        let (success, buf, needed2) = self.render_into(index, needed + 1);
+        assert!(success);
+        assert_eq!(needed, needed2);
+        let s = CStr::from_bytes_with_nul(&buf).unwrap();
+        Some(s.to_str().unwrap().to_string())
+    }
+
+    fn encode(&self) -> Vec<u8> {
+        let mut len = 0;
+        let data = unsafe { rust_demangle_tree_encode(self.0, &mut len) };
+        assert!(!data.is_null());
+        let encoded = unsafe { std::slice::from_raw_parts(data as *const u8, len) }.to_vec();
+        unsafe { free(data) };
+        encoded
+    }
+
+    fn stats(&self) -> RustDemangleTreeStats {
+        let mut stats = RustDemangleTreeStats::default();
+        unsafe { rust_demangle_tree_get_stats(self.0, &mut stats) };
+        stats
+    }
+}
+
+impl Drop for Tree {
+    fn drop(&mut self) {
+        unsafe { rust_demangle_tree_free(self.0) };
+    }
+}
+
+fn demangle(mangled: &str, flags: i32) -> Option<String> {
+    let out = unsafe { rust_demangle_n(mangled.as_ptr() as *const c_char, mangled.len(), flags) };
+    if out.is_null() {
+        return None;
+    }
+    let s = unsafe { CStr::from_ptr(out) }.to_str().unwrap().to_string();
+    unsafe { free(out) };
+    Some(s)
+}
+
+fn corpus() -> Vec<String> {
+    let mut corpus = vec![
+        "_ZN3foo3barE".to_string(),
+        "_RNvNtCsbmNqQUJIY6D_4core3foo3bar".to_string(),
+        "_RINvC1a1fRRaRRB7_E".to_string(),
+        "_RNvC6_123foo3bar.llvm.1234".to_string(),
+        "not a symbol".to_string(),
+    ];
+    for sym in symbols(11, Shape::default(), 500) {
+        corpus.push(sym.legacy);
+        corpus.push(sym.v0);
+        corpus.push(sym.v0_compressed);
+    }
+    corpus
+}
+
+#[test]
+fn round_trip() {
+    let corpus = corpus();
+    for flags in [0, RUST_DEMANGLE_FLAG_VERBOSE] {
+        let mut tree = Tree::new(flags);
+        for (i, mangled) in corpus.iter().enumerate() {
+            assert_eq!(tree.add(mangled), i);
+        }
+        for (i, mangled) in corpus.iter().enumerate() {
+            assert_eq!(tree.render(i), demangle(mangled, flags), "{}", mangled);
+        }
+        assert_eq!(tree.render(corpus.len()), None);
+
+        let encoded = tree.encode();
+        let decoded = Tree::decode(&encoded).unwrap();
+        assert_eq!(decoded.encode(), encoded);
+        for (i, mangled) in corpus.iter().enumerate() {
+            assert_eq!(decoded.render(i), demangle(mangled, flags), "{}", mangled);
+        }
+
+        // Adding the same symbols in the same order always encodes the same.
+        let mut again = Tree::new(flags);
+        for mangled in &corpus {
+            again.add(mangled);
+        }
+        assert_eq!(again.encode(), encoded);
+    }
+}
+
+#[test]
+fn interning() {
+    let corpus = corpus();
+    let mut tree = Tree::new(0);
+    for mangled in &corpus {
+        tree.add(mangled);
+    }
+    let stats = tree.stats();
+    assert_eq!(stats.symbols, corpus.len());
+
+    // Adding the same symbols again only adds new roots (and no new nodes).
+    for (i, mangled) in corpus.iter().enumerate() {
+        assert_eq!(tree.add(mangled), corpus.len() + i);
+        assert_eq!(tree.render(corpus.len() + i), tree.render(i));
+    }
+    let again = tree.stats();
+    assert_eq!(again.symbols, 2 * corpus.len());
+    assert_eq!(again.nodes, stats.nodes);
+    assert_eq!(again.node_bytes, stats.node_bytes);
+    assert_eq!(again.text_bytes, 2 * stats.text_bytes);
+
+    assert!(stats.node_bytes < stats.text_bytes, "{:?}", stats);
+
+    // Decoded trees intern newly added symbols against existing nodes.
+    let mut decoded = Tree::decode(&tree.encode()).unwrap();
+    decoded.add(&corpus[1]);
+    assert_eq!(decoded.stats().nodes, stats.nodes);
+}
+
+#[test]
+fn shared_paths() {
+    // Many methods of the same generic types, where only the method differs.
+    let mut tree = Tree::new(0);
+    for i in 0..200 {
+        let method = format!("method{}", i);
+        let mangled = format!(
+            "_RNvMCs1234_7mycrateINtNtNtNtCsbmNqQUJIY6D_4core4iter8adapters3map3Map\
+             INtNtNtCs1234_5alloc3vec9into_iter8IntoIterhENCNvCs5678_7mycrate4main0E{}{}",
+            method.len(),
+            method
+        );
+        let index = tree.add(&mangled);
+        assert_eq!(tree.render(index), demangle(&mangled, 0));
+    }
+
+    // Everything other than the method is only kept once.
+    let stats = tree.stats();
+    assert!(stats.node_bytes * 5 < stats.text_bytes, "{:?}", stats);
+}
+
+#[test]
+fn render_truncated() {
+    let mut tree = Tree::new(0);
+    let index = tree.add("_RINvNtC3std3mem8align_ofdE");
+    let expected = "std::mem::align_of::<f64>";
+
+    for cap in 0..expected.len() + 2 {
+        let (success, buf, needed) = tree.render_into(index, cap);
+        assert!(success);
+        assert_eq!(needed, expected.len());
+        if cap > 0 {
+            let len = (cap - 1).min(expected.len());
+            assert_eq!(&buf[..len], &expected.as_bytes()[..len]);
+            assert_eq!(buf[len], 0);
+        }
+    }
+}
+
+#[test]
+fn invalid_encodings() {
+    let mut tree = Tree::new(0);
+    for mangled in corpus().iter().take(50) {
+        tree.add(mangled);
+    }
+    let encoded = tree.encode();
+
+    // Every strict prefix is rejected (as is anything extra at the end).
+    for len in 0..encoded.len() {
+        assert!(Tree::decode(&encoded[..len]).is_none(), "{}", len);
+    }
+    let mut extra = encoded.clone();
+    extra.push(0);
+    assert!(Tree::decode(&extra).is_none());
+
+    // Empty trees are fine (but not without the magic).
+    assert!(Tree::decode(b"RDT1\x00\x00\x00").is_some());
+    assert!(Tree::decode(b"RDT0\x00\x00\x00").is_none());
+
+    // A node referring to itself (or any later node).
+    assert!(Tree::decode(b"RDT1\x00\x01\x01\x01\x01\x01").is_none());
+    assert!(Tree::decode(b"RDT1\x00\x01\x02\x02a\x01\x01").is_some());
+
+    // A root out of bounds, or a text item running past its node.
+    assert!(Tree::decode(b"RDT1\x00\x01\x02\x02a\x01\x02").is_none());
+    assert!(Tree::decode(b"RDT1\x00\x01\x02\x04a\x01\x01").is_none());
+
+    // Overlong varints.
+    assert!(Tree::decode(b"RDT1\x80\x00\x00\x00").is_none());
+}
@@ -276,8 +276,8 @@ fn recursion_limit_leaks() {
     }
 }
 
-// FIXME(eddyb) port recursion limits to C.
-#[ignore = "stack overflow"]
+// FIXME(eddyb) the C port still prints `[0]` disambiguators in verbose mode.
+#[ignore = "verbose output differs from newer rustc-demangle"]
 #[test]
 fn recursion_limit_backref_free_bypass() {
     // NOTE(eddyb) this test checks that long symbols cannot bypass the
@@ -0,0 +1,59 @@
+// `c++filt`-like tool: demangles Rust symbols in its arguments (one per line),
+// or, without arguments, in all the text read from stdin.
+//
+// Build with e.g. `cc -O2 -I. tools/rust-demangle-filt.c rust-demangle.c`.
+
+#include "rust-demangle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void write_stdout(const char *data, size_t len, void *opaque) {
+    (void)opaque;
+    fwrite(data, 1, len, stdout);
+}
+
+int main(int argc, char **argv) {
+    int flags = 0;
+    int i = 1;
+
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose"))
+            flags |= RUST_DEMANGLE_FLAG_VERBOSE;
+        else if (!strcmp(argv[i], "--")) {
+            i++;
+            break;
+        } else {
+            fprintf(stderr, "usage: %s [-v|--verbose] [symbol...]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (i < argc) {
+        for (; i < argc; i++) {
+            // NOTE: the whole output is needed before printing any of it, as
+            // demangling may still fail after producing some output.
+            char *demangled = rust_demangle(argv[i], flags);
+            fputs(demangled ? demangled : argv[i], stdout);
+            putchar('\n');
+            free(demangled);
+        }
+        return 0;
+    }
+
+    struct rust_demangle_filter *filter =
+        rust_demangle_filter_new(flags, write_stdout, NULL);
+    if (!filter) {
+        fputs("rust-demangle-filt: out of memory\n", stderr);
+        return 1;
+    }
+
+    static char buf[1 << 16];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), stdin)) > 0)
+        rust_demangle_filter_write(filter, buf, len);
+    rust_demangle_filter_finish(filter);
+
+    return ferror(stdin) ? 1 : 0;
+}